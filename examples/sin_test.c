@@ -7,7 +7,7 @@
 void print_m (matrix_t* m) {
 	for (int i = 0; i < m->rows; i++) {
 		for (int j = 0; j < m->columns; j++) {
-			printf("%lf ", m->matrix[i][j]);
+			printf("%lf ", MATRIX_AT(m, i, j));
 		}
 		printf("\n");
 	}
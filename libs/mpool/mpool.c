@@ -180,15 +180,14 @@ static mpool_error _add_to_unused_list(struct _block* new_block, struct mpool* p
 #endif
 	
 	mpool_error err = _insert_block_list(new_block, &pool->unused_blocks);
+	if (err == MPOOL_SUCCESS)
+		pool->unused_block_list_size++;
 
 #ifdef MULTITHREAD
 	if (MUTEX_UNLOCK(&pool->unused_block_list_mutex) != 0)
 		return MPOOL_ERR_MUTEX;
 #endif
 
-	if (err == MPOOL_SUCCESS)
-		pool->unused_block_list_size++;
-
 	return MPOOL_SUCCESS;
 }
 
@@ -212,14 +211,14 @@ static mpool_error _remove_from_unused_list(struct _block** block, struct mpool*
 #endif
 
 	mpool_error err = _remove_block_list(block, &pool->unused_blocks);
+	if (err == MPOOL_SUCCESS)
+		pool->unused_block_list_size--;
 
 #ifdef MULTITHREAD
 	if (MUTEX_UNLOCK(&pool->unused_block_list_mutex) != 0)
 		return MPOOL_ERR_MUTEX;
 #endif
 	
-	if (err == MPOOL_SUCCESS)
-		pool->unused_block_list_size--;
 	return MPOOL_SUCCESS;
 }
 
@@ -251,23 +250,26 @@ static mpool_error _create_block (void* addr, struct _block** block)
  */
 static mpool_error _add_block (struct _block* new_block, struct mpool* pool) 
 {
-	if (pool->block_list_size + 1 > pool->capacity)
-		return MPOOL_FULL_POOL;
+	mpool_error err = MPOOL_FULL_POOL;
 
 #ifdef MULTITHREAD
 	if (MUTEX_LOCK(&pool->block_list_mutex) != 0)
 		return MPOOL_ERR_MUTEX;
 #endif
 	
-	mpool_error err = _insert_block_list(new_block, &pool->block_list);
+	/* The size is checked and updated under the lock, so two threads can't 
+	 * both take the last place */
+	if (pool->block_list_size + 1 <= pool->capacity) {
+		err = _insert_block_list(new_block, &pool->block_list);
+		if (err == MPOOL_SUCCESS)
+			pool->block_list_size++;
+	}
 
 #ifdef MULTITHREAD
 	if (MUTEX_UNLOCK(&pool->block_list_mutex) != 0)
 		return MPOOL_ERR_MUTEX;
 #endif
 
-	if (err == MPOOL_SUCCESS)
-		pool->block_list_size++;
 	return err;
 }
 
@@ -282,23 +284,21 @@ static mpool_error _remove_block (struct _block** block, struct mpool* pool)
 	if (block == NULL || pool == NULL)
 		return MPOOL_ERR_NULL_ARG;
 
-	if (pool->block_list == NULL)
-		return MPOOL_EMPTY_POOL;
-
 #ifdef MULTITHREAD
 	if (MUTEX_LOCK(&pool->block_list_mutex) != 0)
 		return MPOOL_ERR_MUTEX;
 #endif
 
+	/* An empty list gives MPOOL_EMPTY_POOL */
 	mpool_error err = _remove_block_list(block, &pool->block_list);
+	if (err == MPOOL_SUCCESS)
+		pool->block_list_size--;
 
 #ifdef MULTITHREAD
 	if (MUTEX_UNLOCK(&pool->block_list_mutex) != 0)
 		return MPOOL_ERR_MUTEX;
 #endif
 	
-	if (err == MPOOL_SUCCESS)
-		pool->block_list_size--;
 	return err;
 }
 
@@ -425,8 +425,21 @@ mpool_error mpool_realloc (int32_t new_capacity, struct mpool* pool)
 	int32_t extra = new_capacity - pool->capacity;
 	size_t new_size = extra * pool->block_size;
 	int index = pool->alloc_count++;
+
+	/* _add_block() checks the capacity under the lock, while other threads 
+	 * may be deallocating */
+#ifdef MULTITHREAD
+	if (MUTEX_LOCK(&pool->block_list_mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+#endif
+
 	pool->capacity = new_capacity;
 
+#ifdef MULTITHREAD
+	if (MUTEX_UNLOCK(&pool->block_list_mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+#endif
+
 	pool->blobs = realloc(pool->blobs, sizeof(void*) * pool->alloc_count);
 	if (pool->blobs == NULL) return MPOOL_ERR_ALLOC;
 
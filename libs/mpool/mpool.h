@@ -170,6 +170,10 @@ mpool_error mpool_dealloc (void* item, struct mpool* pool);
  *
  * That means the user must keep track of the size of current pool. This info 
  * may be found with the mpool_capacity() function. 
+ *
+ * With MULTITHREAD, this may run while other threads alloc and dealloc, but 
+ * not alongside another mpool_realloc() on the same pool. The user must hold 
+ * a lock of their own over checking the capacity and growing the pool.
  */
 mpool_error mpool_realloc (int32_t new_capacity, struct mpool* pool);
 
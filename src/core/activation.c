@@ -1,13 +1,47 @@
 #include <stdlib.h>
-#include <math.h>
+#include <tgmath.h>
 #include "cml.h"
 #include "cml-internal.h"
+#include "matrix.h"
+#include "matrix-kernels.h"
 
-/* Activation functions and their derivative */
-static double sigmoid_f (double x);
-static double sigmoid_fp (double x);
-/* static double tanh_f (double x);  C math lib provides this */
-static double tanh_fp (double x);
+/* The type generic math header picks the float or double version of exp() 
+ * and tanh() to match cml_real */
+
+/* Activation functions and their derivative. Like the CUSTOM callbacks, the
+ * derivatives take the same input as the function, the layer uses the 
+ * kernels in matrix-kernels.h to work them out from the output instead. */
+static cml_real sigmoid_f (cml_real x);
+static cml_real sigmoid_fp (cml_real x);
+static cml_real tanh_f (cml_real x);
+static cml_real tanh_fp (cml_real x);
+static cml_real sigmoid_approx_fp (cml_real x);
+static cml_real tanh_approx_fp (cml_real x);
+static cml_real relu_f (cml_real x);
+static cml_real relu_fp (cml_real x);
+static cml_real leaky_relu_f (cml_real x);
+static cml_real leaky_relu_fp (cml_real x);
+
+/* SOFTMAX is applied to whole columns */
+static error_t softmax_forward (matrix_t* m);
+static error_t softmax_backward (matrix_t* out, matrix_t* err);
+
+
+/* Table of sigmoid(x) for SIGMOID_FAST and TANH_FAST, at steps of 
+ * 1 / SIGMOID_TABLE_STEPS from 0 up to SIGMOID_TABLE_MAX. Linear interpolation
+ * between the entries is within 3e-6 of sigmoid(x), and past the end 
+ * sigmoid(x) is within 2e-7 of 1. Filled in when the library is loaded. */
+#define SIGMOID_TABLE_STEPS 64
+#define SIGMOID_TABLE_MAX 16
+#define SIGMOID_TABLE_SIZE (SIGMOID_TABLE_STEPS * SIGMOID_TABLE_MAX + 1)
+
+static cml_real sigmoid_table[SIGMOID_TABLE_SIZE];
+
+static void __attribute__((constructor)) init_sigmoid_table () 
+{
+	for (int i = 0; i < SIGMOID_TABLE_SIZE; i++)
+		sigmoid_table[i] = 1 / (1 + exp(-(double)i / SIGMOID_TABLE_STEPS));
+}
 
 
 /* Short-hand for setting values in the activation_f type, keeps the switch statement 
@@ -31,7 +65,27 @@ error_t get_activation_f (activation_f* actf, act_func_t type, act_func af, act_
 			break;
 
 		case TANH:
-			set_activation_f(actf, type, tanh, tanh_fp);
+			set_activation_f(actf, type, tanh_f, tanh_fp);
+			break;
+
+		case SIGMOID_FAST:
+			set_activation_f(actf, type, sigmoid_approx, sigmoid_approx_fp);
+			break;
+
+		case TANH_FAST:
+			set_activation_f(actf, type, tanh_approx, tanh_approx_fp);
+			break;
+
+		case RELU:
+			set_activation_f(actf, type, relu_f, relu_fp);
+			break;
+
+		case LEAKY_RELU:
+			set_activation_f(actf, type, leaky_relu_f, leaky_relu_fp);
+			break;
+
+		case SOFTMAX:
+			set_activation_f(actf, type, NULL, NULL);
 			break;
 
 		case CUSTOM:
@@ -46,19 +100,243 @@ error_t get_activation_f (activation_f* actf, act_func_t type, act_func af, act_
 }
 
 
-static double sigmoid_f (double x) 
+static cml_real sigmoid_f (cml_real x) 
 {
 	return 1 / (1 + exp(-x));
 }
 
-static double sigmoid_fp (double x) 
+/* dx sigmoid(x) = sigmoid(x) * (1 - sigmoid(x)) */
+static cml_real sigmoid_fp (cml_real x) 
+{
+	cml_real fx = sigmoid_f(x);
+	return fx * (1 - fx);
+}
+
+static cml_real tanh_f (cml_real x) 
 {
-	return x * (1 - x);
+	return tanh(x);
 }
 
 /* dx tanh(x) = 1 - tanh^2(x) */
-static double tanh_fp (double x) 
+static cml_real tanh_fp (cml_real x) 
 {
-	double fx = tanh(x);
+	cml_real fx = tanh(x);
 	return 1 - (fx * fx);
 }
+
+/* sigmoid_approx() */
+cml_real sigmoid_approx (cml_real x) 
+{
+	cml_real ax = fabs(x) * SIGMOID_TABLE_STEPS;
+	cml_real y = 1;
+
+	if (ax < SIGMOID_TABLE_STEPS * SIGMOID_TABLE_MAX) {
+		int i = (int)ax;
+		cml_real frac = ax - i;
+		y = sigmoid_table[i] + frac * (sigmoid_table[i+1] - sigmoid_table[i]);
+	}
+
+	/* sigmoid(-x) = 1 - sigmoid(x) */
+	return (x < 0) ? 1 - y : y;
+}
+
+/* tanh_approx(), tanh(x) = 2 * sigmoid(2x) - 1 */
+cml_real tanh_approx (cml_real x) 
+{
+	return 2 * sigmoid_approx(2 * x) - 1;
+}
+
+static cml_real sigmoid_approx_fp (cml_real x) 
+{
+	cml_real fx = sigmoid_approx(x);
+	return fx * (1 - fx);
+}
+
+static cml_real tanh_approx_fp (cml_real x) 
+{
+	cml_real fx = tanh_approx(x);
+	return 1 - (fx * fx);
+}
+
+static cml_real relu_f (cml_real x) 
+{
+	return (x > 0) ? x : 0;
+}
+
+static cml_real relu_fp (cml_real x) 
+{
+	return (x > 0) ? 1 : 0;
+}
+
+static cml_real leaky_relu_f (cml_real x) 
+{
+	return (x > 0) ? x : LEAKY_RELU_SLOPE * x;
+}
+
+static cml_real leaky_relu_fp (cml_real x) 
+{
+	return (x > 0) ? 1 : LEAKY_RELU_SLOPE;
+}
+
+
+/* activation_forward() */
+error_t activation_forward (activation_f* actf, matrix_t* m, cml_real bias, 
+		matrix_t* preact) 
+{
+	if (actf == NULL || m == NULL) return E_NULL_ARG;
+	if (preact != NULL && (preact->rows != m->rows || preact->columns != m->columns))
+		return E_MATRIX_WRONG_DIM;
+
+	/* Row by row, so the padding at the end of each row stays zero. A 
+	 * vector has no padding and is done as a single row. */
+	size_t rows = m->rows, len = m->columns;
+	if (m->stride == m->columns) {
+		len *= rows;
+		rows = 1;
+	}
+
+	for (size_t i = 0; i < rows; i++) {
+		cml_real* row = m->matrix + i * m->stride;
+
+		if (preact != NULL) {
+			cml_real* z = preact->matrix + i * preact->stride;
+			for (size_t j = 0; j < len; j++)
+				z[j] = row[j] + bias;
+		}
+		if (actf->type == SOFTMAX)
+			continue;
+
+		if (actf->type == CUSTOM) {
+			for (size_t j = 0; j < len; j++)
+				row[j] = actf->af(row[j] + bias);
+		} else {
+			mkernels->act(row, len, bias, actf->type);
+		}
+	}
+
+	if (actf->type == SOFTMAX) return softmax_forward(m);
+	return E_SUCCESS;
+}
+
+
+/* activation_backward() */
+error_t activation_backward (activation_f* actf, matrix_t* preact, matrix_t* out, 
+		matrix_t* err) 
+{
+	if (actf == NULL || out == NULL || err == NULL) return E_NULL_ARG;
+	if (actf->type == CUSTOM && preact == NULL) return E_NULL_ARG;
+	if (out->rows != err->rows || out->columns != err->columns) 
+		return E_MATRIX_WRONG_DIM;
+	if (preact != NULL && (preact->rows != err->rows || preact->columns != err->columns))
+		return E_MATRIX_WRONG_DIM;
+	if (actf->type == SOFTMAX) return softmax_backward(out, err);
+
+	/* As in activation_forward(), a vector is a single row */
+	size_t rows = err->rows, len = err->columns;
+	if (err->stride == err->columns) {
+		len *= rows;
+		rows = 1;
+	}
+
+	for (size_t i = 0; i < rows; i++) {
+		cml_real* e = err->matrix + i * err->stride;
+		const cml_real* o = out->matrix + i * out->stride;
+
+		/* The callback is the derivative of af, so it needs the input */
+		if (actf->type == CUSTOM) {
+			const cml_real* z = preact->matrix + i * preact->stride;
+			for (size_t j = 0; j < len; j++) 
+				e[j] *= actf->ap(z[j]);
+		} else {
+			mkernels->act_grad(e, o, len, actf->type);
+		}
+	}
+	return E_SUCCESS;
+}
+
+
+/* softmax_forward
+ *
+ * 	Replaces each column of m, a sample, with its softmax. The largest value
+ * 	of the column is taken off before exp() so it can not overflow, which 
+ * 	also makes any bias drop out. acc holds a value per column, first the 
+ * 	largest and then the sum, and comes from the scratch arena.
+ */
+static error_t softmax_forward (matrix_t* m) 
+{
+	scratch_mark_t mark = scratch_mark();
+	cml_real* acc = scratch_alloc(m->columns);
+	if (acc == NULL) return E_ALLOC_FAILURE;
+
+	for (unsigned int j = 0; j < m->columns; j++)
+		acc[j] = MATRIX_AT(m, 0, j);
+	for (unsigned int i = 1; i < m->rows; i++) {
+		const cml_real* row = &MATRIX_AT(m, i, 0);
+		for (unsigned int j = 0; j < m->columns; j++)
+			acc[j] = (row[j] > acc[j]) ? row[j] : acc[j];
+	}
+
+	/* A single sample is dense, so exp() is one kernel call */
+	if (m->columns == 1) {
+		mkernels->act(m->matrix, m->rows, -acc[0], SOFTMAX);
+	} else {
+		for (unsigned int i = 0; i < m->rows; i++) {
+			cml_real* row = &MATRIX_AT(m, i, 0);
+			for (unsigned int j = 0; j < m->columns; j++)
+				row[j] -= acc[j];
+			mkernels->act(row, m->columns, 0, SOFTMAX);
+		}
+	}
+
+	for (unsigned int j = 0; j < m->columns; j++)
+		acc[j] = 0;
+	for (unsigned int i = 0; i < m->rows; i++) {
+		const cml_real* row = &MATRIX_AT(m, i, 0);
+		for (unsigned int j = 0; j < m->columns; j++)
+			acc[j] += row[j];
+	}
+
+	for (unsigned int j = 0; j < m->columns; j++)
+		acc[j] = 1 / acc[j];
+	for (unsigned int i = 0; i < m->rows; i++) {
+		cml_real* row = &MATRIX_AT(m, i, 0);
+		for (unsigned int j = 0; j < m->columns; j++)
+			row[j] *= acc[j];
+	}
+
+	scratch_reset(mark);
+	return E_SUCCESS;
+}
+
+
+/* softmax_backward
+ *
+ * 	Multiplies each column of err by the Jacobian of the softmax, which 
+ * 	for an output y is diag(y) - y * y^T. That works out to 
+ * 	err = y * (err - dot(err, y)) without building the matrix.
+ */
+static error_t softmax_backward (matrix_t* out, matrix_t* err) 
+{
+	scratch_mark_t mark = scratch_mark();
+	cml_real* dot = scratch_alloc(err->columns);
+	if (dot == NULL) return E_ALLOC_FAILURE;
+
+	for (unsigned int j = 0; j < err->columns; j++)
+		dot[j] = 0;
+	for (unsigned int i = 0; i < err->rows; i++) {
+		const cml_real* e = &MATRIX_AT(err, i, 0);
+		const cml_real* o = &MATRIX_AT(out, i, 0);
+		for (unsigned int j = 0; j < err->columns; j++)
+			dot[j] += e[j] * o[j];
+	}
+
+	for (unsigned int i = 0; i < err->rows; i++) {
+		cml_real* e = &MATRIX_AT(err, i, 0);
+		const cml_real* o = &MATRIX_AT(out, i, 0);
+		for (unsigned int j = 0; j < err->columns; j++)
+			e[j] = o[j] * (e[j] - dot[j]);
+	}
+
+	scratch_reset(mark);
+	return E_SUCCESS;
+}
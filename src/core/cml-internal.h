@@ -16,28 +16,59 @@
  */
 
 
-/* Implementation of layer structure */
+/* Implementation of layer structure 
+ *
+ * preact, output and layer_error are allocated once in init_layer() and 
+ * overwritten on every pass. preact holds the input of the activation 
+ * z = W * x + bias and output holds f(z), both stay valid after backprop.
+ *
+ * weights, weight_grad and last_weight_delta are views into the arenas of
+ * the net, and bias and bias_grad point into them, see struct net. All of 
+ * them are NULL for the input layer.
+ */
 typedef struct layer {
 	layer_type ltype;
 	int input_nodes;
 	int output_nodes;
 	int using_bias;
-	double bias;
+	cml_real* bias;
+	cml_real* bias_grad;
 	matrix_t* input;
+	matrix_t* preact;
 	matrix_t* output;
 	matrix_t* weights;
+	matrix_t* weight_grad;
 	matrix_t* layer_error;
-	matrix_t* weight_delta;
 	matrix_t* last_weight_delta;
 	activation_f actf;
 } layer;
 
 
-/* Implementation of net structure */
+/* Implementation of net structure 
+ *
+ * input_buff and expected_buff hold the current sample during training,
+ * they are allocated by connect_net() along with the per layer buffers so 
+ * a training step doesn't allocate anything. For the same reason 
+ * connect_net() also sets up the context predict_into() runs in.
+ *
+ * All the parameters of the net are in the single aligned arena params, 
+ * the weights of each layer in turn, each starting on an aligned boundary,
+ * followed by the bias of each layer. grads holds two more copies of this
+ * layout, the gradient of each parameter and then the last step taken for 
+ * it, so a parameter, its gradient and its last step are always 
+ * param_count values apart. The arenas are set up by connect_net(), which 
+ * makes the matrices of each layer views into them.
+ */
 typedef struct net {
 	layer** layers;
 	int layer_count;
 	int* topology;
+	cml_real* params;
+	cml_real* grads;
+	size_t param_count;
+	inference_ctx* ctx; // Buffers for predict_into()
+	matrix_t* input_buff;
+	matrix_t* expected_buff;
 	double learning_rate;
 	double momentum;
 	int connected; // See defines below
@@ -48,10 +79,25 @@ typedef struct net {
 #define NET_NOT_CONNECTED -1
 
 
+/* Implementation of inference_ctx 
+ *
+ * output is indexed by layer like net->layers, with index 0 unused since
+ * the input layer's output is input. topology is a copy of the topology of
+ * the net the context was made for.
+ */
+typedef struct inference_ctx {
+	int layer_count;
+	int* topology;
+	matrix_t* input;
+	matrix_t** output;
+} inference_ctx;
+
+
 /* init_layer (net.c)
  *
  * 	This function is used to initialize an allocated struct layer with the
- * 	given values.
+ * 	given values. The weights and bias are set up afterwards by 
+ * 	init_params().
  *
  * 	Arguments:
  * 		l => Pointer to allocated struct layer
@@ -64,12 +110,77 @@ typedef struct net {
  *		1 => Error initializing layer
  *
  *	Memory Allocated:
- *		l->weights (Through random_matrix())
+ *		l->preact, l->output, l->layer_error 
+ *		(Nothing for the input layer)
  *
  */
 error_t init_layer (layer* l, layer_type lt, int in_node, int out_node);
 
 
+/* init_params (net.c)
+ *
+ * 	Allocates the parameter and gradient arenas of a net whose layers 
+ * 	have been through init_layer(), see struct net for the layout. The 
+ * 	weights and biases are given random values, the gradients and last 
+ * 	steps start at 0.
+ *
+ *	Memory Allocated:
+ *		n->params, n->grads
+ *		l->weights, l->weight_grad, l->last_weight_delta (Views)
+ */
+error_t init_params (net* n);
+
+
+/* Slope of LEAKY_RELU for negative inputs */
+#define LEAKY_RELU_SLOPE ((cml_real)0.01)
+
+
+/* sigmoid_approx and tanh_approx (activation.c)
+ *
+ * 	The activations of SIGMOID_FAST and TANH_FAST, by linear interpolation
+ * 	in a table of sigmoid(x). sigmoid_approx() is within 3e-6 of sigmoid(x)
+ * 	and tanh_approx() within 6e-6 of tanh(x), for any x.
+ */
+cml_real sigmoid_approx (cml_real x);
+cml_real tanh_approx (cml_real x);
+
+
+/* activation_forward (activation.c)
+ *
+ * 	Applies the activation to every value of m in place after adding the 
+ * 	bias, m = f(m + bias). The built-in activations go through the vector
+ * 	kernels of matrix-kernels.h, only CUSTOM calls actf->af per value.
+ * 	SOFTMAX is taken over each column of m, one sample of a batch.
+ *
+ * Arguments:
+ * 	actf => Activation of the layer
+ * 	m => Values of the layer, a single output or a batch
+ * 	bias => Added to each value first, 0 for none
+ * 	preact => If not NULL, m + bias is kept here, the same size as m
+ */
+error_t activation_forward (activation_f* actf, matrix_t* m, cml_real bias, 
+		matrix_t* preact);
+
+
+/* activation_backward (activation.c)
+ *
+ * 	Multiplies each value of err by the activation derivative at the 
+ * 	matching value, err = err * f'(preact). Works on a single sample or 
+ * 	a batch. The built-in activations work it out from out, which is 
+ * 	cheaper (1 - out^2 for tanh), only CUSTOM calls actf->ap on preact. 
+ * 	For SOFTMAX, each column of err is multiplied by the Jacobian of the
+ * 	softmax instead.
+ *
+ * Arguments:
+ * 	actf => Activation of the layer
+ * 	preact => Input of the activation, only needed for CUSTOM
+ * 	out => Output of the layer, the result of activation_forward()
+ * 	err => Error of the layer, same size as out
+ */
+error_t activation_backward (activation_f* actf, matrix_t* preact, matrix_t* out, 
+		matrix_t* err);
+
+
 /* calculate_cost_func (cost.c)
  *
  *	This function is used to calculate the result of the cost function after 
@@ -85,6 +196,14 @@ error_t init_layer (layer* l, layer_type lt, int in_node, int out_node);
 double calculate_cost_func(net* n, matrix_t* expected);
 
 
+/* calculate_cost (cost.c)
+ *
+ *	Same as calculate_cost_func() for an output of the net that was worked 
+ *	out somewhere else, such as in an inference_ctx.
+ */
+double calculate_cost(net* n, matrix_t* output, matrix_t* expected);
+
+
 /* calculate_cost_gradient (cost.c)
  *
  *	This function is used to calculate the gradient of the cost function after 
@@ -92,10 +211,33 @@ double calculate_cost_func(net* n, matrix_t* expected);
  *
  * Arguments:
  * 	net => Current neural network that was just fed forward
- * 	expected => Expected output of neural network
- * 	result => Pointer to the matrix_t pointer that the error vector is put in
+ * 	output => Output of the net, or a matrix with an output per column for a batch
+ * 	expected => Expected output of neural network, same size as output
+ * 	result => Initialized matrix the size of output the gradient is put in
+ */
+error_t calculate_cost_gradient(net* n, matrix_t* output, matrix_t* expected, 
+		matrix_t* result);
+
+
+/* calculate_output_delta (cost.c)
+ *
+ *	This function is used to calculate the error of the output layer with 
+ *	respect to the input of its activation, the cost gradient multiplied by 
+ *	the activation's derivative. For the cross entropy cost with a SIGMOID, 
+ *	SIGMOID_FAST or SOFTMAX output the two cancel down to output - expected,
+ *	which is done in a single pass and stays finite when the output 
+ *	saturates. Otherwise it is calculate_cost_gradient() followed by 
+ *	activation_backward().
+ *
+ * Arguments:
+ * 	net => Current neural network that was just fed forward
+ * 	preact => Input of the output layer's activation, see activation_backward()
+ * 	output => Output of the net, or a matrix with an output per column for a batch
+ * 	expected => Expected output of neural network, same size as output
+ * 	result => Initialized matrix the size of output the error is put in
  */
-error_t calculate_cost_gradient(net* n, matrix_t* expected, matrix_t** result);
+error_t calculate_output_delta(net* n, matrix_t* preact, matrix_t* output, 
+		matrix_t* expected, matrix_t* result);
 
 
 /* data-builder.c
@@ -62,10 +62,37 @@ typedef struct cml_data cml_data;
 typedef struct data_set data_set;
 
 
+/* struct inference_ctx
+ *
+ * 	Working buffers for running inputs through a net, see predict_ctx(). 
+ * 	A context only holds what one prediction writes, so any number of 
+ * 	them can share a single net between threads.
+ */
+typedef struct inference_ctx inference_ctx;
+
+
+/* cml_real
+ *
+ * 	The floating point type the net and its matrices are computed in. This is 
+ * 	double, unless the library is built with CML_SINGLE_PRECISION defined 
+ * 	(the cmake option of the same name), which switches it to float. Float 
+ * 	fits twice the values in each vector register and halves the memory 
+ * 	traffic, at the cost of precision.
+ *
+ * 	Anything including this header must be built with the same setting as 
+ * 	the library. The values in cml_data are always double.
+ */
+#ifdef CML_SINGLE_PRECISION
+typedef float cml_real;
+#else
+typedef double cml_real;
+#endif
+
+
 /*	This defines the signature needed for any custom activation functions or their
  *	derivatives. 
  */
-typedef double (*act_func)(double);
+typedef cml_real (*act_func)(cml_real);
 
 
 /* activation_functions
@@ -76,11 +103,24 @@ typedef double (*act_func)(double);
  * 	If the CUSTOM is selected, then the user will provide callbacks to their own 
  * 	activation function, and derivative of that function.
  *
+ * 	SIGMOID_FAST and TANH_FAST are cheaper approximations of SIGMOID and TANH,
+ * 	meant for nets that are only used for inference. They are within 1e-5 of
+ * 	the exact functions for any input.
+ *
+ * 	LEAKY_RELU has a slope of 0.01 for negative inputs. SOFTMAX is applied 
+ * 	over all the nodes of the layer at once rather than to each node, so it 
+ * 	is meant for the output layer, and it ignores the layer's bias. 
+ *
  */
 typedef enum activation_functions {
 	SIGMOID,
 	TANH,
 	CUSTOM,
+	SIGMOID_FAST,
+	TANH_FAST,
+	RELU,
+	LEAKY_RELU,
+	SOFTMAX,
 } act_func_t;
 
 
@@ -105,6 +145,9 @@ typedef struct activation_f {
  *
  *	The default cost function is the quadratic cost function and that one will be used 
  *	unless another is specifically specified with set_cost_function()
+ *
+ *	When the output layer is SOFTMAX, CROSS_ENTROPY is the categorical cross entropy
+ *	-sum(e * log(o)), with the expected output one-hot or a distribution.
  */
 typedef enum cost_functions {
 	QUADRATIC,
@@ -146,6 +189,8 @@ typedef enum _cnn_error {
 	E_INVALID_FEATURE_COUNT,
 	E_NO_INPUT_FEATURES_SPECIFIED,
 	E_INVALID_TRAINING_SPLIT,
+	E_INVALID_BATCH_SIZE,
+	E_INVALID_THREAD_COUNT,
 } error_t;
 
 
@@ -197,6 +242,125 @@ net* init_net (double learning_rate, double momentum, cost_func_t costf);
 error_t train (net* n, data_set* data, int epochs);
 
 
+/* train_batched
+ *	
+ *	Same as train(), but the weights are updated once per batch of 
+ *	batch_size samples using the average gradient of the batch. Each layer 
+ *	is worked out for the whole batch at once with matrix-matrix products, 
+ *	which is much faster than one sample at a time. A batch_size of 1 
+ *	trains exactly like train().
+ *
+ *	If the data count is not a multiple of batch_size, the last batch of 
+ *	each epoch is smaller. A batch_size larger than the data count is 
+ *	treated as the data count. An empty data set trains nothing.
+ *
+ *	Arguments:
+ *		n => Neural Network to train
+ *		data => Data set to train on
+ *		epochs => How many epochs the net should train for
+ *		batch_size => How many samples are in each batch, must be positive
+ *
+ *	Returns:
+ *		E_SUCCESS => Training was successful 
+ *		E_INVALID_BATCH_SIZE => batch_size is less than 1
+ *		Otherwise the error that stopped training
+ *
+ *	Memory Allocated:
+ *		Working buffers for the batches, freed before returning
+ */
+error_t train_batched (net* n, data_set* data, int epochs, int batch_size);
+
+
+/* train_parallel
+ *	
+ *	Same as train_batched(), with each batch split into the given number 
+ *	of shares that are worked on in parallel by the library's threads (see
+ *	set_thread_count()). The gradient of each share is worked out against 
+ *	the same weights, then the gradients are summed in a fixed order and 
+ *	the weights take a single step. For a given number of shares the 
+ *	result is always the same, however many threads there are, and with 
+ *	one share it is exactly that of train_batched(). Batches smaller than 
+ *	the number of shares use fewer. An empty data set trains nothing.
+ *
+ *	Arguments:
+ *		n => Neural Network to train
+ *		data => Data set to train on
+ *		epochs => How many epochs the net should train for
+ *		batch_size => How many samples are in each batch, must be positive
+ *		shares => How many shares to split each batch into
+ *
+ *	Returns:
+ *		E_SUCCESS => Training was successful 
+ *		E_INVALID_BATCH_SIZE => batch_size is less than 1
+ *		E_INVALID_THREAD_COUNT => shares is less than 1
+ *		Otherwise the error that stopped training
+ *
+ *	Memory Allocated:
+ *		Working buffers and gradients for each share, freed before returning
+ */
+error_t train_parallel (net* n, data_set* data, int epochs, int batch_size, int shares);
+
+
+/* train_hogwild
+ *
+ *	Same as train(), with the data split into the given number of shares
+ *	that are trained on in parallel by the library's threads (see 
+ *	set_thread_count()), each taking its steps on the shared weights 
+ *	without any locking (Hogwild!). An update may now and then be lost to
+ *	one made at the same time for another share, which makes little 
+ *	difference to how well the net learns when each sample only touches 
+ *	part of the weights, as with wide sparse inputs. The result is not 
+ *	repeatable with more than one share, with one it is exactly that of 
+ *	train().
+ *
+ *	Each share keeps its own last steps for the momentum, the first uses 
+ *	those of the net. Every share is done by the end of each epoch, before
+ *	the test error is reported.
+ *
+ *	Arguments:
+ *		n => Neural Network to train
+ *		data => Data set to train on
+ *		epochs => How many epochs the net should train for
+ *		shares => How many shares to split the data into
+ *
+ *	Returns:
+ *		E_SUCCESS => Training was successful
+ *		E_INVALID_THREAD_COUNT => shares is less than 1
+ *		Otherwise the error that stopped training
+ *
+ *	Memory Allocated:
+ *		Working buffers for each share, freed before returning
+ */
+error_t train_hogwild (net* n, data_set* data, int epochs, int shares);
+
+
+/* set_thread_count
+ *
+ *	Sets how many threads the library runs its parallel work on, such as 
+ *	the shares of train_parallel() and train_hogwild(), predict_batch() 
+ *	and reading CSV files. The thread that calls into the library is one
+ *	of them, so 1 does everything on the caller. 0 goes back to the 
+ *	default, which is the CML_NUM_THREADS environment variable if it is 
+ *	set, otherwise the number of CPUs.
+ *
+ *	The threads are started the first time they are needed. This must not
+ *	be called while anything is running on them.
+ *
+ *	Returns:
+ *		E_SUCCESS => The count was set
+ *		E_INVALID_THREAD_COUNT => threads is negative
+ */
+error_t set_thread_count (int threads);
+
+
+/* get_thread_count
+ *
+ *	How many threads the library runs its parallel work on, including 
+ *	the caller, see set_thread_count().
+ */
+int get_thread_count (void);
+
+
 /* predict
  *
  *	This function is used to predict a given value once the network has
@@ -217,6 +381,100 @@ error_t train (net* n, data_set* data, int epochs);
 cml_data* predict (net* n, cml_data* input);
 
 
+/* predict_into
+ *
+ *	Same as predict(), but the input is read from in and the output 
+ *	written to out, and nothing is allocated. Like predict() this uses
+ *	buffers in the net, so only one thread may call it on a net at a time,
+ *	see predict_ctx() for sharing a net between threads.
+ *
+ *	Arguments:
+ *		n => Net to run
+ *		in => As many values as the input layer has nodes
+ *		out => Room for as many values as the output layer has nodes
+ *
+ *	Returns:
+ *		E_SUCCESS => out holds the output
+ *		E_NULL_ARG => n, in or out is NULL
+ *		E_NET_NOT_CONNECTED => The net has not been connected
+ *
+ *	Memory Allocated:
+ *		NONE
+ */
+error_t predict_into (net* n, const double* in, double* out);
+
+
+/* predict_batch
+ *
+ *	Same as predict() for count samples at once. Groups of samples go 
+ *	through each layer as a single matrix-matrix product, which is much 
+ *	faster than one predict() call per sample. The net is only read, so 
+ *	this may be called from several threads at the same time as long as 
+ *	nothing trains the net meanwhile.
+ *
+ *	Arguments:
+ *		n => Net to run
+ *		inputs => count samples one after the other, each with as many 
+ *			values as the input layer has nodes
+ *		count => How many samples there are
+ *		outputs => Where the outputs go, in the same order, each with as many
+ *			values as the output layer has nodes
+ *
+ *	Returns:
+ *		E_SUCCESS => outputs holds the output of every sample
+ *		E_NULL_ARG => n, inputs or outputs is NULL
+ *		E_NET_NOT_CONNECTED => The net has not been connected
+ *		E_ALLOC_FAILURE => Could not get room for the layer outputs
+ *
+ *	Memory Allocated:
+ *		NONE
+ */
+error_t predict_batch (net* n, const double* inputs, size_t count, double* outputs);
+
+
+/* init_inference_ctx
+ *
+ *	Allocates the buffers needed to run a prediction through the given 
+ *	net with predict_ctx(). The context can be used with any net of the 
+ *	same topology.
+ *
+ *	Returns NULL if the net is not connected or the buffers could not be
+ *	allocated.
+ *
+ *	Memory Allocated:
+ *		The context, free with free_inference_ctx()
+ */
+inference_ctx* init_inference_ctx (net* n);
+
+
+/* predict_ctx
+ *
+ *	Same as predict(), but everything written along the way goes to ctx, 
+ *	and the net is only read. Calls with different contexts may run at the
+ *	same time on the same net from different threads, as long as nothing 
+ *	trains it meanwhile.
+ *
+ *	Arguments:
+ *		ctx => Context from init_inference_ctx(), used by one thread at a time
+ *		n => Net to run, with the topology ctx was made for
+ *		input => The input to predict the result of
+ *
+ *	Returns:
+ *		The output of the net, or NULL if input or n don't match ctx
+ *
+ *	Memory Allocated:
+ *		The returned cml_data, free with free_cml_data()
+ */
+cml_data* predict_ctx (inference_ctx* ctx, net* n, cml_data* input);
+
+
+/* free_inference_ctx
+ *
+ *	Frees a context from init_inference_ctx().
+ */
+error_t free_inference_ctx (inference_ctx* ctx);
+
+
 /* free_net
  *
  *	This function frees all memory that the struct net 
@@ -330,9 +588,11 @@ error_t connect_net (net* nn);
  *	activation_f* -> Location to put everything into.
  *	type -> Type of activation function
  *	af -> Pointer to activation function, only needed when type is CUSTOM
- *	ap -> Pointer to the activation function's derivative, only needed when type is CUSTOM
+ *	ap -> Pointer to the activation function's derivative, only needed when type is CUSTOM.
+ *		It is called with the same input as af, not with its output.
  *
- * Note i: If type is not CUSTOM, then af and ap are ignored. 
+ * Note i: If type is not CUSTOM, then af and ap are ignored. For SOFTMAX the af and
+ * 	ap members are left NULL, since it is not applied value by value. 
  * Note ii: Generally the structure passed in should be on the stack not the heap. Since 
  * 	the layer structure holds the structure and not the pointer, it works best as:
  *
@@ -354,7 +614,31 @@ cml_data* init_cml_data();
 data_set* init_data_set();
 error_t free_cml_data(cml_data* data);
 error_t free_data_set(data_set* ds);
+
+
+/* data_set_from_csv
+ *
+ *	Reads the rows of a CSV file into the data set. The first row must 
+ *	name the features, and the first row of data sets the type of each.
+ *	The rows are read in batches of up to 1024, and each batch is checked
+ *	and converted in parallel.
+ *
+ *	Arguments:
+ *		ds => Data set to add the rows to
+ *		fh => File to read from
+ *		lineno => Set to the last line read, or to the line of the row 
+ *		          that failed
+ *
+ *	Returns:
+ *		E_SUCCESS => The whole file was read
+ *		Otherwise the error of the first row that failed, the rows 
+ *		before it are still added to ds
+ *
+ *	Note: A batch is read in full before any of its rows are checked, so
+ *	after a bad row fh may have been read up to 1023 lines past it.
+ */
 error_t data_set_from_csv(data_set* ds, FILE* fh, int* lineno);  
+
 error_t get_feature_names (data_set* ds, char*** features, int* size);
 error_t split_data (data_set* ds, double training_split);
 error_t set_input_features (data_set* ds, char** features, int count);
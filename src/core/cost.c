@@ -13,30 +13,49 @@
 
 /* Static defines */
 static double quadratic_cost (matrix_t* o, matrix_t* e);
-static error_t quadratic_gradient (matrix_t* o, matrix_t* e, matrix_t** result);
+static error_t quadratic_gradient (matrix_t* o, matrix_t* e, matrix_t* result);
 static double cross_entropy_cost (matrix_t* o, matrix_t* e);
-static error_t cross_entropy_gradient (matrix_t* o, matrix_t* e, matrix_t** result);
+static error_t cross_entropy_gradient (matrix_t* o, matrix_t* e, matrix_t* result);
+static double categorical_cross_entropy_cost (matrix_t* o, matrix_t* e);
+
+/* Outputs are kept this far from 0 and 1 before taking logs or dividing by
+ * them, so a saturated output gives a large but finite cost */
+#ifdef CML_SINGLE_PRECISION
+#define CE_EPSILON 1e-7
+#else
+#define CE_EPSILON 1e-12
+#endif
+
+static inline double clamp_output (double o) 
+{
+	return (o < CE_EPSILON) ? CE_EPSILON : (o > 1 - CE_EPSILON) ? 1 - CE_EPSILON : o;
+}
 
 
 /* calculate_cost_func() */
 double calculate_cost_func (net* n, matrix_t* expected) 
 {
-	matrix_t* output = n->layers[n->layer_count - 1]->output;
+	return calculate_cost(n, n->layers[n->layer_count - 1]->output, expected);
+}
+
 
+/* calculate_cost() */
+double calculate_cost (net* n, matrix_t* output, matrix_t* expected) 
+{
 	switch (n->costf) {
 		case QUADRATIC:
 			return quadratic_cost(output, expected);
 		case CROSS_ENTROPY:
+			if (n->layers[n->layer_count - 1]->actf.type == SOFTMAX)
+				return categorical_cross_entropy_cost(output, expected);
 			return cross_entropy_cost(output, expected);
 	}
 }
 
 
 /* calculate_cost_gradient() */
-error_t calculate_cost_gradient(net* n, matrix_t* expected, matrix_t** result) 
+error_t calculate_cost_gradient(net* n, matrix_t* output, matrix_t* expected, matrix_t* result) 
 {
-	matrix_t* output = n->layers[n->layer_count - 1]->output;
-
 	switch (n->costf) {
 		case QUADRATIC:
 			return quadratic_gradient(output, expected, result);
@@ -46,6 +65,29 @@ error_t calculate_cost_gradient(net* n, matrix_t* expected, matrix_t** result)
 }
 
 
+/* calculate_output_delta() */
+error_t calculate_output_delta(net* n, matrix_t* preact, matrix_t* output, 
+		matrix_t* expected, matrix_t* result) 
+{
+	activation_f* actf = &n->layers[n->layer_count - 1]->actf;
+
+	if (n->costf == CROSS_ENTROPY) {
+		switch (actf->type) {
+			case SIGMOID:
+			case SIGMOID_FAST:
+			case SOFTMAX:
+				return matrix_subtraction_into(output, expected, result);
+			default:
+				break;
+		}
+	}
+
+	error_t err = calculate_cost_gradient(n, output, expected, result);
+	if (err != E_SUCCESS) return err;
+	return activation_backward(actf, preact, output, result);
+}
+
+
 /* quadratic_cost()
  *
  *	This implements the quadratic cost function.
@@ -58,7 +100,7 @@ static double quadratic_cost (matrix_t* o, matrix_t* e)
 {
 	double sum_squares = 0.0;
 	for (int i = 0; i < o->rows; i++) {
-		sum_squares += pow(o->matrix[i][0] - e->matrix[i][0], 2);
+		sum_squares += pow(MATRIX_AT(o, i, 0) - MATRIX_AT(e, i, 0), 2);
 	}
 	return 0.5 * sum_squares;
 }
@@ -67,15 +109,16 @@ static double quadratic_cost (matrix_t* o, matrix_t* e)
 /* quadratic_gradient()
  *
  * 	This function computes the vector that is the quadratic gradient function:
- * 	(actual - expected). It returns a vector that holds the gradients.
+ * 	(actual - expected). It returns a vector that holds the gradients, or for 
+ * 	a batch a matrix with a column per sample.
  *	
  * Arguments:
  * 	o => Output vector from network
  * 	e => Expected vector from network
  */
-static error_t quadratic_gradient (matrix_t* o, matrix_t* e, matrix_t** result) 
+static error_t quadratic_gradient (matrix_t* o, matrix_t* e, matrix_t* result) 
 {
-	return matrix_subtraction(o, e, result);
+	return matrix_subtraction_into(o, e, result);
 }
 
 
@@ -91,8 +134,8 @@ static double cross_entropy_cost (matrix_t* o, matrix_t* e)
 {
 	double sum = 0.0;
 	for (int i = 0; i < o->rows; i++) {
-		double expected = e->matrix[i][0];
-		double output = o->matrix[i][0];
+		double expected = MATRIX_AT(e, i, 0);
+		double output = clamp_output(MATRIX_AT(o, i, 0));
 		sum += ((expected * log(output)) + ((1 - expected) * log(1-output)));
 	}
 	return sum * -1;
@@ -100,34 +143,51 @@ static double cross_entropy_cost (matrix_t* o, matrix_t* e)
 
 /**
  * cross_entropy_gradient() - Computes the gradient wrt each output of the network,
- * returns a vector holding all the gradients.
+ * returns a vector holding all the gradients. For a batch each column of @o, @e
+ * and @result is one sample.
  *
  * @o: Output of the network
  * @e: Expected output of the network
- * @result: Location of where to put the result of the calculation
+ * @result: Vector the size of @o to put the result of the calculation in
  *
- * Note that it _may_ be possible for a division by zero error here if the output 
- * value is 1. If this is used with the sigmoid function this should not cause an
- * issue as the range is (0,1), but the value may be rounded up to 1 if it is very 
- * close. Not sure at the moment how to fix this, but need to come back to it 
- * eventually.
+ * The output is clamped to [CE_EPSILON, 1 - CE_EPSILON] so a saturated output
+ * does not divide by zero. With a sigmoid or softmax output layer this is not
+ * used for training at all, see calculate_output_delta().
  */
-static error_t cross_entropy_gradient (matrix_t* o, matrix_t* e, matrix_t** result)
+static error_t cross_entropy_gradient (matrix_t* o, matrix_t* e, matrix_t* result)
 {
 		
 	if (o->rows != e->rows || o->columns != e->columns)
 		return E_MATRIX_WRONG_DIM;
-	//matrix_t* res = malloc(sizeof(matrix_t));
-	matrix_t* res;
-	init_matrix(&res, o->rows, o->columns);
+
+	if (result->rows != o->rows || result->columns != o->columns)
+		return E_MATRIX_WRONG_DIM;
 
 	for (int i = 0; i < o->rows; i++) {
-		double expected = e->matrix[i][0];
-		double output = o->matrix[i][0];
-		res->matrix[i][0] = (output-expected) / ((1-output) * (output));
+		for (int j = 0; j < o->columns; j++) {
+			cml_real expected = MATRIX_AT(e, i, j);
+			cml_real output = clamp_output(MATRIX_AT(o, i, j));
+			MATRIX_AT(result, i, j) = (output-expected) / ((1-output) * (output));
+		}
 	}
-	*result = res;
 	return E_SUCCESS;
 }
 
 
+
+
+/**
+ * categorical_cross_entropy_cost() - Computes the cross-entropy cost of a 
+ * softmax output, where the outputs form a single distribution.
+ *
+ *	@o: Output of the network
+ *	@e: Expected output of the network
+ *
+ */
+static double categorical_cross_entropy_cost (matrix_t* o, matrix_t* e) 
+{
+	double sum = 0.0;
+	for (int i = 0; i < o->rows; i++)
+		sum += MATRIX_AT(e, i, 0) * log(clamp_output(MATRIX_AT(o, i, 0)));
+	return sum * -1;
+}
@@ -4,6 +4,24 @@
 #include "data-builder.h"
 #include "matrix.h"
 #include "csv-utils.h"
+#include "thread-pool.h"
+
+/* Rows data_set_from_csv() reads in before checking and converting them */
+#define CSV_BATCH_ROWS 1024
+
+/* csv_batch
+ *
+ * 	Rows of a CSV file that have been split up by parse_csv_row(), and
+ * 	what convert_csv_rows() made of each.
+ */
+typedef struct csv_batch {
+	data_set* ds;
+	int count;
+	char** rows[CSV_BATCH_ROWS];
+	int sizes[CSV_BATCH_ROWS];
+	cml_data* data[CSV_BATCH_ROWS];
+	error_t errors[CSV_BATCH_ROWS];
+} csv_batch;
 
 /* Static funcs */
 static error_t convert_raw_into_pairs (data_set* ds);
@@ -11,6 +29,8 @@ static error_t add_feature_name (data_set* ds, char* name);
 static error_t str_to_cml_data(data_set* ds, cml_data* data, char** str, int count);
 static error_t set_feature_types(data_set* ds, char** features, int size);
 static error_t shuffle_data (data_set* ds, double split);
+static error_t add_csv_batch (csv_batch* b, int first_line, int* lineno);
+static error_t convert_csv_rows (void* arg, size_t begin, size_t end);
 
 /* init_cml_data() */
 cml_data* init_cml_data () 
@@ -68,12 +88,25 @@ error_t cml_data_to_matrix (cml_data* data, matrix_t** m)
 	error_t err = init_matrix(m, data->count, 1);
 	if (err != E_SUCCESS) return err;
 
+	return cml_data_to_matrix_into(data, *m);
+} 
+
+
+/* cml_data_to_matrix_into() */
+error_t cml_data_to_matrix_into (cml_data* data, matrix_t* m) 
+{
+	if (data == NULL || m == NULL)
+		return E_NULL_ARG;
+
+	if (m->rows != data->count || m->columns != 1)
+		return E_MATRIX_WRONG_DIM;
+
 	for (int i = 0; i < data->count; i++) {
 		double* val = (double*) data->items[i];
-		(*m)->matrix[i][0] = *val;
+		MATRIX_AT(m, i, 0) = *val;
 	}
 	return E_SUCCESS;
-} 
+}
 
 
 /* matrix_to_cml_data() */
@@ -90,7 +123,7 @@ error_t matrix_to_cml_data (matrix_t* m, cml_data** data)
 
 	for (int i = 0; i < m->rows; i++) {
 		double* val = malloc(sizeof(double));
-		*val = m->matrix[i][0];
+		*val = MATRIX_AT(m, i, 0);
 		add_to_cml_data(*data, val);
 	}
 	return E_SUCCESS;
@@ -401,30 +434,44 @@ error_t data_set_from_csv (data_set* ds, FILE* fh, int* lineno)
 	}
 	free(features);
 
-	/* Now loop over entire file until the end */
+	/* Now loop over entire file until the end, the rows are read a batch 
+	 * at a time and converted in parallel */
+	csv_batch* batch = calloc(1, sizeof(csv_batch));
+	if (batch == NULL) {
+		err = E_ALLOC_FAILURE;
+		goto error;
+	}
+	batch->ds = ds;
+
 	char** strline = NULL;
 	while ((err = parse_csv_row(fh, &strline, &count)) == E_SUCCESS) {
 		line++;
 
+		batch->rows[batch->count] = strline;
+		batch->sizes[batch->count++] = count;
+		strline = NULL;
+
+		/* The first row of data sets the type of each feature */
 		if (line == 2) 
-			err = set_feature_types(ds, strline, count);
-		else 
-			err = validate_csv_row(ds, strline, count);
-		if (err != E_SUCCESS) goto error;
+			err = set_feature_types(ds, batch->rows[0], count);
+		if (err == E_SUCCESS && batch->count == CSV_BATCH_ROWS)
+			err = add_csv_batch(batch, line - batch->count + 1, &line);
+		if (err != E_SUCCESS) break;
+	}
 
-		cml_data* new_data = init_cml_data();
-		err = str_to_cml_data(ds, new_data, strline, count);
-		if (err != E_SUCCESS) goto error;
-		
-		err = add_cml_data (ds, new_data);
-		if (err != E_SUCCESS) goto error;
+	if (err == E_NO_MORE_ITEMS) {
+		err = add_csv_batch(batch, line - batch->count + 1, &line);
+		if (err == E_SUCCESS)
+			err = E_NO_MORE_ITEMS;
+	}
 
-		/* Since we used strcpy, we can free resources up */
-		for (int i = 0; i < count; i++)
-			free(strline[i]);
-		free(strline);
-		strline = NULL;
+	/* Anything left is from a row that failed */
+	for (int r = 0; r < batch->count; r++) {
+		for (int i = 0; i < batch->sizes[r]; i++)
+			free(batch->rows[r][i]);
+		free(batch->rows[r]);
 	}
+	free(batch);
 
 error:
 	*lineno = line;
@@ -435,6 +482,65 @@ error:
 }
 
 
+/* add_csv_batch
+ *
+ * 	Checks and converts the rows of the batch in parallel, then adds them
+ * 	to the data set in order. The first row is on line first_line of the 
+ * 	file. If a row fails, the ones before it are still added, and lineno 
+ * 	is set to its line. The batch is left empty.
+ */
+static error_t add_csv_batch (csv_batch* b, int first_line, int* lineno) 
+{
+	error_t err = pool_parallel_for(0, b->count, 1, convert_csv_rows, b);
+
+	for (int r = 0; r < b->count; r++) {
+		if (err == E_SUCCESS && b->errors[r] != E_SUCCESS) {
+			err = b->errors[r];
+			*lineno = first_line + r;
+		}
+		if (err == E_SUCCESS) {
+			err = add_cml_data(b->ds, b->data[r]);
+			if (err != E_SUCCESS)
+				*lineno = first_line + r;
+		}
+
+		/* Rows from the one that failed onwards aren't in the data set */
+		if (err != E_SUCCESS && b->data[r] != NULL)
+			free_cml_data(b->data[r]);
+
+		for (int i = 0; i < b->sizes[r]; i++)
+			free(b->rows[r][i]);
+		free(b->rows[r]);
+	}
+
+	b->count = 0;
+	return err;
+}
+
+
+/* convert_csv_rows
+ *
+ * 	Checks the rows [begin, end) of a csv_batch against the feature types
+ * 	and converts them to cml_data, leaving the result of each in the 
+ * 	batch.
+ */
+static error_t convert_csv_rows (void* arg, size_t begin, size_t end) 
+{
+	csv_batch* b = arg;
+
+	for (size_t r = begin; r < end; r++) {
+		b->data[r] = NULL;
+		b->errors[r] = validate_csv_row(b->ds, b->rows[r], b->sizes[r]);
+		if (b->errors[r] != E_SUCCESS)
+			continue;
+
+		b->data[r] = init_cml_data();
+		b->errors[r] = str_to_cml_data(b->ds, b->data[r], b->rows[r], b->sizes[r]);
+	}
+	return E_SUCCESS;
+}
+
+
 /* str_to_cml_data */
 static error_t str_to_cml_data (data_set* ds, cml_data* data, char** str, int count) 
 {
@@ -105,6 +105,17 @@ error_t add_to_cml_data(cml_data* data, void* value);
 error_t cml_data_to_matrix(cml_data* data, matrix_t** m);
 
 
+/**
+ * cml_data_to_matrix_into() - Convert the cml_data into an existing matrix_t
+ * @data: Data to be converted
+ * @m: Initialized vector with @data->count rows
+ *
+ * Same as cml_data_to_matrix() without allocating anything, returns 
+ * E_MATRIX_WRONG_DIM if @m is not the right size.
+ */
+error_t cml_data_to_matrix_into(cml_data* data, matrix_t* m);
+
+
 /**
  * matrix_to_cml_data() - Convert matrix_t to cml_data
  * @m: Matrix to be converted
@@ -29,6 +29,17 @@ struct _errorstr {
 	{ E_WRONG_INPUT_SIZE, "Input data does not match input node amount" },
 	{ E_WRONG_OUTPUT_SIZE, "Output data does not match output node amount" },
 	{ E_NO_CALLBACK_GIVEN, "No callback provided, check function docs" },
+	{ E_CSV_INVALID_ROW, "Invalid row in CSV file" },
+	{ E_CSV_PARSE_ERR, "Failed to parse CSV file" },
+	{ E_CSV_INVALID_COLUMN_VALUE, "Invalid column value in CSV file" },
+	{ E_CSV_INVALID_LINE_LENGTH, "CSV line has the wrong number of columns" },
+	{ E_CSV_FAILED_TO_CONVERT, "Failed to convert CSV value to a number" },
+	{ E_NO_MORE_ITEMS, "No more items" },
+	{ E_INVALID_FEATURE_COUNT, "Invalid feature count" },
+	{ E_NO_INPUT_FEATURES_SPECIFIED, "No input features specified" },
+	{ E_INVALID_TRAINING_SPLIT, "Invalid training split, must be between 0 and 1" },
+	{ E_INVALID_BATCH_SIZE, "Invalid batch size, must be positive" },
+	{ E_INVALID_THREAD_COUNT, "Invalid thread count, must be positive" },
 };
 
 void print_cml_error (FILE* fh, char* message, error_t err) 
@@ -0,0 +1,538 @@
+/*	Vector kernel template, this file is included by matrix-kernels.c once for
+ *	each instruction set. Before including it, define:
+ *
+ *	KERNEL_NAME => Suffix given to every function, ie. avx2
+ *	KERNEL_TARGET => Function attribute enabling the instruction set
+ *	VEC_BYTES => Width of a vector register in bytes
+ *	GEMM_MR => Rows of the gemm register tile, the tile is two vectors wide
+ *
+ *	The kernels are written with the GCC/clang vector extensions so the same
+ *	code compiles to SSE2, AVX2 or AVX-512 depending on VEC_BYTES and the
+ *	target attribute. Loads and stores go through memcpy() so they do not
+ *	assume alignment, the compiler turns these into single unaligned moves.
+ *
+ *	There is intentionally no include guard.
+ */
+
+#define KCAT_(a, b) a ## _ ## b
+#define KCAT(a, b) KCAT_(a, b)
+#define KSTR_(a) #a
+#define KSTR(a) KSTR_(a)
+#define KFN(fn) KCAT(fn, KERNEL_NAME)
+#define KVEC KCAT(vec, KERNEL_NAME)
+#define KIVEC KCAT(ivec, KERNEL_NAME)
+
+#define LANES (VEC_BYTES / sizeof(cml_real))
+
+typedef cml_real KVEC __attribute__((vector_size(VEC_BYTES)));
+
+/* Integer vector of the same layout, used for comparison masks and for 
+ * working on the bits of the values */
+#ifdef CML_SINGLE_PRECISION
+typedef int32_t KIVEC __attribute__((vector_size(VEC_BYTES)));
+#else
+typedef int64_t KIVEC __attribute__((vector_size(VEC_BYTES)));
+#endif
+
+#define VLOAD(v, p) memcpy(&(v), (p), sizeof(KVEC))
+#define VSTORE(p, v) memcpy((p), &(v), sizeof(KVEC))
+/* x - 0 is x for every x, including -0, so this folds away, unlike 0 + x */
+#define VSPLAT(s) ((s) - (KVEC){ 0 })
+/* Lanes of a where mask is set, otherwise b */
+#define VSELECT(mask, a, b) ((KVEC)(((KIVEC)(a) & (mask)) | ((KIVEC)(b) & ~(mask))))
+
+#define GEMM_NR (2 * LANES)
+
+
+/* Sum of all lanes of a vector */
+static inline KERNEL_TARGET __attribute__((always_inline))
+cml_real KFN(hsum) (KVEC v)
+{
+	cml_real sum = 0;
+	for (size_t k = 0; k < LANES; k++)
+		sum += v[k];
+	return sum;
+}
+
+
+/* vexp
+ *
+ * 	exp() of each lane. x is clamped so the result stays finite and normal,
+ * 	then split into x = n * ln2 + r with |r| <= ln2 / 2. exp(r) is a Taylor
+ * 	polynomial and 2^n is built directly in the exponent bits. The error is
+ * 	within a few ulp of libm exp() over the clamped range, or within 3e-6 
+ * 	relative when fast is set. fast is always a constant.
+ */
+static inline KERNEL_TARGET __attribute__((always_inline))
+KVEC KFN(vexp) (KVEC x, int fast)
+{
+	x = VSELECT(x < VSPLAT(EXP_LO), VSPLAT(EXP_LO), x);
+	x = VSELECT(x > VSPLAT(EXP_HI), VSPLAT(EXP_HI), x);
+
+	/* Adding the shifter leaves round(x / ln2) in the low bits of t */
+	const KVEC t = x * VSPLAT(EXP_LOG2E) + VSPLAT(EXP_SHIFTER);
+	const KVEC n = t - VSPLAT(EXP_SHIFTER);
+	const KVEC r = fast ? x - n * VSPLAT(EXP_LN2)
+		: x - n * VSPLAT(EXP_LN2_HI) - n * VSPLAT(EXP_LN2_LO);
+
+	const int degree = fast ? EXP_FAST_DEGREE : EXP_DEGREE;
+	KVEC p = VSPLAT(exp_coef[degree]);
+	for (int k = degree - 1; k >= 0; k--)
+		p = p * r + VSPLAT(exp_coef[k]);
+
+	const KIVEC ni = (KIVEC)t - (KIVEC)VSPLAT(EXP_SHIFTER);
+	const KVEC scale = (KVEC)((ni + EXP_BIAS) << EXP_MANT_BITS);
+	return p * scale;
+}
+
+
+/* vtanh
+ *
+ * 	tanh() of each lane, as 1 - 2 / (exp(2|x|) + 1) with the sign put back.
+ * 	That loses relative precision as x goes to 0, so below TANH_SMALL the 
+ * 	Taylor series is used instead. When fast is set only the absolute error
+ * 	matters, and the series is skipped.
+ */
+static inline KERNEL_TARGET __attribute__((always_inline))
+KVEC KFN(vtanh) (KVEC x, int fast)
+{
+	const KIVEC sign = (KIVEC)x & (KIVEC)VSPLAT((cml_real)-0.0);
+	const KVEC ax = (KVEC)((KIVEC)x ^ sign);
+
+	const KVEC e = KFN(vexp)(ax + ax, fast);
+	KVEC res = VSPLAT(1) - VSPLAT(2) / (e + VSPLAT(1));
+
+	if (!fast) {
+		const KVEC x2 = ax * ax;
+		KVEC p = VSPLAT(tanh_coef[TANH_TERMS - 1]);
+		for (int k = TANH_TERMS - 2; k >= 0; k--)
+			p = p * x2 + VSPLAT(tanh_coef[k]);
+
+		res = VSELECT(ax < VSPLAT(TANH_SMALL), ax * p, res);
+	}
+	return (KVEC)((KIVEC)res | sign);
+}
+
+
+/* vact and vact_grad
+ *
+ * 	The built-in activations and their derivatives for a vector, as in 
+ * 	kernel_act(). The derivatives take the output of the activation. Any
+ * 	other type is left as is.
+ */
+static inline KERNEL_TARGET __attribute__((always_inline))
+KVEC KFN(vact) (KVEC x, act_func_t act)
+{
+	switch (act) {
+		case SIGMOID:
+			return VSPLAT(1) / (VSPLAT(1) + KFN(vexp)(-x, 0));
+		case SIGMOID_FAST:
+			return VSPLAT(1) / (VSPLAT(1) + KFN(vexp)(-x, 1));
+		case TANH:
+			return KFN(vtanh)(x, 0);
+		case TANH_FAST:
+			return KFN(vtanh)(x, 1);
+		case RELU:
+			return VSELECT(x > VSPLAT(0), x, VSPLAT(0));
+		case LEAKY_RELU:
+			return VSELECT(x > VSPLAT(0), x, x * VSPLAT(LEAKY_RELU_SLOPE));
+		case SOFTMAX:
+			return KFN(vexp)(x, 0);
+		default:
+			return x;
+	}
+}
+
+static inline KERNEL_TARGET __attribute__((always_inline))
+KVEC KFN(vact_grad) (KVEC y, act_func_t act)
+{
+	switch (act) {
+		case SIGMOID:
+		case SIGMOID_FAST:
+			return y * (VSPLAT(1) - y);
+		case TANH:
+		case TANH_FAST:
+			return VSPLAT(1) - y * y;
+		case RELU:
+			return VSELECT(y > VSPLAT(0), VSPLAT(1), VSPLAT(0));
+		case LEAKY_RELU:
+			return VSELECT(y > VSPLAT(0), VSPLAT(1), VSPLAT(LEAKY_RELU_SLOPE));
+		default:
+			return VSPLAT(1);
+	}
+}
+
+
+/* act_body and act_grad_body
+ *
+ * 	Loops for the act and act_grad kernels. act is always a constant, so
+ * 	each activation gets its own copy of the loop with the switch in 
+ * 	vact() folded away. The last partial vector goes through a zero padded
+ * 	vector, so every value gets the same approximation.
+ */
+static inline KERNEL_TARGET __attribute__((always_inline))
+void KFN(act_body) (cml_real* y, size_t n, cml_real bias, act_func_t act)
+{
+	const KVEC bv = VSPLAT(bias);
+	size_t i = 0;
+
+	for (; i + LANES <= n; i += LANES) {
+		KVEC v;
+		VLOAD(v, y + i);
+		v = KFN(vact)(v + bv, act);
+		VSTORE(y + i, v);
+	}
+
+	if (i < n) {
+		KVEC v = VSPLAT(0);
+		memcpy(&v, y + i, sizeof(cml_real) * (n - i));
+		v = KFN(vact)(v + bv, act);
+		memcpy(y + i, &v, sizeof(cml_real) * (n - i));
+	}
+}
+
+static inline KERNEL_TARGET __attribute__((always_inline))
+void KFN(act_grad_body) (cml_real* e, const cml_real* y, size_t n, act_func_t act)
+{
+	size_t i = 0;
+
+	for (; i + LANES <= n; i += LANES) {
+		KVEC ev, yv;
+		VLOAD(ev, e + i);
+		VLOAD(yv, y + i);
+		ev *= KFN(vact_grad)(yv, act);
+		VSTORE(e + i, ev);
+	}
+
+	if (i < n) {
+		KVEC ev = VSPLAT(0), yv = VSPLAT(0);
+		memcpy(&ev, e + i, sizeof(cml_real) * (n - i));
+		memcpy(&yv, y + i, sizeof(cml_real) * (n - i));
+		ev *= KFN(vact_grad)(yv, act);
+		memcpy(e + i, &ev, sizeof(cml_real) * (n - i));
+	}
+}
+
+static KERNEL_TARGET void KFN(act) (cml_real* y, size_t n, cml_real bias, act_func_t act)
+{
+	switch (act) {
+		case SIGMOID:
+			KFN(act_body)(y, n, bias, SIGMOID);
+			break;
+		case TANH:
+			KFN(act_body)(y, n, bias, TANH);
+			break;
+		case SIGMOID_FAST:
+			KFN(act_body)(y, n, bias, SIGMOID_FAST);
+			break;
+		case TANH_FAST:
+			KFN(act_body)(y, n, bias, TANH_FAST);
+			break;
+		case RELU:
+			KFN(act_body)(y, n, bias, RELU);
+			break;
+		case LEAKY_RELU:
+			KFN(act_body)(y, n, bias, LEAKY_RELU);
+			break;
+		case SOFTMAX:
+			KFN(act_body)(y, n, bias, SOFTMAX);
+			break;
+		default:
+			KFN(act_body)(y, n, bias, CUSTOM);
+			break;
+	}
+}
+
+static KERNEL_TARGET void KFN(act_grad) (cml_real* e, const cml_real* y, size_t n,
+		act_func_t act)
+{
+	switch (act) {
+		case SIGMOID:
+			KFN(act_grad_body)(e, y, n, SIGMOID);
+			break;
+		case TANH:
+			KFN(act_grad_body)(e, y, n, TANH);
+			break;
+		case SIGMOID_FAST:
+			KFN(act_grad_body)(e, y, n, SIGMOID_FAST);
+			break;
+		case TANH_FAST:
+			KFN(act_grad_body)(e, y, n, TANH_FAST);
+			break;
+		case RELU:
+			KFN(act_grad_body)(e, y, n, RELU);
+			break;
+		case LEAKY_RELU:
+			KFN(act_grad_body)(e, y, n, LEAKY_RELU);
+			break;
+		default:
+			break;
+	}
+}
+
+
+/* gemv
+ *
+ * 	Rows are handled four at a time so each load of x is shared by four
+ * 	rows, with a plain single row loop for what is left over.
+ */
+static KERNEL_TARGET void KFN(gemv) (const cml_real* a, size_t stride, const cml_real* x,
+		cml_real* y, size_t rows, size_t columns)
+{
+	const size_t vend = columns - columns % LANES;
+	size_t i = 0;
+
+	for (; i + 4 <= rows; i += 4) {
+		const cml_real* r0 = a + i * stride;
+		const cml_real* r1 = r0 + stride;
+		const cml_real* r2 = r1 + stride;
+		const cml_real* r3 = r2 + stride;
+		KVEC acc0 = { 0 }, acc1 = { 0 }, acc2 = { 0 }, acc3 = { 0 };
+		size_t j = 0;
+
+		for (; j < vend; j += LANES) {
+			KVEC xv, av;
+			VLOAD(xv, x + j);
+			VLOAD(av, r0 + j); acc0 += av * xv;
+			VLOAD(av, r1 + j); acc1 += av * xv;
+			VLOAD(av, r2 + j); acc2 += av * xv;
+			VLOAD(av, r3 + j); acc3 += av * xv;
+		}
+
+		cml_real s0 = KFN(hsum)(acc0), s1 = KFN(hsum)(acc1);
+		cml_real s2 = KFN(hsum)(acc2), s3 = KFN(hsum)(acc3);
+		for (; j < columns; j++) {
+			s0 += r0[j] * x[j];
+			s1 += r1[j] * x[j];
+			s2 += r2[j] * x[j];
+			s3 += r3[j] * x[j];
+		}
+		y[i] = s0;
+		y[i + 1] = s1;
+		y[i + 2] = s2;
+		y[i + 3] = s3;
+	}
+
+	for (; i < rows; i++) {
+		const cml_real* r = a + i * stride;
+		KVEC acc0 = { 0 }, acc1 = { 0 };
+		size_t j = 0;
+
+		for (; j + 2 * LANES <= vend; j += 2 * LANES) {
+			KVEC xv, av;
+			VLOAD(xv, x + j); VLOAD(av, r + j); acc0 += av * xv;
+			VLOAD(xv, x + j + LANES); VLOAD(av, r + j + LANES); acc1 += av * xv;
+		}
+		for (; j < vend; j += LANES) {
+			KVEC xv, av;
+			VLOAD(xv, x + j); VLOAD(av, r + j); acc0 += av * xv;
+		}
+
+		cml_real s = KFN(hsum)(acc0 + acc1);
+		for (; j < columns; j++)
+			s += r[j] * x[j];
+		y[i] = s;
+	}
+}
+
+
+/* gemv_act
+ *
+ * 	The activation is applied to y right after the product, while y is 
+ * 	still in L1.
+ */
+static KERNEL_TARGET void KFN(gemv_act) (const cml_real* a, size_t stride, 
+		const cml_real* x, cml_real* y, size_t rows, size_t columns, cml_real bias, 
+		act_func_t act)
+{
+	KFN(gemv)(a, stride, x, y, rows, columns);
+	KFN(act)(y, rows, bias, act);
+}
+
+
+/* gemv_t
+ *
+ * 	Walks A row by row, adding x[i] times row i into y. Four rows are folded 
+ * 	in per pass so y is only loaded and stored once for every four rows.
+ */
+static KERNEL_TARGET void KFN(gemv_t) (const cml_real* a, size_t stride, const cml_real* x,
+		cml_real* y, size_t rows, size_t columns)
+{
+	const size_t vend = columns - columns % LANES;
+	size_t i = 0;
+
+	memset(y, 0, sizeof(cml_real) * columns);
+
+	for (; i + 4 <= rows; i += 4) {
+		const cml_real* r0 = a + i * stride;
+		const cml_real* r1 = r0 + stride;
+		const cml_real* r2 = r1 + stride;
+		const cml_real* r3 = r2 + stride;
+		const KVEC x0 = VSPLAT(x[i]), x1 = VSPLAT(x[i + 1]);
+		const KVEC x2 = VSPLAT(x[i + 2]), x3 = VSPLAT(x[i + 3]);
+		size_t j = 0;
+
+		for (; j < vend; j += LANES) {
+			KVEC yv, av;
+			VLOAD(yv, y + j);
+			VLOAD(av, r0 + j); yv += av * x0;
+			VLOAD(av, r1 + j); yv += av * x1;
+			VLOAD(av, r2 + j); yv += av * x2;
+			VLOAD(av, r3 + j); yv += av * x3;
+			VSTORE(y + j, yv);
+		}
+		for (; j < columns; j++)
+			y[j] += r0[j] * x[i] + r1[j] * x[i + 1] + r2[j] * x[i + 2] + r3[j] * x[i + 3];
+	}
+
+	for (; i < rows; i++) {
+		const cml_real* r = a + i * stride;
+		const KVEC xv = VSPLAT(x[i]);
+		size_t j = 0;
+
+		for (; j < vend; j += LANES) {
+			KVEC yv, av;
+			VLOAD(yv, y + j);
+			VLOAD(av, r + j); yv += av * xv;
+			VSTORE(y + j, yv);
+		}
+		for (; j < columns; j++)
+			y[j] += r[j] * x[i];
+	}
+}
+
+
+/* rank1_update
+ *
+ * 	Each element of A (and D) is loaded and stored exactly once.
+ */
+static KERNEL_TARGET void KFN(rank1_update) (cml_real* a, size_t stride, cml_real* d,
+		size_t dstride, const cml_real* x, const cml_real* y, size_t rows, size_t columns,
+		cml_real alpha, cml_real beta)
+{
+	const size_t vend = columns - columns % LANES;
+	const KVEC bv = VSPLAT(beta);
+
+	for (size_t i = 0; i < rows; i++) {
+		cml_real* row = a + i * stride;
+		const cml_real ax = alpha * x[i];
+		const KVEC axv = VSPLAT(ax);
+		size_t j = 0;
+
+		if (d == NULL) {
+			for (; j < vend; j += LANES) {
+				KVEC av, yv;
+				VLOAD(av, row + j);
+				VLOAD(yv, y + j);
+				av -= axv * yv;
+				VSTORE(row + j, av);
+			}
+			for (; j < columns; j++)
+				row[j] -= ax * y[j];
+			continue;
+		}
+
+		cml_real* drow = d + i * dstride;
+		for (; j < vend; j += LANES) {
+			KVEC av, yv, dv;
+			VLOAD(av, row + j);
+			VLOAD(yv, y + j);
+			VLOAD(dv, drow + j);
+			dv = axv * yv + bv * dv;
+			av -= dv;
+			VSTORE(drow + j, dv);
+			VSTORE(row + j, av);
+		}
+		for (; j < columns; j++) {
+			cml_real delta = ax * y[j] + beta * drow[j];
+			drow[j] = delta;
+			row[j] -= delta;
+		}
+	}
+}
+
+
+/* gemm_micro
+ *
+ * 	Adds the product of a packed GEMM_MR x k panel of A and a packed 
+ * 	k x GEMM_NR panel of B into C. The accumulators for the whole tile are
+ * 	held in registers, so each step of k is one load of B and GEMM_MR 
+ * 	broadcasts of A feeding 2 * GEMM_MR multiply-adds. Only the top left 
+ * 	m x n of the tile is written, for the tiles on the edges of C.
+ */
+static KERNEL_TARGET void KFN(gemm_micro) (size_t k, const cml_real* a, const cml_real* b,
+		cml_real* c, size_t ldc, size_t m, size_t n)
+{
+	KVEC acc[GEMM_MR][2];
+
+	for (size_t i = 0; i < GEMM_MR; i++)
+		acc[i][0] = acc[i][1] = VSPLAT(0);
+
+	for (size_t p = 0; p < k; p++) {
+		KVEC b0, b1;
+		VLOAD(b0, b);
+		VLOAD(b1, b + LANES);
+
+#pragma GCC unroll 16
+		for (size_t i = 0; i < GEMM_MR; i++) {
+			const KVEC av = VSPLAT(a[i]);
+			acc[i][0] += av * b0;
+			acc[i][1] += av * b1;
+		}
+		a += GEMM_MR;
+		b += GEMM_NR;
+	}
+
+	if (m == GEMM_MR && n == GEMM_NR) {
+		for (size_t i = 0; i < GEMM_MR; i++) {
+			cml_real* row = c + i * ldc;
+			KVEC c0, c1;
+			VLOAD(c0, row);
+			VLOAD(c1, row + LANES);
+			c0 += acc[i][0];
+			c1 += acc[i][1];
+			VSTORE(row, c0);
+			VSTORE(row + LANES, c1);
+		}
+		return;
+	}
+
+	for (size_t i = 0; i < m; i++)
+		for (size_t j = 0; j < n; j++)
+			c[i * ldc + j] += acc[i][j / LANES][j % LANES];
+}
+
+static void KFN(gemm) (int trans_a, int trans_b, size_t m, size_t n, size_t k,
+		const cml_real* a, size_t lda, const cml_real* b, size_t ldb, cml_real* c,
+		size_t ldc, cml_real* work)
+{
+	gemm_blocked(KFN(gemm_micro), GEMM_MR, GEMM_NR, trans_a, trans_b, m, n, k,
+			a, lda, b, ldb, c, ldc, work);
+}
+
+
+static const matrix_kernels KFN(kernels) = {
+	.name = KSTR(KERNEL_NAME),
+	.gemv = KFN(gemv),
+	.gemv_act = KFN(gemv_act),
+	.gemv_t = KFN(gemv_t),
+	.rank1_update = KFN(rank1_update),
+	.gemm = KFN(gemm),
+	.act = KFN(act),
+	.act_grad = KFN(act_grad),
+};
+
+
+#undef KCAT_
+#undef KCAT
+#undef KSTR_
+#undef KSTR
+#undef KFN
+#undef KVEC
+#undef KIVEC
+#undef LANES
+#undef VLOAD
+#undef VSTORE
+#undef VSPLAT
+#undef VSELECT
+#undef GEMM_NR
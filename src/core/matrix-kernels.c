@@ -0,0 +1,551 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tgmath.h>
+#include "cml-internal.h"
+#include "matrix-kernels.h"
+
+
+/* Micro kernel of gemm, see gemm_blocked() */
+typedef void (*gemm_micro_fn) (size_t k, const cml_real* a, const cml_real* b,
+		cml_real* c, size_t ldc, size_t m, size_t n);
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define ROUND_UP(x, to) (((x) + (to) - 1) / (to) * (to))
+
+
+/* kernel_act and kernel_act_grad
+ *
+ * 	The built-in activations and their derivatives as the scalar kernels
+ * 	apply them. The derivatives are worked out from the output y = f(x), 
+ * 	which saves computing f() again.
+ */
+static inline cml_real kernel_act (cml_real x, act_func_t act)
+{
+	switch (act) {
+		case SIGMOID:
+			return 1 / (1 + exp(-x));
+		case TANH:
+			return tanh(x);
+		case SIGMOID_FAST:
+			return sigmoid_approx(x);
+		case TANH_FAST:
+			return tanh_approx(x);
+		case RELU:
+			return (x > 0) ? x : 0;
+		case LEAKY_RELU:
+			return (x > 0) ? x : LEAKY_RELU_SLOPE * x;
+		case SOFTMAX:
+			return exp(x);
+		default:
+			return x;
+	}
+}
+
+static inline cml_real kernel_act_grad (cml_real y, act_func_t act)
+{
+	switch (act) {
+		case SIGMOID:
+		case SIGMOID_FAST:
+			return y * (1 - y);
+		case TANH:
+		case TANH_FAST:
+			return 1 - y * y;
+		case RELU:
+			return (y > 0) ? 1 : 0;
+		case LEAKY_RELU:
+			return (y > 0) ? 1 : LEAKY_RELU_SLOPE;
+		default:
+			return 1;
+	}
+}
+
+
+/* Constants for the vector exp() and tanh() in matrix-kernels-impl.h. 
+ *
+ * 	EXP_LO and EXP_HI clamp the input so the result stays finite and normal.
+ * 	EXP_SHIFTER is 1.5 * 2^mantissa bits, adding it rounds to an integer. 
+ * 	ln2 is split in two so that n * EXP_LN2_HI is exact. The polynomial 
+ * 	degrees are where the next Taylor term drops below an ulp.
+ *
+ * 	The approximate activations use EXP_FAST_DEGREE instead and a single
+ * 	step reduction, which keeps exp() within 3e-6 of its value.
+ */
+#ifdef CML_SINGLE_PRECISION
+#	define EXP_LO ((cml_real)-87.0)
+#	define EXP_HI ((cml_real)88.0)
+#	define EXP_SHIFTER ((cml_real)12582912.0)
+#	define EXP_LN2_HI ((cml_real)0.693359375)
+#	define EXP_LN2_LO ((cml_real)-2.12194440e-4)
+#	define EXP_BIAS 127
+#	define EXP_MANT_BITS 23
+#	define EXP_DEGREE 7
+#	define TANH_TERMS 3
+#else
+#	define EXP_LO ((cml_real)-708.0)
+#	define EXP_HI ((cml_real)709.0)
+#	define EXP_SHIFTER ((cml_real)6755399441055744.0)
+#	define EXP_LN2_HI ((cml_real)6.93147180369123816490e-01)
+#	define EXP_LN2_LO ((cml_real)1.90821492927058770002e-10)
+#	define EXP_BIAS 1023
+#	define EXP_MANT_BITS 52
+#	define EXP_DEGREE 12
+#	define TANH_TERMS 6
+#endif
+#define EXP_LOG2E ((cml_real)1.44269504088896340736)
+#define EXP_LN2 ((cml_real)0.69314718055994530942)
+#define EXP_FAST_DEGREE 5
+#define TANH_SMALL ((cml_real)0.0625)
+
+/* 1 / k!, the Taylor series of exp() */
+static const cml_real exp_coef[] = {
+	1.0, 1.0, 1.0 / 2, 1.0 / 6, 1.0 / 24, 1.0 / 120, 1.0 / 720, 1.0 / 5040,
+	1.0 / 40320, 1.0 / 362880, 1.0 / 3628800, 1.0 / 39916800, 1.0 / 479001600,
+};
+
+/* Taylor series of tanh(x) / x in powers of x^2 */
+static const cml_real tanh_coef[] = {
+	1.0, -1.0 / 3, 2.0 / 15, -17.0 / 315, 62.0 / 2835, -1382.0 / 155925,
+};
+
+
+/* gemm_work_size() */
+size_t gemm_work_size (size_t m, size_t n, size_t k)
+{
+	size_t kc = MIN(k, GEMM_KC);
+	return ROUND_UP(MIN(m, GEMM_MC), GEMM_MAX_MR) * kc
+		+ ROUND_UP(MIN(n, GEMM_NC), GEMM_MAX_NR) * kc;
+}
+
+
+/* pack_a
+ *
+ * 	Copies an m x k block of A into panels of mr rows. Within a panel the mr
+ * 	values of each column are next to each other, which is the order the
+ * 	micro kernel reads them in. The last panel is padded with zeros.
+ */
+static void pack_a (const cml_real* a, size_t a_row, size_t a_col, size_t m, size_t k,
+		size_t mr, cml_real* pack)
+{
+	for (size_t i = 0; i < m; i += mr) {
+		size_t rows = MIN(mr, m - i);
+
+		for (size_t p = 0; p < k; p++) {
+			const cml_real* src = a + i * a_row + p * a_col;
+			size_t r = 0;
+
+			for (; r < rows; r++)
+				pack[r] = src[r * a_row];
+			for (; r < mr; r++)
+				pack[r] = 0;
+			pack += mr;
+		}
+	}
+}
+
+
+/* pack_b
+ *
+ * 	Same as pack_a() for a k x n block of B, in panels of nr columns with the
+ * 	nr values of each row next to each other.
+ */
+static void pack_b (const cml_real* b, size_t b_row, size_t b_col, size_t k, size_t n,
+		size_t nr, cml_real* pack)
+{
+	for (size_t j = 0; j < n; j += nr) {
+		size_t cols = MIN(nr, n - j);
+
+		for (size_t p = 0; p < k; p++) {
+			const cml_real* src = b + p * b_row + j * b_col;
+			size_t c = 0;
+
+			if (b_col == 1) {
+				memcpy(pack, src, sizeof(cml_real) * cols);
+				c = cols;
+			} else {
+				for (; c < cols; c++)
+					pack[c] = src[c * b_col];
+			}
+			for (; c < nr; c++)
+				pack[c] = 0;
+			pack += nr;
+		}
+	}
+}
+
+
+/* gemm_blocked
+ *
+ * 	The gemm driver every kernel set shares, only the micro kernel and its
+ * 	mr x nr register tile differ. The product is split into blocks that fit
+ * 	the caches (see GEMM_MC etc.), and both blocks are packed into the order
+ * 	the micro kernel reads them so its loads are all sequential. The micro
+ * 	kernel then adds an mr x nr tile of C at a time, keeping the whole tile
+ * 	in registers over the full GEMM_KC long slice.
+ */
+static void gemm_blocked (gemm_micro_fn micro, size_t mr, size_t nr, int trans_a,
+		int trans_b, size_t m, size_t n, size_t k, const cml_real* a, size_t lda,
+		const cml_real* b, size_t ldb, cml_real* c, size_t ldc, cml_real* work)
+{
+	/* Strides through A and B, so the packing doesn't care which operands
+	 * are transposed */
+	size_t a_row = trans_a ? 1 : lda, a_col = trans_a ? lda : 1;
+	size_t b_row = trans_b ? 1 : ldb, b_col = trans_b ? ldb : 1;
+	cml_real* pack_bbuf = work + ROUND_UP(MIN(m, GEMM_MC), GEMM_MAX_MR) * MIN(k, GEMM_KC);
+
+	for (size_t i = 0; i < m; i++)
+		memset(c + i * ldc, 0, sizeof(cml_real) * n);
+
+	for (size_t jc = 0; jc < n; jc += GEMM_NC) {
+		size_t nc = MIN(GEMM_NC, n - jc);
+
+		for (size_t pc = 0; pc < k; pc += GEMM_KC) {
+			size_t kc = MIN(GEMM_KC, k - pc);
+			pack_b(b + pc * b_row + jc * b_col, b_row, b_col, kc, nc, nr, pack_bbuf);
+
+			for (size_t ic = 0; ic < m; ic += GEMM_MC) {
+				size_t mc = MIN(GEMM_MC, m - ic);
+				pack_a(a + ic * a_row + pc * a_col, a_row, a_col, mc, kc, mr, work);
+
+				for (size_t jr = 0; jr < nc; jr += nr) {
+					for (size_t ir = 0; ir < mc; ir += mr) {
+						micro(kc, work + ir * kc, pack_bbuf + jr * kc,
+								c + (ic + ir) * ldc + jc + jr, ldc,
+								MIN(mr, mc - ir), MIN(nr, nc - jr));
+					}
+				}
+			}
+		}
+	}
+}
+
+
+/* Scalar kernels
+ *
+ * 	These are the reference implementations, used when no vector instruction
+ * 	set is available, and the behaviour every other set must match.
+ */
+static void gemv_scalar (const cml_real* a, size_t stride, const cml_real* x, cml_real* y,
+		size_t rows, size_t columns)
+{
+	for (size_t i = 0; i < rows; i++) {
+		const cml_real* row = a + i * stride;
+		cml_real sum = 0;
+
+		for (size_t j = 0; j < columns; j++)
+			sum += row[j] * x[j];
+		y[i] = sum;
+	}
+}
+
+static void act_scalar (cml_real* y, size_t n, cml_real bias, act_func_t act)
+{
+	for (size_t i = 0; i < n; i++)
+		y[i] = kernel_act(y[i] + bias, act);
+}
+
+static void act_grad_scalar (cml_real* e, const cml_real* y, size_t n, act_func_t act)
+{
+	for (size_t i = 0; i < n; i++)
+		e[i] *= kernel_act_grad(y[i], act);
+}
+
+static void gemv_act_scalar (const cml_real* a, size_t stride, const cml_real* x,
+		cml_real* y, size_t rows, size_t columns, cml_real bias, act_func_t act)
+{
+	gemv_scalar(a, stride, x, y, rows, columns);
+	act_scalar(y, rows, bias, act);
+}
+
+static void gemv_t_scalar (const cml_real* a, size_t stride, const cml_real* x, cml_real* y,
+		size_t rows, size_t columns)
+{
+	memset(y, 0, sizeof(cml_real) * columns);
+
+	for (size_t i = 0; i < rows; i++) {
+		const cml_real* row = a + i * stride;
+
+		for (size_t j = 0; j < columns; j++)
+			y[j] += row[j] * x[i];
+	}
+}
+
+static void rank1_update_scalar (cml_real* a, size_t stride, cml_real* d, size_t dstride,
+		const cml_real* x, const cml_real* y, size_t rows, size_t columns,
+		cml_real alpha, cml_real beta)
+{
+	for (size_t i = 0; i < rows; i++) {
+		cml_real* row = a + i * stride;
+		const cml_real ax = alpha * x[i];
+
+		if (d == NULL) {
+			for (size_t j = 0; j < columns; j++)
+				row[j] -= ax * y[j];
+			continue;
+		}
+
+		cml_real* drow = d + i * dstride;
+		for (size_t j = 0; j < columns; j++) {
+			cml_real delta = ax * y[j] + beta * drow[j];
+			drow[j] = delta;
+			row[j] -= delta;
+		}
+	}
+}
+
+#define SCALAR_MR 4
+#define SCALAR_NR 4
+
+static void gemm_micro_scalar (size_t k, const cml_real* a, const cml_real* b,
+		cml_real* c, size_t ldc, size_t m, size_t n)
+{
+	cml_real acc[SCALAR_MR][SCALAR_NR] = { { 0 } };
+
+	for (size_t p = 0; p < k; p++) {
+		for (size_t i = 0; i < SCALAR_MR; i++)
+			for (size_t j = 0; j < SCALAR_NR; j++)
+				acc[i][j] += a[i] * b[j];
+		a += SCALAR_MR;
+		b += SCALAR_NR;
+	}
+
+	for (size_t i = 0; i < m; i++)
+		for (size_t j = 0; j < n; j++)
+			c[i * ldc + j] += acc[i][j];
+}
+
+static void gemm_scalar (int trans_a, int trans_b, size_t m, size_t n, size_t k,
+		const cml_real* a, size_t lda, const cml_real* b, size_t ldb, cml_real* c,
+		size_t ldc, cml_real* work)
+{
+	gemm_blocked(gemm_micro_scalar, SCALAR_MR, SCALAR_NR, trans_a, trans_b, m, n, k,
+			a, lda, b, ldb, c, ldc, work);
+}
+
+static const matrix_kernels kernels_scalar = {
+	.name = "scalar",
+	.gemv = gemv_scalar,
+	.gemv_act = gemv_act_scalar,
+	.gemv_t = gemv_t_scalar,
+	.rank1_update = rank1_update_scalar,
+	.gemm = gemm_scalar,
+	.act = act_scalar,
+	.act_grad = act_grad_scalar,
+};
+
+
+/* CBLAS kernels, only built when the library is configured with CML_USE_CBLAS 
+ * and a system CBLAS (OpenBLAS, BLIS, ...) was found. These are preferred over
+ * the built-in sets when present. */
+#ifdef CML_HAVE_CBLAS
+#	include <cblas.h>
+
+#	ifdef CML_SINGLE_PRECISION
+#		define CBLAS(fn) cblas_s ## fn
+#	else
+#		define CBLAS(fn) cblas_d ## fn
+#	endif
+
+/* BLAS rejects a leading dimension of 0, even when there is nothing to do */
+#define LD(stride) ((stride) > 0 ? (stride) : 1)
+
+static void gemv_cblas (const cml_real* a, size_t stride, const cml_real* x, cml_real* y,
+		size_t rows, size_t columns)
+{
+	CBLAS(gemv)(CblasRowMajor, CblasNoTrans, rows, columns, 1, a, LD(stride), 
+			x, 1, 0, y, 1);
+}
+
+static matrix_kernels kernels_cblas;
+
+static void gemv_act_cblas (const cml_real* a, size_t stride, const cml_real* x, 
+		cml_real* y, size_t rows, size_t columns, cml_real bias, act_func_t act)
+{
+	gemv_cblas(a, stride, x, y, rows, columns);
+	kernels_cblas.act(y, rows, bias, act);
+}
+
+static void gemv_t_cblas (const cml_real* a, size_t stride, const cml_real* x, cml_real* y,
+		size_t rows, size_t columns)
+{
+	/* BLAS leaves y alone when there are no rows, rather than zeroing it */
+	if (rows == 0) {
+		memset(y, 0, sizeof(cml_real) * columns);
+		return;
+	}
+	CBLAS(gemv)(CblasRowMajor, CblasTrans, rows, columns, 1, a, LD(stride), 
+			x, 1, 0, y, 1);
+}
+
+static void rank1_update_cblas (cml_real* a, size_t stride, cml_real* d, size_t dstride,
+		const cml_real* x, const cml_real* y, size_t rows, size_t columns,
+		cml_real alpha, cml_real beta)
+{
+	if (d == NULL) {
+		CBLAS(ger)(CblasRowMajor, rows, columns, -alpha, x, 1, y, 1, a, LD(stride));
+		return;
+	}
+
+	/* BLAS has no fused form of this, so it takes three passes over D */
+	for (size_t i = 0; i < rows; i++)
+		CBLAS(scal)(columns, beta, d + i * dstride, 1);
+	CBLAS(ger)(CblasRowMajor, rows, columns, alpha, x, 1, y, 1, d, LD(dstride));
+	for (size_t i = 0; i < rows; i++)
+		CBLAS(axpy)(columns, -1, d + i * dstride, 1, a + i * stride, 1);
+}
+
+static void gemm_cblas (int trans_a, int trans_b, size_t m, size_t n, size_t k,
+		const cml_real* a, size_t lda, const cml_real* b, size_t ldb, cml_real* c,
+		size_t ldc, cml_real* work)
+{
+	CBLAS(gemm)(CblasRowMajor, trans_a ? CblasTrans : CblasNoTrans, 
+			trans_b ? CblasTrans : CblasNoTrans, m, n, k, 1, a, LD(lda), b, LD(ldb), 
+			0, c, LD(ldc));
+}
+
+/* BLAS has no activations, act and act_grad are filled in on load from the
+ * best built-in set, see select_matrix_kernels() */
+static matrix_kernels kernels_cblas = {
+	.name = "cblas",
+	.gemv = gemv_cblas,
+	.gemv_act = gemv_act_cblas,
+	.gemv_t = gemv_t_cblas,
+	.rank1_update = rank1_update_cblas,
+	.gemm = gemm_cblas,
+	.act = act_scalar,
+	.act_grad = act_grad_scalar,
+};
+
+#	undef CBLAS
+#	undef LD
+#endif
+
+
+/* Vector kernels, only built for x86 where the instruction set can be
+ * checked at runtime */
+#if defined(__x86_64__) || defined(__i386__)
+#	define HAVE_X86_KERNELS 1
+
+#	define KERNEL_NAME sse2
+#	define KERNEL_TARGET __attribute__((target("sse2")))
+#	define VEC_BYTES 16
+#	define GEMM_MR 4
+#	include "matrix-kernels-impl.h"
+#	undef KERNEL_NAME
+#	undef KERNEL_TARGET
+#	undef VEC_BYTES
+#	undef GEMM_MR
+
+#	define KERNEL_NAME avx2
+#	define KERNEL_TARGET __attribute__((target("avx2,fma")))
+#	define VEC_BYTES 32
+#	define GEMM_MR 6
+#	include "matrix-kernels-impl.h"
+#	undef KERNEL_NAME
+#	undef KERNEL_TARGET
+#	undef VEC_BYTES
+#	undef GEMM_MR
+
+#	define KERNEL_NAME avx512
+#	define KERNEL_TARGET __attribute__((target("avx512f")))
+#	define VEC_BYTES 64
+#	define GEMM_MR 12
+#	include "matrix-kernels-impl.h"
+#	undef KERNEL_NAME
+#	undef KERNEL_TARGET
+#	undef VEC_BYTES
+#	undef GEMM_MR
+#endif
+
+
+/* Every kernel set, best first, so the first supported one is picked */
+static const matrix_kernels* const all_kernels[] = {
+#ifdef CML_HAVE_CBLAS
+	&kernels_cblas,
+#endif
+#ifdef HAVE_X86_KERNELS
+	&kernels_avx512,
+	&kernels_avx2,
+	&kernels_sse2,
+#endif
+	&kernels_scalar,
+};
+
+#define KERNEL_SET_COUNT (sizeof(all_kernels) / sizeof(all_kernels[0]))
+
+const matrix_kernels* mkernels = &kernels_scalar;
+static const matrix_kernels* selected_kernels = &kernels_scalar;
+
+
+/* kernels_supported
+ *
+ * 	Checks the CPU can run the given kernel set.
+ */
+static int kernels_supported (const matrix_kernels* k)
+{
+#ifdef CML_HAVE_CBLAS
+	if (k == &kernels_cblas)
+		return 1;
+#endif
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+
+	if (k == &kernels_avx512)
+		return __builtin_cpu_supports("avx512f");
+	if (k == &kernels_avx2)
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	if (k == &kernels_sse2)
+		return __builtin_cpu_supports("sse2");
+#endif
+	return k == &kernels_scalar;
+}
+
+
+/* find_matrix_kernels() */
+const matrix_kernels* find_matrix_kernels (const char* name)
+{
+	if (name == NULL) return NULL;
+
+	for (size_t i = 0; i < KERNEL_SET_COUNT; i++) {
+		if (strcmp(all_kernels[i]->name, name) == 0)
+			return kernels_supported(all_kernels[i]) ? all_kernels[i] : NULL;
+	}
+	return NULL;
+}
+
+
+/* set_matrix_kernels() */
+void set_matrix_kernels (const matrix_kernels* k)
+{
+	mkernels = (k == NULL) ? selected_kernels : k;
+}
+
+
+/* Run on load to pick the widest kernel set the CPU supports, unless one is
+ * forced through CML_SIMD */
+__attribute__((constructor))
+static void select_matrix_kernels ()
+{
+#ifdef CML_HAVE_CBLAS
+	for (size_t i = 0; i < KERNEL_SET_COUNT; i++) {
+		if (all_kernels[i] != &kernels_cblas && kernels_supported(all_kernels[i])) {
+			kernels_cblas.act = all_kernels[i]->act;
+			kernels_cblas.act_grad = all_kernels[i]->act_grad;
+			break;
+		}
+	}
+#endif
+	const matrix_kernels* forced = find_matrix_kernels(getenv("CML_SIMD"));
+
+	if (forced != NULL) {
+		selected_kernels = forced;
+	} else {
+		for (size_t i = 0; i < KERNEL_SET_COUNT; i++) {
+			if (kernels_supported(all_kernels[i])) {
+				selected_kernels = all_kernels[i];
+				break;
+			}
+		}
+	}
+	mkernels = selected_kernels;
+}
@@ -0,0 +1,116 @@
+#ifndef _MATRIX_KERNELS_H_
+#define _MATRIX_KERNELS_H_
+
+#include <stddef.h>
+#include "cml.h"
+
+/*	This header holds the low level kernels that the operations in matrix.c are
+ *	built on. Each kernel works on raw row-major buffers (see matrix_t for the
+ *	layout) and does no argument checking, that is left to matrix.c.
+ *
+ *	There is one set of kernels for each instruction set the library is built
+ *	for. The widest set the CPU supports is picked once when the library is
+ *	loaded, so a single libcml.so runs on any x86 machine while still using
+ *	AVX2 or AVX-512 where available. The scalar set is always available and is
+ *	the only one on other architectures.
+ *
+ *	When built with CML_USE_CBLAS, there is also a set that hands the work to
+ *	the system CBLAS, and it is picked ahead of the built-in ones.
+ */
+
+
+/* Cache blocking of gemm, see gemm_blocked() in matrix-kernels.c. A block of 
+ * GEMM_MC x GEMM_KC of A stays in L2 while it is multiplied with a 
+ * GEMM_KC x GEMM_NC block of B that stays in L3, and each GEMM_KC long slice
+ * of B the register tile works on stays in L1. GEMM_MC must be a multiple
+ * of the row count of every register tile, GEMM_NC of every column count. */
+#define GEMM_MC 96
+#define GEMM_KC 256
+#define GEMM_NC 2048
+
+/* Largest register tile of any kernel set, two 64 byte vectors wide */
+#define GEMM_MAX_MR 12
+#define GEMM_MAX_NR (2 * 64 / sizeof(cml_real))
+
+
+/* struct matrix_kernels
+ *
+ * 	Table of kernels for a single instruction set.
+ *
+ * 	gemv => y = A * x, where A is rows x columns with the given row stride.
+ * 	gemv_act => y = f(A * x + bias) in a single call, with f applied while y 
+ * 		is still in cache, see act.
+ * 	gemv_t => y = A^T * x, reading A in its stored layout. y has columns values.
+ * 	rank1_update => D = alpha * x * y^T + beta * D, then A -= D, in one pass over
+ * 		A and D. D has its own stride, and may be NULL in which case the
+ * 		update is just A -= alpha * x * y^T.
+ * 	gemm => C = op(A) * op(B), where op(A) is m x k and op(B) is k x n, as in
+ * 		BLAS. If trans_a is set, A is stored as k x m and read transposed,
+ * 		likewise for B. lda, ldb and ldc are the row strides of the stored
+ * 		matrices. work is scratch space of at least gemm_work_size() values,
+ * 		aligned to 64 bytes.
+ * 	act => y = f(y + bias) for n values, where f is the activation act. 
+ * 		All built-in types are supported, CUSTOM only adds the bias. For
+ * 		SOFTMAX f is exp(), the normalisation is left to the caller.
+ * 		The vector sets use approximations of exp() and tanh() that are 
+ * 		within a few ulp of libm, or within the documented error of the
+ * 		_FAST types.
+ * 	act_grad => e = e * f'(x) for n values, worked out from y = f(x), the
+ * 		output of the activation act. CUSTOM and SOFTMAX leave e as is.
+ */
+typedef struct matrix_kernels {
+	const char* name;
+	void (*gemv) (const cml_real* a, size_t stride, const cml_real* x, cml_real* y,
+			size_t rows, size_t columns);
+	void (*gemv_act) (const cml_real* a, size_t stride, const cml_real* x, cml_real* y,
+			size_t rows, size_t columns, cml_real bias, act_func_t act);
+	void (*gemv_t) (const cml_real* a, size_t stride, const cml_real* x, cml_real* y,
+			size_t rows, size_t columns);
+	void (*rank1_update) (cml_real* a, size_t stride, cml_real* d, size_t dstride,
+			const cml_real* x, const cml_real* y, size_t rows, size_t columns,
+			cml_real alpha, cml_real beta);
+	void (*gemm) (int trans_a, int trans_b, size_t m, size_t n, size_t k,
+			const cml_real* a, size_t lda, const cml_real* b, size_t ldb, cml_real* c,
+			size_t ldc, cml_real* work);
+	void (*act) (cml_real* y, size_t n, cml_real bias, act_func_t act);
+	void (*act_grad) (cml_real* e, const cml_real* y, size_t n, act_func_t act);
+} matrix_kernels;
+
+
+/* The kernel set currently in use, never NULL */
+extern const matrix_kernels* mkernels;
+
+
+/* gemm_work_size
+ *
+ * 	Number of values of scratch space gemm needs for the given sizes, for
+ * 	any kernel set. This is never more than what is needed for the full
+ * 	cache blocks, so it stays bounded for large products.
+ */
+size_t gemm_work_size (size_t m, size_t n, size_t k);
+
+
+/* find_matrix_kernels
+ *
+ * 	Look up a kernel set by name ("scalar", "sse2", "avx2", "avx512", or 
+ * 	"cblas" when built with it).
+ *
+ * 	Returns NULL if there is no set with that name, or the CPU does not
+ * 	support the instruction set it needs.
+ */
+const matrix_kernels* find_matrix_kernels (const char* name);
+
+
+/* set_matrix_kernels
+ *
+ * 	Switch the kernel set used by matrix.c. This is only meant for testing and
+ * 	benchmarking the different sets against each other, it is not thread safe.
+ * 	Passing NULL goes back to the set picked on load.
+ *
+ * 	The CML_SIMD environment variable may also be set to one of the names above
+ * 	to override the selection made on load.
+ */
+void set_matrix_kernels (const matrix_kernels* k);
+
+
+#endif
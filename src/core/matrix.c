@@ -1,6 +1,15 @@
+/* posix_memalign() */
+#define _POSIX_C_SOURCE 200112L
+
 #include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
 #include "matrix.h"
+#include "matrix-kernels.h"
+#include "cml-internal.h"
 #include "mpool.h"
+#include "thread-pool.h"
 
 /* 
  * This is the memory pool for the matrix_t* data type. For full docs, see the
@@ -8,12 +17,103 @@
  */
 struct mpool* matrix_pool = NULL;
 
+/* Held while matrix_pool is grown, so only one thread grows it at a time */
+static pthread_mutex_t matrix_pool_grow = PTHREAD_MUTEX_INITIALIZER;
+
+/* Smallest matrix, in values, whose product with a vector is split by rows 
+ * between the threads of the pool. Smaller ones take no longer than 
+ * handing out the work does. */
+#define GEMV_PARALLEL_MIN (1 << 17)
+
+/* Values of the matrix each thread is given at least, and the rows its 
+ * share is a multiple of. The block is a multiple of the row tile and 
+ * vector length of every kernel set, so each value comes out the same as
+ * when the whole product is done in one call. */
+#define GEMV_PARALLEL_GRAIN (1 << 15)
+#define GEMV_BLOCK_ROWS 64
+
+/* gemv_job
+ *
+ * 	A product split by gemv_rows(), with the activation applied in the
+ * 	same pass if fused is set.
+ */
+typedef struct gemv_job {
+	matrix_t* m;
+	const cml_real* x;
+	cml_real* y;
+	int fused;
+	cml_real bias;
+	act_func_t act;
+} gemv_job;
+
+/* Scratch space for packing the operands of matrix_matrix_mult(), one per 
+ * thread. It only grows, up to the size of the gemm cache blocks. */
+static __thread cml_real* gemm_work = NULL;
+static __thread size_t gemm_work_len = 0;
+
+/* Set for each thread that owns buffers above, so they are freed when it 
+ * exits. The main thread's are freed in end() instead. */
+static pthread_key_t thread_buffers_key;
+static pthread_once_t thread_buffers_once = PTHREAD_ONCE_INIT;
+
 void __setup_mpool(int count) 
 {	
 	mpool_error e = init_mpool(sizeof(matrix_t), count, &matrix_pool);
 	assert(e == MPOOL_SUCCESS);
 }
 
+/* scratch_block
+ *
+ *	One block of a thread's scratch arena. Blocks are chained from the 
+ *	newest back to the first, and values are handed out from data 
+ *	upwards. The header takes a full cache line so data stays aligned.
+ */
+typedef struct scratch_block {
+	struct scratch_block* prev;
+	size_t size; // Values in data
+	size_t used;
+	size_t total; // Sum of size over this block and all before it
+	cml_real data[] __attribute__((aligned(MATRIX_ALIGNMENT)));
+} scratch_block;
+
+/* Values in the first block of a thread's scratch arena */
+#define SCRATCH_BLOCK_SIZE (16384 / sizeof(cml_real))
+
+/* Newest block of this thread's scratch arena, NULL until first used */
+static __thread scratch_block* scratch = NULL;
+
+
+/* free_thread_buffers
+ *
+ *	Run when a thread that used gemm_workspace() or the scratch arena 
+ *	exits, see thread_buffers_key.
+ */
+static void free_thread_buffers (void* unused) 
+{
+	(void)unused;
+	free(gemm_work);
+	gemm_work = NULL;
+	gemm_work_len = 0;
+	scratch_free();
+}
+
+static void create_thread_buffers_key (void) 
+{
+	pthread_key_create(&thread_buffers_key, free_thread_buffers);
+}
+
+/* track_thread_buffers
+ *
+ *	Makes sure this thread's buffers are freed when it exits. Only needs
+ *	to be called when one is allocated.
+ */
+static void track_thread_buffers (void) 
+{
+	pthread_once(&thread_buffers_once, create_thread_buffers_key);
+	if (pthread_getspecific(thread_buffers_key) == NULL)
+		pthread_setspecific(thread_buffers_key, (void*)1);
+}
+
 /* Run on startup to seed rng. This is temporary, atleast till the move to 
  * CUDA is done. */
 __attribute__((constructor))
@@ -28,51 +128,147 @@ __attribute__((destructor))
 static void end() 
 {
 	free_mpool(matrix_pool);	
+	free(gemm_work);
+	scratch_free();
 }
 
-error_t init_matrix(matrix_t** m, unsigned int rows, unsigned int columns) 
+/* matrix_stride
+ *
+ *	Row stride used for a matrix of the given size. Vectors are kept dense so
+ *	their values can be walked linearly, everything else has its rows padded
+ *	out to the alignment boundary.
+ */
+static unsigned int matrix_stride (unsigned int rows, unsigned int columns) 
+{
+	const unsigned int per_line = MATRIX_ALIGNMENT / sizeof(cml_real);
+
+	if (rows <= 1 || columns <= 1)
+		return columns;
+	return (columns + per_line - 1) / per_line * per_line;
+}
+
+
+/* gemm_workspace
+ *
+ * 	Returns this thread's gemm scratch space, grown to hold at least size
+ * 	values, or NULL if it could not be allocated.
+ */
+static cml_real* gemm_workspace (size_t size) 
+{
+	if (size <= gemm_work_len)
+		return gemm_work;
+
+	void* work;
+	if (posix_memalign(&work, MATRIX_ALIGNMENT, sizeof(cml_real) * size) != 0)
+		return NULL;
+
+	free(gemm_work);
+	gemm_work = work;
+	gemm_work_len = size;
+	track_thread_buffers();
+	return gemm_work;
+}
+
+
+/* alloc_matrix_header
+ *
+ *	Takes a matrix_t from the pool, growing the pool if it is full, and 
+ *	fills out its size. The caller sets up matrix.
+ */
+static matrix_t* alloc_matrix_header (unsigned int rows, unsigned int columns) 
 {
-	if (m == NULL) return E_NULL_ARG;
 	if (matrix_pool == NULL) __setup_mpool(100);
 
 	mpool_error e;
-
-try:	
-	*m = (matrix_t*) mpool_alloc(matrix_pool, &e);
+	matrix_t* m = (matrix_t*) mpool_alloc(matrix_pool, &e);
 	
-	/* Ensure there was enough room to alloc */
+	/* Ensure there was enough room to alloc. The pool is grown under the 
+	 * lock, and each try to alloc again is too, since another thread may 
+	 * have grown it while this one waited */
 	if (e != MPOOL_SUCCESS) {
-		print_mpool_error(stdout, "Could not alloc", e);
-		printf("Trying to realloc\n");
-		e = mpool_realloc(mpool_capacity(matrix_pool) + 50, matrix_pool);
-		
-		if (e != MPOOL_SUCCESS) {
-			print_mpool_error(stdout, "Could not realloc", e);
-			printf("Failed to realloc\n");
-			exit(-1);
+		pthread_mutex_lock(&matrix_pool_grow);
+
+		for (;;) {
+			m = (matrix_t*) mpool_alloc(matrix_pool, &e);
+			if (e == MPOOL_SUCCESS) break;
+
+			print_mpool_error(stdout, "Could not alloc", e);
+			printf("Trying to realloc\n");
+			e = mpool_realloc(mpool_capacity(matrix_pool) + 50, matrix_pool);
+			
+			if (e != MPOOL_SUCCESS) {
+				print_mpool_error(stdout, "Could not realloc", e);
+				printf("Failed to realloc\n");
+				exit(-1);
+			}
 		}
-		goto try;
+
+		pthread_mutex_unlock(&matrix_pool_grow);
 	}
 		
-	(*m)->rows = rows;
-	(*m)->columns = columns;
-	(*m)->matrix = malloc(sizeof(double*) * rows);
+	m->rows = rows;
+	m->columns = columns;
+	m->stride = matrix_stride(rows, columns);
+	m->matrix = NULL;
+	m->owner = MATRIX_OWNED;
+	return m;
+}
 
-	for (int i = 0; i < rows; i++) { 
-		(*m)->matrix[i] = malloc(sizeof(double) * columns);
-		
-		/* Ensure all values are set to 0 */
-		for (int j = 0; j < columns; j++) 
-			(*m)->matrix[i][j] = 0;
+
+size_t matrix_buffer_size(unsigned int rows, unsigned int columns) 
+{
+	const size_t per_line = MATRIX_ALIGNMENT / sizeof(cml_real);
+	size_t size = (size_t)rows * matrix_stride(rows, columns);
+
+	/* Round up so the buffer always ends on an aligned boundary as well */
+	return (size + per_line - 1) / per_line * per_line;
+}
+
+
+error_t init_matrix(matrix_t** m, unsigned int rows, unsigned int columns) 
+{
+	if (m == NULL) return E_NULL_ARG;
+
+	*m = alloc_matrix_header(rows, columns);
+
+	size_t size = matrix_buffer_size(rows, columns) * sizeof(cml_real);
+	if (size == 0)
+		return E_SUCCESS;
+
+	if (posix_memalign((void**)&(*m)->matrix, MATRIX_ALIGNMENT, size) != 0) {
+		mpool_dealloc(*m, matrix_pool);
+		*m = NULL;
+		return E_ALLOC_FAILURE;
 	}
+
+	/* Ensure all values are set to 0, including the padding */
+	memset((*m)->matrix, 0, size);
 	return E_SUCCESS;
 }
 
 
-error_t matrix_vector_mult(matrix_t* m, matrix_t* vec, matrix_t** result) 
+error_t init_matrix_view(matrix_t** m, unsigned int rows, unsigned int columns, 
+		cml_real* data) 
 {
-	
-	if (m == NULL || vec == NULL || result == NULL)
+	if (m == NULL || data == NULL) return E_NULL_ARG;
+	assert((uintptr_t)data % MATRIX_ALIGNMENT == 0);
+
+	*m = alloc_matrix_header(rows, columns);
+	(*m)->matrix = data;
+	(*m)->owner = MATRIX_VIEW;
+	return E_SUCCESS;
+}
+
+
+/* check_matrix_vector
+ *
+ *	Shared argument checks for the matrix-vector products. The vector must 
+ *	have inner values, which is m->columns for m * vec, or m->rows for the 
+ *	transposed product.
+ */
+static error_t check_matrix_vector (matrix_t* m, matrix_t* vec, unsigned int inner) 
+{
+	if (m == NULL || vec == NULL)
 		return E_NULL_ARG;
 
 	if ( (vec->rows > 1 && vec->columns > 1) || vec->columns < 1 || vec->rows < 1) 
@@ -81,35 +277,234 @@ error_t matrix_vector_mult(matrix_t* m, matrix_t* vec, matrix_t** result)
 	if (m->rows < 1 || m->columns < 1)
 		return E_ZERO_DIM_MATRIX;
 	
-	if (m->columns != vec->rows)
+	if (inner != vec->rows)
 		return E_MATRIX_WRONG_DIM;
+	return E_SUCCESS;
+}
 
-	init_matrix(result, m->rows, 1);
-	
-	/* init_matrix() garuntees that all values are set to 0 on init, so
-	 * we can immediately use the += operator */
-	for (int i = 0; i < m->rows; i++) {
-		for (int j = 0; j < m->columns; j++) {
-			(*result)->matrix[i][0] += m->matrix[i][j] * vec->matrix[j][0];
-		}
+
+/* check_dest
+ *
+ *	Checks a caller provided destination has the given size. 
+ */
+static error_t check_dest (matrix_t* dest, unsigned int rows, unsigned int columns) 
+{
+	if (dest == NULL)
+		return E_NULL_ARG;
+
+	if (dest->rows != rows || dest->columns != columns)
+		return E_MATRIX_WRONG_DIM;
+	return E_SUCCESS;
+}
+
+
+/* gemv_blocks
+ *
+ * 	The blocks of GEMV_BLOCK_ROWS rows [begin, end) of a gemv_job.
+ */
+static error_t gemv_blocks (void* arg, size_t begin, size_t end) 
+{
+	gemv_job* job = arg;
+	matrix_t* m = job->m;
+	size_t first = begin * GEMV_BLOCK_ROWS;
+	size_t last = end * GEMV_BLOCK_ROWS;
+	if (last > m->rows) last = m->rows;
+
+	const cml_real* a = m->matrix + first * m->stride;
+	if (job->fused)
+		mkernels->gemv_act(a, m->stride, job->x, job->y + first, last - first, 
+				m->columns, job->bias, job->act);
+	else
+		mkernels->gemv(a, m->stride, job->x, job->y + first, last - first, m->columns);
+	return E_SUCCESS;
+}
+
+
+/* gemv_rows
+ *
+ * 	y = m * x, or f(m * x + bias) for the activation act if fused is set.
+ * 	Large products are split by rows between the threads of the pool, 
+ * 	unless this is already running on it.
+ */
+static void gemv_rows (matrix_t* m, const cml_real* x, cml_real* y, int fused, 
+		cml_real bias, act_func_t act) 
+{
+	size_t size = (size_t)m->rows * m->columns;
+	size_t blocks = (m->rows + GEMV_BLOCK_ROWS - 1) / GEMV_BLOCK_ROWS;
+
+	if (size >= GEMV_PARALLEL_MIN && blocks > 1 && !pool_in_task() && pool_size() > 1) {
+		gemv_job job = { m, x, y, fused, bias, act };
+		size_t block_size = (size_t)GEMV_BLOCK_ROWS * m->columns;
+		size_t grain = (GEMV_PARALLEL_GRAIN + block_size - 1) / block_size;
+		pool_parallel_for(0, blocks, grain, gemv_blocks, &job);
+		return;
+	}
+
+	if (fused)
+		mkernels->gemv_act(m->matrix, m->stride, x, y, m->rows, m->columns, bias, act);
+	else
+		mkernels->gemv(m->matrix, m->stride, x, y, m->rows, m->columns);
+}
+
+
+error_t matrix_vector_mult(matrix_t* m, matrix_t* vec, matrix_t** result) 
+{
+	if (result == NULL)
+		return E_NULL_ARG;
+
+	error_t err = check_matrix_vector(m, vec, m ? m->columns : 0);
+	if (err != E_SUCCESS) return err;
+
+	err = init_matrix(result, m->rows, 1);
+	if (err != E_SUCCESS) return err;
+
+	return matrix_vector_mult_into(m, vec, *result);
+}
+
+
+error_t matrix_vector_mult_into(matrix_t* m, matrix_t* vec, matrix_t* result) 
+{
+	error_t err = check_matrix_vector(m, vec, m ? m->columns : 0);
+	if (err != E_SUCCESS) return err;
+
+	err = check_dest(result, m->rows, 1);
+	if (err != E_SUCCESS) return err;
+
+	/* Vectors are dense, so vec and result can be handed to the kernel as is */
+	gemv_rows(m, vec->matrix, result->matrix, 0, 0, CUSTOM);
+	return E_SUCCESS;
+}
+
+
+error_t matrix_vector_mult_act_into(matrix_t* m, matrix_t* vec, cml_real bias, 
+		activation_f* actf, matrix_t* preact, matrix_t* result) 
+{
+	if (actf == NULL)
+		return E_NULL_ARG;
+
+	error_t err = check_matrix_vector(m, vec, m ? m->columns : 0);
+	if (err != E_SUCCESS) return err;
+
+	err = check_dest(result, m->rows, 1);
+	if (err != E_SUCCESS) return err;
+
+	/* Keeping z or softmax, which needs the whole vector, means the 
+	 * activation is done on its own afterwards */
+	if (preact != NULL || actf->type == SOFTMAX) {
+		gemv_rows(m, vec->matrix, result->matrix, 0, 0, CUSTOM);
+		return activation_forward(actf, result, bias, preact);
 	}
+
+	gemv_rows(m, vec->matrix, result->matrix, 1, bias, actf->type);
+
+	if (actf->type == CUSTOM)
+		return map_vector(result, actf->af);
+	return E_SUCCESS;
+}
+
+
+error_t matrix_transpose_vector_mult(matrix_t* m, matrix_t* vec, matrix_t** result) 
+{
+	if (result == NULL)
+		return E_NULL_ARG;
+
+	error_t err = check_matrix_vector(m, vec, m ? m->rows : 0);
+	if (err != E_SUCCESS) return err;
+
+	err = init_matrix(result, m->columns, 1);
+	if (err != E_SUCCESS) return err;
+
+	return matrix_transpose_vector_mult_into(m, vec, *result);
+}
+
+
+error_t matrix_transpose_vector_mult_into(matrix_t* m, matrix_t* vec, matrix_t* result) 
+{
+	error_t err = check_matrix_vector(m, vec, m ? m->rows : 0);
+	if (err != E_SUCCESS) return err;
+
+	err = check_dest(result, m->columns, 1);
+	if (err != E_SUCCESS) return err;
+
+	mkernels->gemv_t(m->matrix, m->stride, vec->matrix, result->matrix, 
+			m->rows, m->columns);
+	return E_SUCCESS;
+}
+
+
+error_t matrix_matrix_mult(matrix_t* a, int trans_a, matrix_t* b, int trans_b, 
+		matrix_t** result) 
+{
+	if (a == NULL || b == NULL || result == NULL)
+		return E_NULL_ARG;
+
+	unsigned int m = trans_a ? a->columns : a->rows;
+	unsigned int ka = trans_a ? a->rows : a->columns;
+	unsigned int kb = trans_b ? b->columns : b->rows;
+	unsigned int n = trans_b ? b->rows : b->columns;
+
+	if (ka != kb)
+		return E_MATRIX_WRONG_DIM;
+
+	error_t err = init_matrix(result, m, n);
+	if (err != E_SUCCESS) return err;
+
+	return matrix_matrix_mult_into(a, trans_a, b, trans_b, *result);
+}
+
+
+error_t matrix_matrix_mult_into(matrix_t* a, int trans_a, matrix_t* b, int trans_b, 
+		matrix_t* result) 
+{
+	if (a == NULL || b == NULL || result == NULL)
+		return E_NULL_ARG;
+
+	unsigned int m = trans_a ? a->columns : a->rows;
+	unsigned int k = trans_a ? a->rows : a->columns;
+	unsigned int kb = trans_b ? b->columns : b->rows;
+	unsigned int n = trans_b ? b->rows : b->columns;
+
+	if (k != kb)
+		return E_MATRIX_WRONG_DIM;
+
+	error_t err = check_dest(result, m, n);
+	if (err != E_SUCCESS) return err;
+
+	cml_real* work = gemm_workspace(gemm_work_size(m, n, k));
+	if (work == NULL)
+		return E_ALLOC_FAILURE;
+
+	mkernels->gemm(trans_a, trans_b, m, n, k, a->matrix, a->stride, b->matrix, 
+			b->stride, result->matrix, result->stride, work);
 	return E_SUCCESS;
 }
 
 
-error_t matrix_scalar_mult (matrix_t* m, double scalar) 
+error_t matrix_scalar_mult (matrix_t* m, cml_real scalar) 
 {
 	if (m == NULL) return E_NULL_ARG;
 
-	for (int i = 0; i < m->rows; i++) {
-		for (int j = 0; j < m->columns; j++) {
-			m->matrix[i][j] *= scalar;
-		}
+	for (unsigned int i = 0; i < m->rows; i++) {
+		cml_real* row = &MATRIX_AT(m, i, 0);
+		for (unsigned int j = 0; j < m->columns; j++) 
+			row[j] *= scalar;
 	}	
 	return E_SUCCESS;
 }
 
-error_t vector_scalar_addition (matrix_t* m, double scalar) 
+error_t matrix_scalar_addition (matrix_t* m, cml_real scalar) 
+{
+	if (m == NULL) return E_NULL_ARG;
+
+	for (unsigned int i = 0; i < m->rows; i++) {
+		cml_real* row = &MATRIX_AT(m, i, 0);
+		for (unsigned int j = 0; j < m->columns; j++) 
+			row[j] += scalar;
+	}	
+	return E_SUCCESS;
+}
+
+error_t vector_scalar_addition (matrix_t* m, cml_real scalar) 
 {	
 	if (m == NULL)
 		return E_NULL_ARG;
@@ -120,26 +515,26 @@ error_t vector_scalar_addition (matrix_t* m, double scalar)
 	if (m->rows < 1 || m->columns < 1)
 		return E_ZERO_DIM_MATRIX;
 
-	for(int i = 0; i < m->rows; i++) 
-		m->matrix[i][0] += scalar;	
+	for (unsigned int i = 0; i < m->rows; i++) 
+		MATRIX_AT(m, i, 0) += scalar;	
 	
 	return E_SUCCESS;
 }
 
 
-error_t map_vector (matrix_t* vec, double (*f)(double)) 
+error_t map_vector (matrix_t* vec, cml_real (*f)(cml_real)) 
 {
 	if (f == NULL)
 		return E_NULL_ARG;
 	
-	for (int i = 0; i < vec->rows; i++) 
-		vec->matrix[i][0] = (*f)(vec->matrix[i][0]);
+	for (unsigned int i = 0; i < vec->rows; i++) 
+		MATRIX_AT(vec, i, 0) = (*f)(MATRIX_AT(vec, i, 0));
 	
 	return E_SUCCESS;
 }
 
 
-error_t map_matrix (matrix_t* m, double(*f)(double)) 
+error_t map_matrix (matrix_t* m, cml_real (*f)(cml_real)) 
 {
 	if (m == NULL || f == NULL) 
 		return E_NULL_ARG;
@@ -147,10 +542,10 @@ error_t map_matrix (matrix_t* m, double(*f)(double))
 	if (m->rows < 1 || m->columns < 1)
 		return E_ZERO_DIM_MATRIX;
 
-	for (int i = 0; i < m->rows; i++) {
-		for (int j = 0; j < m->columns; j++) {
-			m->matrix[i][j] = (*f)(m->matrix[i][j]);
-		}
+	for (unsigned int i = 0; i < m->rows; i++) {
+		cml_real* row = &MATRIX_AT(m, i, 0);
+		for (unsigned int j = 0; j < m->columns; j++) 
+			row[j] = (*f)(row[j]);
 	}
 	return E_SUCCESS;
 }
@@ -165,12 +560,31 @@ error_t matrix_subtraction (matrix_t* m, matrix_t* n, matrix_t** result)
 	if (m->rows != n->rows || m->columns != n->columns)
 		return E_MATRIX_WRONG_DIM;
 
-	init_matrix(result, m->rows, m->columns);
+	error_t err = init_matrix(result, m->rows, m->columns);
+	if (err != E_SUCCESS) return err;
 	
-	for (int i = 0; i < m->rows; i++) {
-		for (int j = 0; j < m->columns; j++) {
-			(*result)->matrix[i][j] = m->matrix[i][j] - n->matrix[i][j];
-		}
+	return matrix_subtraction_into(m, n, *result);
+}
+
+
+error_t matrix_subtraction_into (matrix_t* m, matrix_t* n, matrix_t* result) 
+{
+	if (m == NULL || n == NULL || result == NULL)
+		return E_NULL_ARG;
+	
+	if (m->rows != n->rows || m->columns != n->columns)
+		return E_MATRIX_WRONG_DIM;
+
+	error_t err = check_dest(result, m->rows, m->columns);
+	if (err != E_SUCCESS) return err;
+
+	for (unsigned int i = 0; i < m->rows; i++) {
+		const cml_real* mrow = &MATRIX_AT(m, i, 0);
+		const cml_real* nrow = &MATRIX_AT(n, i, 0);
+		cml_real* rrow = &MATRIX_AT(result, i, 0);
+
+		for (unsigned int j = 0; j < m->columns; j++) 
+			rrow[j] = mrow[j] - nrow[j];
 	}
 	return E_SUCCESS;
 }
@@ -179,15 +593,10 @@ error_t matrix_subtraction (matrix_t* m, matrix_t* n, matrix_t** result)
 error_t transpose (matrix_t** m) 
 {
 	matrix_t* old_matrix = *m;
-	//matrix_t* new_matrix = malloc(sizeof(matrix_t));
-	matrix_t* new_matrix;
-	init_matrix(&new_matrix, (*m)->columns, (*m)->rows);
-	
-	for (int i = 0; i < new_matrix->columns; i++) {
-		for (int j = 0; j < new_matrix->rows; j++) {
-			new_matrix->matrix[j][i] = old_matrix->matrix[i][j]; 
-		}
-	}
+	matrix_t* new_matrix = transpose_r(old_matrix);
+
+	if (new_matrix == NULL)
+		return E_ALLOC_FAILURE;
 
 	/* Free memory of old matrix and point m to new one */
 	free_matrix(old_matrix);
@@ -196,24 +605,38 @@ error_t transpose (matrix_t** m)
 }
 
 
+/* Size of the square tiles transpose_r() works in, 8x8 values keeps both the 
+ * source and destination tile within a handful of cache lines */
+#define TRANSPOSE_BLOCK 8
+
 matrix_t* transpose_r (matrix_t* const m) 
 {
-	//matrix_t* new_matrix = malloc(sizeof(matrix_t));
 	matrix_t* new_matrix;
-	init_matrix(&new_matrix, m->columns, m->rows);
-
-	for (int i = 0; i < new_matrix->columns; i++) {
-		for (int j = 0; j < new_matrix->rows; j++) {
-			new_matrix->matrix[j][i] = m->matrix[i][j]; 
+	if (init_matrix(&new_matrix, m->columns, m->rows) != E_SUCCESS)
+		return NULL;
+
+	for (unsigned int ib = 0; ib < m->rows; ib += TRANSPOSE_BLOCK) {
+		for (unsigned int jb = 0; jb < m->columns; jb += TRANSPOSE_BLOCK) {
+			unsigned int iend = ib + TRANSPOSE_BLOCK < m->rows ? ib + TRANSPOSE_BLOCK : m->rows;
+			unsigned int jend = jb + TRANSPOSE_BLOCK < m->columns ? jb + TRANSPOSE_BLOCK : m->columns;
+
+			for (unsigned int i = ib; i < iend; i++) {
+				for (unsigned int j = jb; j < jend; j++) 
+					MATRIX_AT(new_matrix, j, i) = MATRIX_AT(m, i, j);
+			}
 		}
 	}
 	return new_matrix;	
 }
 
 
-error_t multiply_vector(matrix_t* m, matrix_t* n, matrix_t** result) 
+/* check_multiply_vector
+ *
+ *	Argument checks for the multiply_vector() family.
+ */
+static error_t check_multiply_vector (matrix_t* m, matrix_t* n) 
 {
-	if (m == NULL || n == NULL || result == NULL)
+	if (m == NULL || n == NULL)
 		return E_NULL_ARG;
 
 	if (m->columns > 1 || n->columns > 1)
@@ -224,89 +647,224 @@ error_t multiply_vector(matrix_t* m, matrix_t* n, matrix_t** result)
 	
 	if (m->rows != n->rows)
 		return E_MATRIX_WRONG_DIM;
+	return E_SUCCESS;
+}
+
+
+error_t multiply_vector(matrix_t* m, matrix_t* n, matrix_t** result) 
+{
+	if (result == NULL)
+		return E_NULL_ARG;
+
+	error_t err = check_multiply_vector(m, n);
+	if (err != E_SUCCESS) return err;
+
+	err = init_matrix(result, m->rows, m->columns);
+	if (err != E_SUCCESS) return err;
+
+	return multiply_vector_into(m, n, *result);
+}
 
-	init_matrix(result, m->rows, m->columns);
-	for (int i = 0; i < m->rows; i++) 
-		(*result)->matrix[i][0] = m->matrix[i][0] * n->matrix[i][0];
+
+error_t multiply_vector_into(matrix_t* m, matrix_t* n, matrix_t* result) 
+{
+	error_t err = check_multiply_vector(m, n);
+	if (err != E_SUCCESS) return err;
+
+	err = check_dest(result, m->rows, m->columns);
+	if (err != E_SUCCESS) return err;
+
+	for (unsigned int i = 0; i < m->rows; i++) 
+		result->matrix[i] = m->matrix[i] * n->matrix[i];
 	return E_SUCCESS;
 }
 
 
 matrix_t* random_matrix (unsigned int rows, unsigned int columns, double interval) 
 {
-	//matrix_t* random_matrix = malloc(sizeof(matrix_t));
 	matrix_t* random_matrix;
-	init_matrix(&random_matrix, rows, columns);
+	if (init_matrix(&random_matrix, rows, columns) != E_SUCCESS)
+		return NULL;
+
+	randomize_matrix(random_matrix, interval);
+	return random_matrix;
+}
+
+
+error_t randomize_matrix (matrix_t* m, double interval) 
+{
+	if (m == NULL) return E_NULL_ARG;
 	double div = RAND_MAX / (interval * 2);
 
-	for (int i = 0; i < rows; i++) {
-		for (int j = 0; j < columns; j++) {
-			random_matrix->matrix[i][j] = -interval + (rand() / div);
+	for (unsigned int i = 0; i < m->rows; i++) {
+		for (unsigned int j = 0; j < m->columns; j++) {
+			MATRIX_AT(m, i, j) = -interval + (rand() / div);
 		}
 	}	
-	return random_matrix;
+	return E_SUCCESS;
 }
 
 
-error_t kronecker_vectors (matrix_t* vec1, matrix_t* vec2, matrix_t** result) 
+/* kronecker_orient
+ *
+ *	Works out which of the two vectors given to kronecker_vectors() is the 
+ *	horizontal one.
+ */
+static error_t kronecker_orient (matrix_t* vec1, matrix_t* vec2, 
+		matrix_t** vertical_v, matrix_t** horiz_v) 
 {
-	if (vec1 == NULL || vec2 == NULL || result == NULL)
+	if (vec1 == NULL || vec2 == NULL)
 		return E_NULL_ARG;
-	
-	unsigned int rows, columns;
-	matrix_t *vertical_v, *horiz_v;
 
-	/* Determine matrix dimensions and which is horizontal vector */
 	if (vec1->rows == 1 && vec1->columns > 1) {
-		rows = vec2->rows;
-		columns = vec1->columns;
-		horiz_v = vec1;
-		vertical_v = vec2;
+		*horiz_v = vec1;
+		*vertical_v = vec2;
 	} else if (vec2->rows == 1 && vec2->columns >= 1) {
-		rows = vec1->rows;
-		columns = vec2->columns;
-		horiz_v = vec2;
-		vertical_v = vec1;
+		*horiz_v = vec2;
+		*vertical_v = vec1;
 	} else { 
 		return E_NOT_VECTOR;	
 	}
+	return E_SUCCESS;
+}
 
-	init_matrix(result, rows, columns);
-	for (int i = 0; i < rows; i++) {
-		for (int j = 0; j < columns; j++) {
-			(*result)->matrix[i][j] = vertical_v->matrix[i][0] * horiz_v->matrix[0][j];
-		}
+
+error_t kronecker_vectors (matrix_t* vec1, matrix_t* vec2, matrix_t** result) 
+{
+	if (result == NULL)
+		return E_NULL_ARG;
+	
+	matrix_t *vertical_v, *horiz_v;
+	error_t err = kronecker_orient(vec1, vec2, &vertical_v, &horiz_v);
+	if (err != E_SUCCESS) return err;
+
+	err = init_matrix(result, vertical_v->rows, horiz_v->columns);
+	if (err != E_SUCCESS) return err;
+
+	return kronecker_vectors_into(vec1, vec2, *result);
+}
+
+
+error_t kronecker_vectors_into (matrix_t* vec1, matrix_t* vec2, matrix_t* result) 
+{
+	matrix_t *vertical_v, *horiz_v;
+	error_t err = kronecker_orient(vec1, vec2, &vertical_v, &horiz_v);
+	if (err != E_SUCCESS) return err;
+
+	unsigned int rows = vertical_v->rows;
+	unsigned int columns = horiz_v->columns;
+
+	err = check_dest(result, rows, columns);
+	if (err != E_SUCCESS) return err;
+
+	/* Both vectors are dense */
+	const cml_real* x = vertical_v->matrix;
+	const cml_real* y = horiz_v->matrix;
+
+	for (unsigned int i = 0; i < rows; i++) {
+		cml_real* row = &MATRIX_AT(result, i, 0);
+		for (unsigned int j = 0; j < columns; j++) 
+			row[j] = x[i] * y[j];
 	}	
 
 	return E_SUCCESS;
 }
 
 
-error_t copy_matrix (matrix_t* src, matrix_t** dest) 
+error_t matrix_rank1_update (matrix_t* m, matrix_t* delta, matrix_t* vec1, matrix_t* vec2,
+		cml_real rate, cml_real momentum) 
 {
-	if (src == NULL || dest == NULL)
+	if (m == NULL || vec1 == NULL || vec2 == NULL)
 		return E_NULL_ARG;
 
-	init_matrix(dest, src->rows, src->columns);
+	if ((vec1->rows > 1 && vec1->columns > 1) || (vec2->rows > 1 && vec2->columns > 1))
+		return E_NOT_VECTOR;
+
+	/* Vectors are dense, so rows * columns is the length of either orientation */
+	if (vec1->rows * vec1->columns != m->rows || vec2->rows * vec2->columns != m->columns)
+		return E_MATRIX_WRONG_DIM;
+
+	if (delta != NULL && (delta->rows != m->rows || delta->columns != m->columns))
+		return E_MATRIX_WRONG_DIM;
+
+	if (m->rows < 1 || m->columns < 1)
+		return E_SUCCESS;
+
+	mkernels->rank1_update(m->matrix, m->stride, 
+			delta ? delta->matrix : NULL, delta ? delta->stride : 0,
+			vec1->matrix, vec2->matrix, m->rows, m->columns, rate, momentum);
+	return E_SUCCESS;
+}
+
+
+error_t matrix_gradient_update (matrix_t* m, matrix_t* delta, matrix_t* grad, 
+		cml_real rate, cml_real momentum) 
+{
+	if (m == NULL || grad == NULL)
+		return E_NULL_ARG;
+
+	if (grad->rows != m->rows || grad->columns != m->columns)
+		return E_MATRIX_WRONG_DIM;
+
+	if (delta != NULL && (delta->rows != m->rows || delta->columns != m->columns))
+		return E_MATRIX_WRONG_DIM;
+
+	for (unsigned int i = 0; i < m->rows; i++) {
+		cml_real* row = &MATRIX_AT(m, i, 0);
+		const cml_real* grow = &MATRIX_AT(grad, i, 0);
+
+		if (delta == NULL) {
+			for (unsigned int j = 0; j < m->columns; j++) 
+				row[j] -= rate * grow[j];
+			continue;
+		}
 
-	for (int i = 0; i < src->rows; i++) {
-		for (int j = 0; j < src->columns; j++) {
-			(*dest)->matrix[i][j] = src->matrix[i][j];
+		cml_real* drow = &MATRIX_AT(delta, i, 0);
+		for (unsigned int j = 0; j < m->columns; j++) {
+			drow[j] = rate * grow[j] + momentum * drow[j];
+			row[j] -= drow[j];
 		}
 	}
 	return E_SUCCESS;
 }
 
+
+error_t copy_matrix (matrix_t* src, matrix_t** dest) 
+{
+	if (src == NULL || dest == NULL)
+		return E_NULL_ARG;
+
+	error_t err = init_matrix(dest, src->rows, src->columns);
+	if (err != E_SUCCESS) return err;
+
+	return copy_matrix_into(src, *dest);
+}
+
+
+error_t copy_matrix_into (matrix_t* src, matrix_t* dest) 
+{
+	if (src == NULL)
+		return E_NULL_ARG;
+
+	error_t err = check_dest(dest, src->rows, src->columns);
+	if (err != E_SUCCESS) return err;
+
+	for (unsigned int i = 0; i < src->rows; i++) 
+		memcpy(&MATRIX_AT(dest, i, 0), &MATRIX_AT(src, i, 0), 
+				sizeof(cml_real) * src->columns);
+	return E_SUCCESS;
+}
+
 error_t free_matrix (matrix_t* m) 
 {
 	if (m == NULL) 
 		return E_NULL_ARG;
 
-	for (int i = 0; i < m->rows; i++) {
-		free(m->matrix[i]);
-		m->matrix[i] = NULL;
-	}
-	free(m->matrix);
+	if (m->owner == MATRIX_SCRATCH)
+		return E_SUCCESS;
+
+	if (m->owner == MATRIX_OWNED)
+		free(m->matrix);
 	
 	/* 
 	 * Since mpool only fake frees the memory, to ensure we don't use old pointers,
@@ -319,11 +877,128 @@ error_t free_matrix (matrix_t* m)
 }
 
 
+/* scratch_grow
+ *
+ *	Starts a new block in the scratch arena with room for at least count 
+ *	values. It is at least as big as everything before it, so a step that
+ *	keeps needing more only ever adds a few blocks.
+ */
+static scratch_block* scratch_grow (size_t count) 
+{
+	size_t total = scratch ? scratch->total : 0;
+	size_t size = SCRATCH_BLOCK_SIZE;
+	if (size < total) size = total;
+	if (size < count) size = count;
+
+	scratch_block* b;
+	if (posix_memalign((void**)&b, MATRIX_ALIGNMENT, 
+			sizeof(scratch_block) + sizeof(cml_real) * size) != 0)
+		return NULL;
+
+	b->prev = scratch;
+	b->size = size;
+	b->used = 0;
+	b->total = total + size;
+	scratch = b;
+	track_thread_buffers();
+	return b;
+}
+
+
+scratch_mark_t scratch_mark (void) 
+{
+	scratch_mark_t mark = { NULL, 0 };
+
+	/* The bottom of the arena is always { NULL, 0 }, since resetting to it 
+	 * may replace the first block */
+	if (scratch != NULL && (scratch->prev != NULL || scratch->used > 0)) {
+		mark.block = scratch;
+		mark.used = scratch->used;
+	}
+	return mark;
+}
+
+
+void scratch_reset (scratch_mark_t mark) 
+{
+	scratch_block* b = mark.block;
+
+	/* Back at the bottom of the arena, swap the blocks for a single one 
+	 * that holds what they all did, so the next step fits in one block */
+	if (b == NULL) {
+		if (scratch != NULL && scratch->prev != NULL) {
+			size_t total = scratch->total;
+			scratch_free();
+			scratch_grow(total);
+		}
+		if (scratch != NULL)
+			scratch->used = 0;
+		return;
+	}
+
+	/* Only blocks added since the mark need to go, which is none once the
+	 * arena is big enough for the step */
+	while (scratch != b) {
+		scratch_block* prev = scratch->prev;
+		free(scratch);
+		scratch = prev;
+	}
+	scratch->used = mark.used;
+}
+
+
+cml_real* scratch_alloc (size_t count) 
+{
+	const size_t per_line = MATRIX_ALIGNMENT / sizeof(cml_real);
+	count = (count + per_line - 1) / per_line * per_line;
+
+	if (scratch == NULL || scratch->size - scratch->used < count) {
+		if (scratch_grow(count) == NULL)
+			return NULL;
+	}
+
+	cml_real* p = scratch->data + scratch->used;
+	scratch->used += count;
+	return p;
+}
+
+
+matrix_t* scratch_matrix (unsigned int rows, unsigned int columns) 
+{
+	const size_t per_line = MATRIX_ALIGNMENT / sizeof(cml_real);
+	size_t size = matrix_buffer_size(rows, columns);
+
+	/* The matrix_t takes the first cache line, the values follow it */
+	cml_real* p = scratch_alloc(per_line + size);
+	if (p == NULL)
+		return NULL;
+
+	matrix_t* m = (matrix_t*)p;
+	m->matrix = p + per_line;
+	m->rows = rows;
+	m->columns = columns;
+	m->stride = matrix_stride(rows, columns);
+	m->owner = MATRIX_SCRATCH;
+	memset(m->matrix, 0, size * sizeof(cml_real));
+	return m;
+}
+
+
+void scratch_free (void) 
+{
+	while (scratch != NULL) {
+		scratch_block* prev = scratch->prev;
+		free(scratch);
+		scratch = prev;
+	}
+}
+
+
 void print_matrix (FILE* fh, matrix_t* m) 
 {
-	for (int i = 0; i < m->rows; i++) {
-		for (int j = 0; j < m->columns; j++) {
-			fprintf(fh, "%lf ", m->matrix[i][j]);
+	for (unsigned int i = 0; i < m->rows; i++) {
+		for (unsigned int j = 0; j < m->columns; j++) {
+			fprintf(fh, "%lf ", MATRIX_AT(m, i, j));
 		}
 		fprintf(fh, "\n");
 	}
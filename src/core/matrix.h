@@ -6,23 +6,86 @@
 #include <time.h>
 #include "cml.h"
 
+/* matrix_t
+ *
+ *	The values of the matrix are stored row-major in a single contiguous buffer
+ *	that is aligned to MATRIX_ALIGNMENT bytes. Each row starts stride elements 
+ *	after the previous one. For a 2D matrix the stride is the column count 
+ *	rounded up so that every row is aligned as well, while vectors (a single
+ *	row or column) are stored densely. Any padding at the end of a row is 
+ *	always zero.
+ *
+ *	Always access the values through MATRIX_AT() rather than indexing with 
+ *	the column count, since stride may be larger than columns.
+ *
+ *	A view (see init_matrix_view()) has the same layout, but its buffer is 
+ *	owned by someone else and is left alone by free_matrix(). A scratch 
+ *	matrix (see scratch_matrix()) lives entirely in the scratch arena.
+ */
 typedef struct matrix_t {
-	double** matrix;
+	cml_real* matrix;
 	unsigned int rows; // m
 	unsigned int columns; //n
+	unsigned int stride; // Elements between the start of each row
+	int owner; // Who frees the matrix, see below
 } matrix_t;
 
+/* Values of matrix_t.owner */
+#define MATRIX_OWNED 0 // free_matrix() frees the buffer and the matrix_t
+#define MATRIX_VIEW 1 // free_matrix() only frees the matrix_t
+#define MATRIX_SCRATCH 2 // Freed by scratch_reset(), free_matrix() does nothing
+
+/* Alignment in bytes of matrix_t buffers, one cache line */
+#define MATRIX_ALIGNMENT 64
+
+/* Element (i,j) of matrix m, may be used as an lvalue */
+#define MATRIX_AT(m, i, j) ((m)->matrix[(size_t)(i) * (m)->stride + (j)])
+
+/* Flags for the operands of matrix_matrix_mult() */
+#define MATRIX_NO_TRANS 0
+#define MATRIX_TRANS 1
+
 
 /* init_matrix
  *
  *	This function initializes a matrix_t on the heap with 
- *	the specified dimensions. To free the matrix_t use
+ *	the specified dimensions. All values, including any row 
+ *	padding, are set to 0. To free the matrix_t use
  *	free_matrix().
+ *
+ *	Returns:
+ *	E_SUCCESS => Matrix allocated
+ *	E_ALLOC_FAILURE => Could not allocate the value buffer
 *
 */
 error_t init_matrix(matrix_t** m, unsigned int rows, unsigned int columns);
 
 
+/* matrix_buffer_size
+ *
+ *	Number of values a matrix of the given size takes up, including the
+ *	padding of each row, rounded up so that whatever follows it in a 
+ *	buffer is aligned to MATRIX_ALIGNMENT as well.
+ */
+size_t matrix_buffer_size(unsigned int rows, unsigned int columns);
+
+
+/* init_matrix_view
+ *
+ *	Same as init_matrix(), but the values are the matrix_buffer_size() 
+ *	values at data rather than a buffer of its own. This is used to carve
+ *	several matrices out of a single allocation. data must be aligned to
+ *	MATRIX_ALIGNMENT and outlive the view, and its row padding must be 
+ *	zero. free_matrix() only frees the matrix_t, not data.
+ *
+ *	Returns:
+ *	E_SUCCESS => View set up
+ *	E_NULL_ARG => m or data is NULL
+ */
+error_t init_matrix_view(matrix_t** m, unsigned int rows, unsigned int columns, 
+		cml_real* data);
+
+
 /* matrix_vector_product
 *
 *	This function takes a matrix, and a vector (single column matrix) and
@@ -43,16 +106,108 @@ error_t init_matrix(matrix_t** m, unsigned int rows, unsigned int columns);
 *    -                           -
 *
 *    Note: the matrix m and vector vec are not deallocated in this function
+*
+*    The product is computed with the widest vector kernel the CPU supports,
+*    see matrix-kernels.h.
 */
 error_t matrix_vector_mult(matrix_t* m, matrix_t* vec, matrix_t** result);
 
 
+/* matrix_vector_mult_into
+ *
+ *	Same as matrix_vector_mult(), but the product is written into result, 
+ *	which must already be initialized as a m->rows x 1 vector. Nothing is 
+ *	allocated. result must not be vec.
+ *
+ *	Returns E_MATRIX_WRONG_DIM if result is the wrong size.
+ */
+error_t matrix_vector_mult_into(matrix_t* m, matrix_t* vec, matrix_t* result);
+
+
+/* matrix_vector_mult_act_into
+ *
+ *	Computes result = f(m * vec + bias), the forward step of a layer, where f 
+ *	is the activation function of actf. For the built-in activations the 
+ *	bias and activation are applied by the kernel itself while the result
+ *	is still in cache, without the indirect call per value. CUSTOM ones
+ *	are applied with map_vector() afterwards, and SOFTMAX over the whole
+ *	result with activation_forward().
+ *
+ *	If preact is not NULL, the input of the activation m * vec + bias is
+ *	kept in it as well. It must be a vector the size of result.
+ *
+ *	Has the same requirements as matrix_vector_mult_into().
+ */
+error_t matrix_vector_mult_act_into(matrix_t* m, matrix_t* vec, cml_real bias, 
+		activation_f* actf, matrix_t* preact, matrix_t* result);
+
+
+/* matrix_transpose_vector_mult
+ *
+ *	Computes the product of the transpose of m with a vector, without building
+ *	the transpose. This is the same as:
+ *
+ *	transposed = transpose_r(m);
+ *	matrix_vector_mult(transposed, vec, result);
+ *
+ *	but reads m in the layout it is stored in. The result has m->columns rows.
+ *
+ *	Note: the matrix m and vector vec are not deallocated in this function
+ */
+error_t matrix_transpose_vector_mult(matrix_t* m, matrix_t* vec, matrix_t** result);
+
+
+/* matrix_transpose_vector_mult_into
+ *
+ *	Same as matrix_transpose_vector_mult(), writing into an initialized 
+ *	m->columns x 1 result. result must not be vec.
+ *
+ *	Returns E_MATRIX_WRONG_DIM if result is the wrong size.
+ */
+error_t matrix_transpose_vector_mult_into(matrix_t* m, matrix_t* vec, matrix_t* result);
+
+
+/* matrix_matrix_mult
+ *
+ *	This function computes the matrix product op(a) * op(b), where op(x) is 
+ *	either x, or the transpose of x when the matching trans flag is 
+ *	MATRIX_TRANS. The transposes are never built, the operands are read in
+ *	the layout they are stored in.
+ *
+ *	If op(a) is m x k then op(b) must be k x n, and the result is m x n.
+ *
+ *	Returns:
+ *	E_SUCCESS => *result holds the product
+ *	E_MATRIX_WRONG_DIM => The inner dimensions don't match
+ */
+error_t matrix_matrix_mult(matrix_t* a, int trans_a, matrix_t* b, int trans_b, 
+		matrix_t** result);
+
+
+/* matrix_matrix_mult_into
+ *
+ *	Same as matrix_matrix_mult(), writing into an initialized result of the 
+ *	right size. result must not be a or b.
+ *
+ *	Returns E_MATRIX_WRONG_DIM if result is the wrong size.
+ */
+error_t matrix_matrix_mult_into(matrix_t* a, int trans_a, matrix_t* b, int trans_b, 
+		matrix_t* result);
+
+
 /* matrix_scalar_mult
  *	
  *	This function multiplies a matrix by a given scalar in place. 
  *
  */
-error_t matrix_scalar_mult(matrix_t* m, double scalar);
+error_t matrix_scalar_mult(matrix_t* m, cml_real scalar);
+
+
+/* matrix_scalar_addition
+ *
+ *	This function adds a constant to each element of a matrix in place. 
+ */
+error_t matrix_scalar_addition (matrix_t* m, cml_real scalar);
 
 
 /* vector_scalar_addition
@@ -64,7 +219,7 @@ error_t matrix_scalar_mult(matrix_t* m, double scalar);
 *	_ => Failure
 *
 */
-error_t vector_scalar_addition (matrix_t* m, double scalar);
+error_t vector_scalar_addition (matrix_t* m, cml_real scalar);
 
 
 /* function_on_matrix
@@ -83,7 +238,7 @@ error_t vector_scalar_addition (matrix_t* m, double scalar);
 * 	 0 => Success 
 * 	 _ => Failure
 */
-error_t map_matrix (matrix_t* m, double(*f)(double));
+error_t map_matrix (matrix_t* m, cml_real (*f)(cml_real));
 
 
 /* map_vector
@@ -95,7 +250,7 @@ error_t map_matrix (matrix_t* m, double(*f)(double));
 * 	0 => Success
 * 	_ => Failure
 */
-error_t map_vector (matrix_t* vec, double (*f)(double));
+error_t map_vector (matrix_t* vec, cml_real (*f)(cml_real));
 
 
 /* matrix_subtraction
@@ -112,6 +267,16 @@ error_t map_vector (matrix_t* vec, double (*f)(double));
 error_t matrix_subtraction (matrix_t* m, matrix_t* n, matrix_t** result);
 
 
+/* matrix_subtraction_into
+ *
+ *	Same as matrix_subtraction(), writing into an initialized result of the 
+ *	same size as m. result may be m or n.
+ *
+ *	Returns E_MATRIX_WRONG_DIM if result is the wrong size.
+ */
+error_t matrix_subtraction_into (matrix_t* m, matrix_t* n, matrix_t* result);
+
+
 /*	transpose
  *	
  *	This function transposes a matrix inplace. 
@@ -148,16 +313,33 @@ matrix_t* transpose_r (matrix_t* const m);
 error_t multiply_vector(matrix_t* m, matrix_t* n, matrix_t** result);
 
 
+/*	multiply_vector_into
+ *
+ *	Same as multiply_vector(), writing into an initialized result of the same
+ *	size as m. result may be m or n.
+ *
+ *	Returns E_MATRIX_WRONG_DIM if result is the wrong size.
+ */
+error_t multiply_vector_into(matrix_t* m, matrix_t* n, matrix_t* result);
+
+
 /*	random_matrix
  *
  *	This function initializes a matrix and populates it with uniform random
  *	values on the interval [-interval, interval]. The values placed in the 
- *	matrix are doubles. 
+ *	matrix are cml_real. 
  *
  */
 matrix_t* random_matrix (unsigned int rows, unsigned int columns, double interval);
 
 
+/*	randomize_matrix
+ *
+ *	Same as random_matrix(), filling a matrix that already exists.
+ */
+error_t randomize_matrix (matrix_t* m, double interval);
+
+
 /* kronecker_vectors
  *
  * This function applys the kronecker product across two vectors, one
@@ -181,15 +363,133 @@ matrix_t* random_matrix (unsigned int rows, unsigned int columns, double interva
 error_t kronecker_vectors (matrix_t* vec1, matrix_t* vec2, matrix_t** result);
 
 
+/* kronecker_vectors_into
+ *
+ * Same as kronecker_vectors(), writing into an initialized result that has 
+ * the length of the vertical vector as rows and the length of the horizontal 
+ * vector as columns.
+ *
+ * Returns E_MATRIX_WRONG_DIM if result is the wrong size.
+ */
+error_t kronecker_vectors_into (matrix_t* vec1, matrix_t* vec2, matrix_t* result);
+
+
+/* matrix_rank1_update
+ *
+ *	This function applies a gradient descent step with momentum for a weight 
+ *	matrix whose gradient is the outer product of two vectors. It performs:
+ *
+ *	delta = rate * (vec1 k vec2^T) + momentum * delta
+ *	m = m - delta
+ *
+ *	in a single pass over m and delta, without building the outer product. 
+ *	vec1 must have m->rows values and vec2 m->columns values, either may be a 
+ *	row or column vector. delta must be the same size as m and is updated in
+ *	place, so it holds the step that was taken for use in the next update. It 
+ *	may be NULL, in which case no momentum is applied.
+ *
+ *	Returns:
+ *	E_SUCCESS => m (and delta) updated
+ *	E_NOT_VECTOR => vec1 or vec2 is not a vector
+ *	E_MATRIX_WRONG_DIM => The sizes don't line up
+ */
+error_t matrix_rank1_update (matrix_t* m, matrix_t* delta, matrix_t* vec1, matrix_t* vec2,
+		cml_real rate, cml_real momentum);
+
+
+/* matrix_gradient_update
+ *
+ *	The general form of matrix_rank1_update(), for when the gradient of m has
+ *	already been worked out, for example summed over a batch:
+ *
+ *	delta = rate * grad + momentum * delta
+ *	m = m - delta
+ *
+ *	grad and delta (if not NULL) must be the same size as m.
+ */
+error_t matrix_gradient_update (matrix_t* m, matrix_t* delta, matrix_t* grad, 
+		cml_real rate, cml_real momentum);
+
+
 /* copy_matrix
  *	
- *	Used to copy a matrix into another. One must be an allocated matrix that 
- *	has been initialized. The second must be allocated already.
+ *	Used to copy a matrix into another. src must be an allocated matrix that 
+ *	has been initialized, *dest is initialized by this function.
  *
  */
 error_t copy_matrix (matrix_t* src, matrix_t** dest);
 
 
+/* copy_matrix_into
+ *	
+ *	Copies the values of src into dest, which must already be initialized 
+ *	with the same dimensions.
+ *
+ *	Returns E_MATRIX_WRONG_DIM if dest is the wrong size.
+ */
+error_t copy_matrix_into (matrix_t* src, matrix_t* dest);
+
+
+/* scratch_mark_t
+ *
+ *	Position in this thread's scratch arena, see scratch_mark().
+ */
+typedef struct scratch_mark_t {
+	void* block;
+	size_t used;
+} scratch_mark_t;
+
+
+/* scratch_mark and scratch_reset
+ *
+ *	Each thread has a scratch arena that temporaries are carved from with
+ *	scratch_alloc() and scratch_matrix(). Nothing in it is freed on its own,
+ *	instead scratch_mark() is taken at the start of a step, and 
+ *	scratch_reset() with that mark at the end releases everything 
+ *	allocated in between at once. Marks nest, so a function may take its 
+ *	own mark while its caller holds one, as long as they are reset in 
+ *	reverse order.
+ *
+ *	The arena grows as needed and is not given back when reset, so once a
+ *	step has run it can be repeated without any call to malloc(). It 
+ *	takes no locks.
+ */
+scratch_mark_t scratch_mark (void);
+void scratch_reset (scratch_mark_t mark);
+
+
+/* scratch_alloc
+ *
+ *	count values from this thread's scratch arena, aligned to 
+ *	MATRIX_ALIGNMENT and not initialized. Valid until scratch_reset() is 
+ *	called with a mark taken before it.
+ *
+ *	Returns NULL if the arena could not grow.
+ */
+cml_real* scratch_alloc (size_t count);
+
+
+/* scratch_matrix
+ *
+ *	Same as init_matrix(), but the matrix_t and its values are in this 
+ *	thread's scratch arena, see scratch_alloc(). It must not outlive the
+ *	mark it was allocated under, and free_matrix() ignores it.
+ *
+ *	Returns NULL if the arena could not grow.
+ */
+matrix_t* scratch_matrix (unsigned int rows, unsigned int columns);
+
+
+/* scratch_free
+ *
+ *	Gives the memory of this thread's scratch arena back. Nothing may be
+ *	in use, the arena starts over on the next allocation. This is done on
+ *	its own when a thread exits, so it is only needed to trim the memory
+ *	of a thread that stays around.
+ */
+void scratch_free (void);
+
+
 /*	free_matrix
  *
  *	This function frees all resources associated with a matrix, including 
@@ -73,23 +73,47 @@ error_t connect_net (net* n)
 	
 	/* TODO: figure out how to handle hidden layers */
 	
-	/* Loop backwards through the net, fill out each layer with needed info */
+	/* Loop backwards through the net, fill out each layer with needed info. 
+	 * This allocates all the buffers a training step uses. */
 	for (int i = n->layer_count - 1; i > 0; i--) {
 		layer* clayer = n->layers[i];
 		layer* prev_layer = n->layers[i-1];
-		init_layer(clayer, clayer->ltype, prev_layer->output_nodes, clayer->output_nodes);
+		err = init_layer(clayer, clayer->ltype, prev_layer->output_nodes, clayer->output_nodes);
+		if (err != E_SUCCESS) return err;
 	}
 
 	/* Init the input layer */
 	int inputs = n->layers[0]->output_nodes;
 	init_layer(n->layers[0], input, inputs, inputs);
 
+	/* The weights and biases of every layer, in one arena */
+	err = init_params(n);
+	if (err != E_SUCCESS) return err;
+
+	/* Each layer reads straight from the previous layer's output buffer, 
+	 * the first one is pointed at the input by feed_forward() */
+	for (int i = 2; i < n->layer_count; i++) 
+		n->layers[i]->input = n->layers[i-1]->output;
+
 	/* Set up the topology array */
 	n->topology = malloc(sizeof(int) * n->layer_count);
 	for (int i = 0; i < n->layer_count; i++) 
 		n->topology[i] = n->layers[i]->output_nodes;
+
+	/* Buffers for the sample being trained on */
+	err = init_matrix(&n->input_buff, n->topology[0], 1);
+	if (err != E_SUCCESS) return err;
+	err = init_matrix(&n->expected_buff, n->topology[n->layer_count - 1], 1);
+	if (err != E_SUCCESS) return err;
 	
 	n->connected = NET_CONNECTED;
+
+	/* predict_into() runs in a context of the net's own */
+	n->ctx = init_inference_ctx(n);
+	if (n->ctx == NULL) {
+		n->connected = NET_NOT_CONNECTED;
+		return E_ALLOC_FAILURE;
+	}
 	return E_SUCCESS;
 }
 
@@ -1,9 +1,116 @@
+/* posix_memalign() */
+#define _POSIX_C_SOURCE 200112L
+
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 #include "cml.h"
 #include "cml-internal.h"
 #include "data-builder.h"
+#include "thread-pool.h"
+
+/* batch_buffers
+ *
+ * 	Working memory for a batch of samples, every matrix has a column per
+ * 	sample. preact, output, error and weight_grad are indexed by layer, 
+ * 	index 0 (the input layer) is unused since its output is input.
+ *
+ * 	The gradients of the batch go to grads, which is laid out like the 
+ * 	parameters of the net (see struct net), weight_grad are views into it.
+ */
+typedef struct batch_buffers {
+	int size;
+	matrix_t* input;
+	matrix_t* expected;
+	matrix_t** preact;
+	matrix_t** output;
+	matrix_t** error;
+	cml_real* grads;
+	matrix_t** weight_grad;
+} batch_buffers;
+
+
+/* Parameters each range of the gradient sum of train_parallel() adds up */
+#define SUM_GRADIENTS_GRAIN 4096
+
+
+/* parallel_share
+ *
+ * 	Buffers for one share of train_parallel(), for its part of a full 
+ * 	batch and of the smaller batch at the end of each epoch.
+ */
+typedef struct parallel_share {
+	batch_buffers full;
+	batch_buffers tail;
+} parallel_share;
+
+
+/* parallel_trainer
+ *
+ * 	State of train_parallel(). Each step works on size samples from 
+ * 	start, split between shares, which work out their gradients into 
+ * 	grads. grads[0] is n->grads, the rest are summed into it.
+ */
+typedef struct parallel_trainer {
+	net* n;
+	data_set* data;
+	int shares;
+	int batch_size;
+	int start;
+	int size;
+	cml_real** grads;
+	parallel_share* share;
+} parallel_trainer;
+
+
+/* hogwild_share
+ *
+ * 	A share of train_hogwild(), which runs the per sample steps of train()
+ * 	over its part of the data. It works on n, which for every share but 
+ * 	the first is copy: a net sharing the weights and biases of the one 
+ * 	being trained, with its own input, output and error buffers in 
+ * 	layers, and its own last steps for the momentum in deltas.
+ */
+typedef struct hogwild_share {
+	net* n;
+	net copy;
+	layer* layers;
+	cml_real* deltas;
+	data_set* data;
+	int start;
+	int size;
+} hogwild_share;
+
+
+/* test_error_job
+ *
+ * 	The test samples of calc_test_error(), in chunks of TEST_ERROR_CHUNK
+ * 	whose costs are summed into costs. The chunks are split into ranges 
+ * 	that are run in parallel, each through a context of its own. The 
+ * 	contexts are made once by the thread that trains, for every epoch.
+ */
+typedef struct test_error_job {
+	net* n;
+	data_set* data;
+	double* costs; // One per chunk
+	int chunks;
+	int ranges;
+	inference_ctx** ctx; // One per range
+	matrix_t** expected; // One per range
+} test_error_job;
+
+
+/* predict_batch_job
+ *
+ * 	The samples of predict_batch(), in groups of PREDICT_BATCH_SIZE.
+ */
+typedef struct predict_batch_job {
+	net* n;
+	const double* inputs;
+	size_t count;
+	double* outputs;
+} predict_batch_job;
+
 
 /* Local functions */
 static error_t feed_forward(net* n, matrix_t* input);
@@ -11,7 +118,27 @@ static error_t backprop (net* n, matrix_t* expected);
 static error_t net_error(net* n, matrix_t* expected);
 static error_t update_weights(net* n);
 static error_t update_bias(net* n);
-static error_t calc_test_error(net* n, data_set* ds, double* total_err, double* avg_err);
+static error_t init_test_error_job(net* n, data_set* ds, test_error_job* job);
+static void free_test_error_job(test_error_job* job);
+static error_t calc_test_error(test_error_job* job, double* total_err, double* avg_err);
+static error_t load_data_pair(net* n, data_pair* pair);
+static error_t end_epoch(net* n, data_set* data, test_error_job* test);
+static error_t init_batch_buffers(net* n, batch_buffers* b, int size, cml_real* grads);
+static void free_batch_buffers(net* n, batch_buffers* b);
+static error_t load_batch(net* n, batch_buffers* b, data_pair** pairs);
+static error_t batch_feed_forward(net* n, batch_buffers* b);
+static error_t batch_backprop(net* n, batch_buffers* b);
+static error_t ctx_feed_forward(inference_ctx* ctx, net* n);
+static error_t apply_gradients(net* n, int size);
+static int shard_size(int size, int shares, int id);
+static error_t share_gradients(void* arg, size_t begin, size_t end);
+static error_t sum_gradients(void* arg, size_t begin, size_t end);
+static error_t init_hogwild_share(net* n, hogwild_share* w);
+static void free_hogwild_share(hogwild_share* w);
+static error_t hogwild_epoch(void* arg, size_t begin, size_t end);
+static error_t hogwild_run_share(hogwild_share* w);
+static error_t test_error_ranges(void* arg, size_t begin, size_t end);
+static error_t predict_groups(void* arg, size_t begin, size_t end);
 
 /* PUBLIC FUNCTIONS */
 
@@ -44,24 +171,86 @@ error_t init_layer (layer* l, layer_type lt, int in_node, int out_node)
 	l->input_nodes = in_node;
 	l->output_nodes = out_node;
 
-	/* These matrices are not in use yet */
+	/* input is wired up by connect_net() */
 	l->input = NULL;
+	l->preact = NULL;
 	l->output = NULL;
 	l->layer_error = NULL;
-	l->weight_delta = NULL;
+
+	/* The weights and bias live in the arenas of the net, see init_params() */
+	l->weights = NULL;
+	l->weight_grad = NULL;
 	l->last_weight_delta = NULL;
+	l->bias = NULL;
+	l->bias_grad = NULL;
 
-	/* Output layer has no weights or bias */
-	if (lt == input) {
-		l->weights = NULL;
-		l->bias = 0;
-	} else {
-		/* Weight matrix has output_nodes columns and input_nodes rows */
-		double interval = 0.5;
-		l->weights = random_matrix(out_node, in_node, interval);
-		l->bias = -interval + (rand() / (RAND_MAX / interval * 2)); 
+	/* Input layer has no weights or bias */
+	if (lt == input)
+		return E_SUCCESS;
+
+	/* Buffers reused by every feed forward and backprop pass */
+	error_t err;
+	if ((err = init_matrix(&l->preact, out_node, 1)) != E_SUCCESS) return err;
+	if ((err = init_matrix(&l->output, out_node, 1)) != E_SUCCESS) return err;
+	if ((err = init_matrix(&l->layer_error, out_node, 1)) != E_SUCCESS) return err;
+
+	return E_SUCCESS;
+}
+
+
+/* init_params() [net-internal.h] */
+error_t init_params (net* n) 
+{
+	if (n == NULL) return E_NULL_ARG;
+	
+	/* Weights of each layer in turn, then the biases */
+	size_t weight_count = 0;
+	for (int i = 1; i < n->layer_count; i++) {
+		layer* clayer = n->layers[i];
+		weight_count += matrix_buffer_size(clayer->output_nodes, clayer->input_nodes);
+	}
+	n->param_count = weight_count + matrix_buffer_size(1, n->layer_count);
+
+	size_t size = n->param_count * sizeof(cml_real);
+	if (posix_memalign((void**)&n->params, MATRIX_ALIGNMENT, size) != 0) {
+		n->params = NULL;
+		return E_ALLOC_FAILURE;
+	}
+	if (posix_memalign((void**)&n->grads, MATRIX_ALIGNMENT, 2 * size) != 0) {
+		n->grads = NULL;
+		return E_ALLOC_FAILURE;
 	}
+	memset(n->params, 0, size);
+	memset(n->grads, 0, 2 * size);
 
+	cml_real* deltas = n->grads + n->param_count;
+	size_t offset = 0;
+	for (int i = 1; i < n->layer_count; i++) {
+		layer* clayer = n->layers[i];
+		int rows = clayer->output_nodes;
+		int columns = clayer->input_nodes;
+		error_t err;
+
+		err = init_matrix_view(&clayer->weights, rows, columns, n->params + offset);
+		if (err != E_SUCCESS) return err;
+		err = init_matrix_view(&clayer->weight_grad, rows, columns, n->grads + offset);
+		if (err != E_SUCCESS) return err;
+		err = init_matrix_view(&clayer->last_weight_delta, rows, columns, deltas + offset);
+		if (err != E_SUCCESS) return err;
+		offset += matrix_buffer_size(rows, columns);
+
+		clayer->bias = n->params + weight_count + i;
+		clayer->bias_grad = n->grads + weight_count + i;
+	}
+
+	/* Random starting values, from the output layer back so a given seed 
+	 * gives the same net as it always has */
+	double interval = 0.5;
+	for (int i = n->layer_count - 1; i > 0; i--) {
+		layer* clayer = n->layers[i];
+		randomize_matrix(clayer->weights, interval);
+		*clayer->bias = -interval + (rand() / (RAND_MAX / interval * 2)); 
+	}
 	return E_SUCCESS;
 }
 
@@ -72,51 +261,241 @@ error_t init_layer (layer* l, layer_type lt, int in_node, int out_node)
  */
 error_t train (net* n, data_set* data, int epochs) 
 {
-	double total_err = 0.0;
-	double avg_err = 0.0;
-	
 	if (n == NULL || data == NULL) 
 		return E_NULL_ARG;
 
 	if (n->connected != NET_CONNECTED)
 		return E_NET_NOT_CONNECTED;
 
-	for (int j = 0; j < epochs; j++) {
+	/* Any temporaries of a step are released at the end of it */
+	scratch_mark_t mark = scratch_mark();
+	test_error_job test;
+	error_t err = init_test_error_job(n, data, &test);
+
+	for (int j = 0; j < epochs && err == E_SUCCESS; j++) {
 		fprintf(stderr, "Training epoch: %d\t", j);
-		for (int i = 0; i < data->count; i++) {
-			error_t e;
-			matrix_t* input = NULL;
-			matrix_t* expected_output = NULL;
+		for (int i = 0; i < data->count && err == E_SUCCESS; i++) {
+			err = load_data_pair(n, data->data[i]);
+			if (err == E_SUCCESS) err = feed_forward(n, n->input_buff);
+			if (err == E_SUCCESS) err = backprop(n, n->expected_buff);
+			scratch_reset(mark);
+		}
 
-			e = cml_data_to_matrix(data->data[i]->input, &input);
-			if (e != E_SUCCESS) return e;
+		if (err == E_SUCCESS)
+			err = end_epoch(n, data, &test);
+	}
 
-			e = cml_data_to_matrix(data->data[i]->expected_output, &expected_output);
-			if (e != E_SUCCESS) return e;
+	free_test_error_job(&test);
+	return err;
+}
+
+
+/* train_batched() */
+error_t train_batched (net* n, data_set* data, int epochs, int batch_size) 
+{
+	if (n == NULL || data == NULL) 
+		return E_NULL_ARG;
+
+	if (n->connected != NET_CONNECTED)
+		return E_NET_NOT_CONNECTED;
+
+	if (batch_size < 1)
+		return E_INVALID_BATCH_SIZE;
+
+	/* Nothing to train on */
+	if (data->count < 1)
+		return E_SUCCESS;
 
-			e = feed_forward(n, input);
-			if (e != E_SUCCESS) return e;
+	if (batch_size > data->count)
+		batch_size = data->count;
 
-			e = backprop(n, expected_output);
-			if (e != E_SUCCESS) return e;
-			
-			free_matrix(input);
-			free_matrix(expected_output);
+	/* One set of buffers for full batches, and one for the smaller batch
+	 * left over at the end of each epoch */
+	batch_buffers full = { 0 }, tail = { 0 };
+	int tail_size = data->count % batch_size;
+	scratch_mark_t mark = scratch_mark();
+	test_error_job test;
+
+	error_t err = init_test_error_job(n, data, &test);
+	if (err == E_SUCCESS)
+		err = init_batch_buffers(n, &full, batch_size, n->grads);
+	if (err == E_SUCCESS && tail_size > 0)
+		err = init_batch_buffers(n, &tail, tail_size, n->grads);
+
+	for (int j = 0; j < epochs && err == E_SUCCESS; j++) {
+		fprintf(stderr, "Training epoch: %d\t", j);
+
+		for (int i = 0; i < data->count && err == E_SUCCESS; ) {
+			batch_buffers* b = (data->count - i >= batch_size) ? &full : &tail;
+
+			err = load_batch(n, b, data->data + i);
+			if (err == E_SUCCESS) err = batch_feed_forward(n, b);
+			if (err == E_SUCCESS) err = batch_backprop(n, b);
+			if (err == E_SUCCESS) err = apply_gradients(n, b->size);
+			scratch_reset(mark);
+			i += b->size;
 		}
 
-		/* Test against the test data if the user wants to */
-		if (data->test_count > 0) {
-			error_t err = calc_test_error(n, data, &total_err, &avg_err);
-			if (err != E_SUCCESS) return err;
+		if (err == E_SUCCESS)
+			err = end_epoch(n, data, &test);
+	}
+
+	free_batch_buffers(n, &full);
+	free_batch_buffers(n, &tail);
+	free_test_error_job(&test);
+	return err;
+}
+
+
+/* train_parallel() */
+error_t train_parallel (net* n, data_set* data, int epochs, int batch_size, int shares) 
+{
+	if (n == NULL || data == NULL) 
+		return E_NULL_ARG;
+
+	if (n->connected != NET_CONNECTED)
+		return E_NET_NOT_CONNECTED;
+
+	if (batch_size < 1)
+		return E_INVALID_BATCH_SIZE;
+
+	if (shares < 1)
+		return E_INVALID_THREAD_COUNT;
+
+	/* Nothing to train on */
+	if (data->count < 1)
+		return E_SUCCESS;
+
+	if (batch_size > data->count)
+		batch_size = data->count;
+
+	/* A share without any samples would only add zeros */
+	if (shares > batch_size)
+		shares = batch_size;
+
+	parallel_trainer t = { .n = n, .data = data, .shares = shares, 
+		.batch_size = batch_size };
+	t.share = calloc(shares, sizeof(parallel_share));
+	t.grads = calloc(shares, sizeof(cml_real*));
+	int tail_size = data->count % batch_size;
 
-			fprintf(stderr, "Total error: %lf\tAverage error: %lf\n", total_err, avg_err);
-			total_err = 0.0;
+	error_t err = (t.share && t.grads) ? E_SUCCESS : E_ALLOC_FAILURE;
+	if (err != E_SUCCESS) {
+		free(t.share);
+		free(t.grads);
+		return err;
+	}
+
+	/* Every share but the first gets gradients of its own */
+	t.grads[0] = n->grads;
+	size_t size = n->param_count * sizeof(cml_real);
+	for (int i = 1; i < shares && err == E_SUCCESS; i++) {
+		if (posix_memalign((void**)&t.grads[i], MATRIX_ALIGNMENT, size) != 0) {
+			t.grads[i] = NULL;
+			err = E_ALLOC_FAILURE;
 		} else {
-			fprintf(stderr, "\n");
+			memset(t.grads[i], 0, size);
 		}
 	}
 
-	return E_SUCCESS;
+	for (int i = 0; i < shares && err == E_SUCCESS; i++) {
+		parallel_share* share = &t.share[i];
+		int full_size = shard_size(batch_size, shares, i);
+		int part_size = shard_size(tail_size, shares, i);
+
+		if (full_size > 0) 
+			err = init_batch_buffers(n, &share->full, full_size, t.grads[i]);
+		if (err == E_SUCCESS && part_size > 0)
+			err = init_batch_buffers(n, &share->tail, part_size, t.grads[i]);
+	}
+
+	test_error_job test = { 0 };
+	if (err == E_SUCCESS)
+		err = init_test_error_job(n, data, &test);
+
+	for (int j = 0; j < epochs && err == E_SUCCESS; j++) {
+		fprintf(stderr, "Training epoch: %d\t", j);
+
+		for (int i = 0; i < data->count && err == E_SUCCESS; ) {
+			t.start = i;
+			t.size = (data->count - i >= batch_size) ? batch_size : tail_size;
+
+			err = pool_parallel_for(0, shares, 1, share_gradients, &t);
+			if (err == E_SUCCESS && shares > 1)
+				err = pool_parallel_for(0, n->param_count, SUM_GRADIENTS_GRAIN, 
+						sum_gradients, &t);
+			if (err == E_SUCCESS) 
+				err = apply_gradients(n, t.size);
+			i += t.size;
+		}
+
+		if (err == E_SUCCESS)
+			err = end_epoch(n, data, &test);
+	}
+
+	for (int i = 0; i < shares; i++) {
+		free_batch_buffers(n, &t.share[i].full);
+		free_batch_buffers(n, &t.share[i].tail);
+		if (i > 0) free(t.grads[i]);
+	}
+	free(t.share);
+	free(t.grads);
+	free_test_error_job(&test);
+	return err;
+}
+
+
+/* train_hogwild() */
+error_t train_hogwild (net* n, data_set* data, int epochs, int shares) 
+{
+	if (n == NULL || data == NULL) 
+		return E_NULL_ARG;
+
+	if (n->connected != NET_CONNECTED)
+		return E_NET_NOT_CONNECTED;
+
+	if (shares < 1)
+		return E_INVALID_THREAD_COUNT;
+
+	/* Every share gets at least one sample */
+	if (shares > data->count)
+		shares = data->count > 0 ? data->count : 1;
+
+	hogwild_share* share = calloc(shares, sizeof(hogwild_share));
+	if (share == NULL)
+		return E_ALLOC_FAILURE;
+
+	/* The first share is trained straight on n */
+	error_t err = E_SUCCESS;
+	int start = 0;
+	for (int i = 0; i < shares && err == E_SUCCESS; i++) {
+		hogwild_share* w = &share[i];
+		w->n = n;
+		if (i > 0)
+			err = init_hogwild_share(n, w);
+		w->data = data;
+		w->start = start;
+		w->size = shard_size(data->count, shares, i);
+		start += w->size;
+	}
+
+	test_error_job test = { 0 };
+	if (err == E_SUCCESS)
+		err = init_test_error_job(n, data, &test);
+
+	for (int j = 0; j < epochs && err == E_SUCCESS; j++) {
+		fprintf(stderr, "Training epoch: %d\t", j);
+
+		err = pool_parallel_for(0, shares, 1, hogwild_epoch, share);
+		if (err == E_SUCCESS)
+			err = end_epoch(n, data, &test);
+	}
+
+	for (int i = 1; i < shares; i++) 
+		free_hogwild_share(&share[i]);
+	free(share);
+	free_test_error_job(&test);
+	return err;
 }
 
 
@@ -125,9 +504,14 @@ cml_data* predict (net* n, cml_data* input)
 {
 	int last_layer = n->layer_count - 1;
 
-	matrix_t* input_matrix = NULL;
-	cml_data_to_matrix(input, &input_matrix);	
-	error_t e = feed_forward(n, input_matrix);
+	scratch_mark_t mark = scratch_mark();
+
+	error_t e = E_WRONG_INPUT_SIZE;
+	if (input->count == n->topology[0])
+		e = cml_data_to_matrix_into(input, n->input_buff);	
+	if (e == E_SUCCESS)
+		e = feed_forward(n, n->input_buff);
+	scratch_reset(mark);
 
 	if (e != E_SUCCESS) {
 		// HANDLE ERR
@@ -136,11 +520,127 @@ cml_data* predict (net* n, cml_data* input)
 	
 	cml_data* data = NULL;
 	matrix_to_cml_data(n->layers[last_layer]->output, &data);
-	free_matrix(input_matrix);
 	return data;
 }
 
 
+/* Samples predict_batch() runs through the net at a time, enough for the 
+ * matrix products to run at full speed while the outputs of every layer 
+ * stay in cache */
+#define PREDICT_BATCH_SIZE 256
+
+
+/* predict_batch() */
+error_t predict_batch (net* n, const double* inputs, size_t count, double* outputs) 
+{
+	if (n == NULL || (count > 0 && (inputs == NULL || outputs == NULL)))
+		return E_NULL_ARG;
+
+	if (n->connected != NET_CONNECTED)
+		return E_NET_NOT_CONNECTED;
+
+	predict_batch_job job = { n, inputs, count, outputs };
+	size_t groups = (count + PREDICT_BATCH_SIZE - 1) / PREDICT_BATCH_SIZE;
+	return pool_parallel_for(0, groups, 1, predict_groups, &job);
+}
+
+
+/* init_inference_ctx() */
+inference_ctx* init_inference_ctx (net* n) 
+{
+	if (n == NULL || n->connected != NET_CONNECTED)
+		return NULL;
+
+	inference_ctx* ctx = calloc(1, sizeof(inference_ctx));
+	if (ctx == NULL)
+		return NULL;
+
+	ctx->layer_count = n->layer_count;
+	ctx->topology = malloc(sizeof(int) * n->layer_count);
+	ctx->output = calloc(n->layer_count, sizeof(matrix_t*));
+	error_t err = (ctx->topology && ctx->output) ? E_SUCCESS : E_ALLOC_FAILURE;
+
+	if (err == E_SUCCESS) {
+		memcpy(ctx->topology, n->topology, sizeof(int) * n->layer_count);
+		err = init_matrix(&ctx->input, n->topology[0], 1);
+	}
+	for (int i = 1; i < n->layer_count && err == E_SUCCESS; i++) 
+		err = init_matrix(&ctx->output[i], n->topology[i], 1);
+
+	if (err != E_SUCCESS) {
+		free_inference_ctx(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+
+/* predict_ctx() */
+cml_data* predict_ctx (inference_ctx* ctx, net* n, cml_data* input) 
+{
+	if (ctx == NULL || n == NULL || input == NULL)
+		return NULL;
+
+	if (n->connected != NET_CONNECTED || n->layer_count != ctx->layer_count)
+		return NULL;
+	for (int i = 0; i < n->layer_count; i++) 
+		if (n->topology[i] != ctx->topology[i])
+			return NULL;
+
+	if (cml_data_to_matrix_into(input, ctx->input) != E_SUCCESS)
+		return NULL;
+
+	if (ctx_feed_forward(ctx, n) != E_SUCCESS)
+		return NULL;
+
+	cml_data* data = NULL;
+	matrix_to_cml_data(ctx->output[n->layer_count - 1], &data);
+	return data;
+}
+
+
+/* predict_into() */
+error_t predict_into (net* n, const double* in, double* out) 
+{
+	if (n == NULL || in == NULL || out == NULL)
+		return E_NULL_ARG;
+
+	if (n->connected != NET_CONNECTED)
+		return E_NET_NOT_CONNECTED;
+
+	/* Both are dense column vectors */
+	inference_ctx* ctx = n->ctx;
+	for (int i = 0; i < n->topology[0]; i++) 
+		ctx->input->matrix[i] = in[i];
+
+	error_t err = ctx_feed_forward(ctx, n);
+	if (err != E_SUCCESS) return err;
+
+	matrix_t* result = ctx->output[n->layer_count - 1];
+	for (unsigned int i = 0; i < result->rows; i++) 
+		out[i] = result->matrix[i];
+	return E_SUCCESS;
+}
+
+
+/* free_inference_ctx() */
+error_t free_inference_ctx (inference_ctx* ctx) 
+{
+	if (ctx == NULL)
+		return E_NULL_ARG;
+
+	if (ctx->output) {
+		for (int i = 1; i < ctx->layer_count; i++) 
+			if (ctx->output[i]) free_matrix(ctx->output[i]);
+		free(ctx->output);
+	}
+	if (ctx->input) free_matrix(ctx->input);
+	free(ctx->topology);
+	free(ctx);
+	return E_SUCCESS;
+}
+
+
 /* free_net() */
 error_t free_net (net* n) 
 {
@@ -151,6 +651,11 @@ error_t free_net (net* n)
 		free_layer(n->layers[i]);
 	free(n->layers);
 	free(n->topology);
+	free(n->params);
+	free(n->grads);
+	if (n->ctx) free_inference_ctx(n->ctx);
+	free_matrix(n->input_buff);
+	free_matrix(n->expected_buff);
 	free(n);
 	return E_SUCCESS;
 }
@@ -160,8 +665,8 @@ error_t free_net (net* n)
  *
  * layer->input is never free'd because it is never allocated. It only
  * ever points the previous layer's output which will be free'd by 
- * layer->output. Or, it is the input for the whole neural net so it 
- * will be the responsibility of the creator of the net to dealloc.
+ * layer->output. Or, it is the input for the whole neural net which is
+ * either net->input_buff or owned by whoever called feed_forward().
  *
  */
 error_t free_layer (layer* l) 
@@ -169,10 +674,12 @@ error_t free_layer (layer* l)
 	if (l == NULL)
 		return E_NULL_ARG;
 
+	free_matrix(l->preact);
 	free_matrix(l->output);
 	free_matrix(l->weights);
+	free_matrix(l->weight_grad);
 	free_matrix(l->layer_error);
-	free_matrix(l->weight_delta);
+	free_matrix(l->last_weight_delta);
 	free(l);
 	return E_SUCCESS;
 }
@@ -199,35 +706,17 @@ static error_t feed_forward (net* n, matrix_t* input)
 	if (n->topology[0] != input->rows)
 		return E_WRONG_INPUT_SIZE;
 
+	/* The hidden and output layer inputs were wired to the previous
+	 * layer's output buffer in connect_net() */
 	n->layers[1]->input = input;
 	for (int i = 1; i < n->layer_count; i++) {
 		clayer = n->layers[i];
-		
-		/* Free up old memory */
-		if (clayer->output) {
-			free_matrix(clayer->output); 
-			clayer->output = NULL;
-		}
-
-		if (clayer->layer_error) { 
-			free_matrix(clayer->layer_error); 
-			clayer->layer_error = NULL;
-		}
 
-		//clayer->output = malloc(sizeof(matrix_t));
-
-		error_t err = matrix_vector_mult(clayer->weights, clayer->input, &clayer->output); 
+		/* z is kept in preact next to the output for backprop */
+		cml_real bias = clayer->using_bias ? *clayer->bias : 0;
+		error_t err = matrix_vector_mult_act_into(clayer->weights, clayer->input, 
+				bias, &clayer->actf, clayer->preact, clayer->output); 
 		if (err != E_SUCCESS) return err;
-
-		/* Check if we have bias to add */
-		if (clayer->using_bias)
-			vector_scalar_addition(clayer->output, clayer->bias);
-		
-		map_vector(clayer->output, clayer->actf.af);
-		
-		if (clayer->ltype != output) {
-			n->layers[i+1]->input = clayer->output;
-		}
 	}
 
 	return E_SUCCESS;
@@ -269,8 +758,9 @@ static error_t backprop (net* n, matrix_t* expected)
 
 /* net_error
  *	
- *	This function calculates the weight delta matrix based
- *	off the error of each layer.
+ *	This function calculates the error of each layer, the weight
+ *	gradient of a layer is the outer product of its error and its 
+ *	input, which update_weights() applies directly.
  *
  * 	Arguments:
  * 	n => Neural Network
@@ -291,37 +781,28 @@ static error_t net_error (net* n, matrix_t* expected)
 	 * input layer */
 	for (int i = n->layer_count-1; i > 0; i--) {
 		layer* clayer = n->layers[i];
-		//matrix_t* buff_err = malloc(sizeof(matrix_t));
-		matrix_t* buff_err;
-		matrix_t* tweights = NULL;
 		error_t err = E_SUCCESS;
 
-		if (clayer->ltype != output) {
-			layer* nlayer = n->layers[i+1];
-			tweights = transpose_r(nlayer->weights);
-			err = matrix_vector_mult(tweights, nlayer->layer_error, &buff_err);
-		} else {
-			err = calculate_cost_gradient(n, expected, &buff_err);
+		/* The output layer's error comes from the cost, which already 
+		 * includes g'(z) */
+		if (clayer->ltype == output) {
+			err = calculate_output_delta(n, clayer->preact, clayer->output, expected, 
+					clayer->layer_error);
+			if (err != E_SUCCESS) return err;
+			continue;
 		}
 
-		if (err != E_SUCCESS) return err;
-		/* g'(z) */	
-		map_vector(clayer->output, clayer->actf.ap);
-		
-		/* S * g'(z) */
-		//clayer->layer_error = malloc(sizeof(matrix_t));
-		err = multiply_vector(buff_err, clayer->output, &clayer->layer_error);
-		if (err != E_SUCCESS) return err;
-		matrix_t* transposed_input = transpose_r(clayer->input);
-		
-		/* Get weight delta matrix */
-		//clayer->weight_delta = malloc(sizeof(matrix_t));
-		err = kronecker_vectors(clayer->layer_error, transposed_input, &clayer->weight_delta);
+		/* S, put straight into the error buffer */
+		layer* nlayer = n->layers[i+1];
+		err = matrix_transpose_vector_mult_into(nlayer->weights, nlayer->layer_error, 
+				clayer->layer_error);
 		if (err != E_SUCCESS) return err;
 
-		free_matrix(transposed_input);
-		free_matrix(tweights);
-		free_matrix(buff_err);
+		/* S * g'(z), the output is left as is since it is still needed as 
+		 * the input of the next layer when the weights are updated */
+		err = activation_backward(&clayer->actf, clayer->preact, clayer->output, 
+				clayer->layer_error);
+		if (err != E_SUCCESS) return err;
 	}
 
 	return E_SUCCESS;
@@ -330,8 +811,13 @@ static error_t net_error (net* n, matrix_t* expected)
 
 /* update_weights
  *
- * 	This function is used to update the weights by the values of their 
- * 	weight delta matrix. It should be called after the net_error() function.
+ * 	This function is used to update the weights by the gradient of 
+ * 	each layer, the outer product of the layer error and its input. 
+ * 	It should be called after the net_error() function.
+ *
+ * 	The step and the momentum term are applied in place by 
+ * 	matrix_rank1_update(), which leaves the step taken in 
+ * 	last_weight_delta for the next update.
  *
  * 	Returns:
  * 	SUCCESS => Updated weights successfully 
@@ -341,42 +827,10 @@ static error_t update_weights (net* n)
 {
 	for (int i = 1; i < n->layer_count; i++) {
 		layer* clayer = n->layers[i];
-		//matrix_t* f_weights = malloc(sizeof(matrix_t));
-		matrix_t* f_weights;
 
-		error_t err;
-		err = matrix_scalar_mult(clayer->weight_delta, n->learning_rate);
+		error_t err = matrix_rank1_update(clayer->weights, clayer->last_weight_delta, 
+				clayer->layer_error, clayer->input, n->learning_rate, n->momentum);
 		if (err != E_SUCCESS) return err;
-		
-		/* Calculate the momentum term, note that I didn't implement the 
-		 * matrix_addition() function, so for now, we will subtract the 
-		 * negative instead
-		 */
-		if (clayer->last_weight_delta != NULL) {
-			err = matrix_scalar_mult(clayer->last_weight_delta, n->momentum * -1);
-			if (err != E_SUCCESS) return err;
-			
-			//matrix_t* buff_delta = malloc(sizeof(matrix_t));
-			matrix_t* buff_delta;
-			err = matrix_subtraction(clayer->weight_delta, clayer->last_weight_delta, &buff_delta);
-			if (err != E_SUCCESS) return err;
-		
-			/* clayer->weight_delta is re-init within copy-matrix */
-			free_matrix(clayer->weight_delta);
-			err = copy_matrix(buff_delta, &clayer->weight_delta);
-			if (err != E_SUCCESS) return err;
-			free_matrix(buff_delta);
-		}
-
-		/**/
-		err = matrix_subtraction(clayer->weights, clayer->weight_delta, &f_weights);
-		if (err != E_SUCCESS) return err;
-		
-		free_matrix(clayer->last_weight_delta);
-		free_matrix(clayer->weights);
-		
-		clayer->last_weight_delta = clayer->weight_delta;
-		clayer->weights = f_weights;
 	}	
 	return E_SUCCESS;
 }
@@ -405,46 +859,634 @@ static error_t update_bias (net* n)
 			continue;
 
 		for (int j = 0; j < clayer->layer_error->rows; j++) 
-			error_sum += clayer->layer_error->matrix[j][0];
+			error_sum += MATRIX_AT(clayer->layer_error, j, 0);
 		
-		clayer->bias -= error_sum;
+		*clayer->bias -= error_sum;
 	}
 	return E_SUCCESS;
 }
 
 
-/*
+/* Test samples calc_test_error() sums the cost of at a time, the chunks 
+ * are the same however many threads there are so the total is too */
+#define TEST_ERROR_CHUNK 64
+
+/* init_test_error_job
  *
+ * 	Sets up job for calc_test_error() over the test samples of ds, with a
+ * 	range of chunks for each thread of the pool. Nothing is allocated if 
+ * 	there are no test samples. On failure whatever was allocated is left 
+ * 	in job for free_test_error_job().
+ */
+static error_t init_test_error_job (net* n, data_set* ds, test_error_job* job) 
+{
+	memset(job, 0, sizeof(test_error_job));
+	job->n = n;
+	job->data = ds;
+
+	if (ds->test_count < 1)
+		return E_SUCCESS;
+
+	job->chunks = (ds->test_count + TEST_ERROR_CHUNK - 1) / TEST_ERROR_CHUNK;
+	job->ranges = pool_size() < job->chunks ? pool_size() : job->chunks;
+	job->costs = calloc(job->chunks, sizeof(double));
+	job->ctx = calloc(job->ranges, sizeof(inference_ctx*));
+	job->expected = calloc(job->ranges, sizeof(matrix_t*));
+	if (job->costs == NULL || job->ctx == NULL || job->expected == NULL)
+		return E_ALLOC_FAILURE;
+
+	for (int r = 0; r < job->ranges; r++) {
+		job->ctx[r] = init_inference_ctx(n);
+		if (job->ctx[r] == NULL)
+			return E_ALLOC_FAILURE;
+
+		error_t err = init_matrix(&job->expected[r], n->topology[n->layer_count - 1], 1);
+		if (err != E_SUCCESS) return err;
+	}
+	return E_SUCCESS;
+}
+
+
+/* free_test_error_job
+ *
+ * 	Frees what init_test_error_job() allocated for job.
+ */
+static void free_test_error_job (test_error_job* job) 
+{
+	for (int r = 0; job->ctx != NULL && r < job->ranges; r++) 
+		free_inference_ctx(job->ctx[r]);
+	for (int r = 0; job->expected != NULL && r < job->ranges; r++) 
+		if (job->expected[r]) free_matrix(job->expected[r]);
+
+	free(job->costs);
+	free(job->ctx);
+	free(job->expected);
+	memset(job, 0, sizeof(test_error_job));
+}
+
+
+/* calc_test_error
  *
+ * 	Works out the total and average cost of the net over the test 
+ * 	samples of job, with the ranges of chunks run in parallel.
  */
-static error_t calc_test_error(net* n, data_set* ds, double* total_err, double* avg_err) 
+static error_t calc_test_error(test_error_job* job, double* total_err, double* avg_err) 
 {
-	if (n == NULL || ds == NULL || total_err == NULL || avg_err == NULL)
+	if (job == NULL || total_err == NULL || avg_err == NULL)
 		return E_NULL_ARG;
 
 	*total_err = 0;
 
-	for (int i = 0; i < ds->test_count; i++) {
-		matrix_t* input = NULL;
-		matrix_t* expected_output = NULL;
-		
-		error_t e = cml_data_to_matrix(ds->data[i]->input, &input);
-		if (e != E_SUCCESS) return e;
+	if (job->chunks < 1)
+		return E_FAILURE;
 
-		e = cml_data_to_matrix(ds->data[i]->expected_output, &expected_output);
-		if (e != E_SUCCESS) return e;
+	error_t err = pool_parallel_for(0, job->ranges, 1, test_error_ranges, job);
+	for (int i = 0; i < job->chunks; i++) 
+		*total_err += job->costs[i];
+	if (err != E_SUCCESS) return err;
 
-		e = feed_forward(n, input);
-		if (e != E_SUCCESS) return e;
-		
-		*total_err += calculate_cost_func(n, expected_output);
-		free_matrix(input);
-		free_matrix(expected_output);
+	*avg_err = *total_err / (double)job->data->test_count;
+	return E_SUCCESS;
+}
+
+
+/* ctx_feed_forward
+ *
+ * 	Same as feed_forward() for ctx->input, with each layer writing its 
+ * 	output to ctx rather than the net. Nothing is kept for backprop, so 
+ * 	each layer is a single fused product and activation.
+ */
+static error_t ctx_feed_forward (inference_ctx* ctx, net* n) 
+{
+	scratch_mark_t mark = scratch_mark();
+	matrix_t* prev = ctx->input;
+	error_t err = E_SUCCESS;
+
+	for (int i = 1; i < n->layer_count && err == E_SUCCESS; i++) {
+		layer* clayer = n->layers[i];
+		cml_real bias = clayer->using_bias ? *clayer->bias : 0;
+
+		err = matrix_vector_mult_act_into(clayer->weights, prev, bias, 
+				&clayer->actf, NULL, ctx->output[i]);
+		prev = ctx->output[i];
 	}
 
-	if (ds->test_count < 1)
-		return E_FAILURE;
+	scratch_reset(mark);
+	return err;
+}
+
+
+/* load_data_pair
+ *
+ * 	Copies a data pair into the net's input and expected output 
+ * 	buffers, ready for feed_forward() and backprop().
+ *
+ * 	Returns:
+ * 	E_WRONG_INPUT_SIZE => Input doesn't match the input layer 
+ * 	E_WRONG_OUTPUT_SIZE => Expected output doesn't match the output layer
+ */
+static error_t load_data_pair (net* n, data_pair* pair) 
+{
+	if (pair->input->count != n->topology[0])
+		return E_WRONG_INPUT_SIZE;
+
+	if (pair->expected_output->count != n->topology[n->layer_count - 1])
+		return E_WRONG_OUTPUT_SIZE;
+
+	error_t e = cml_data_to_matrix_into(pair->input, n->input_buff);
+	if (e != E_SUCCESS) return e;
+
+	return cml_data_to_matrix_into(pair->expected_output, n->expected_buff);
+}
+
+
+/* end_epoch
+ *
+ * 	Reports the error on the test data at the end of an epoch, if the
+ * 	data set has any, using test from init_test_error_job().
+ */
+static error_t end_epoch (net* n, data_set* data, test_error_job* test) 
+{
+	double total_err = 0.0;
+	double avg_err = 0.0;
+
+	/* Test against the test data if the user wants to */
+	if (data->test_count > 0) {
+		error_t err = calc_test_error(test, &total_err, &avg_err);
+		if (err != E_SUCCESS) return err;
+
+		fprintf(stderr, "Total error: %lf\tAverage error: %lf\n", total_err, avg_err);
+	} else {
+		fprintf(stderr, "\n");
+	}
+	return E_SUCCESS;
+}
+
+
+/* init_batch_buffers
+ *
+ * 	Allocates the buffers for batches of the given size, with the 
+ * 	gradients going to grads. On failure whatever was allocated is left 
+ * 	in b for free_batch_buffers().
+ */
+static error_t init_batch_buffers (net* n, batch_buffers* b, int size, cml_real* grads) 
+{
+	error_t err;
+	int last = n->layer_count - 1;
+
+	b->size = size;
+	b->grads = grads;
+	b->preact = calloc(n->layer_count, sizeof(matrix_t*));
+	b->output = calloc(n->layer_count, sizeof(matrix_t*));
+	b->error = calloc(n->layer_count, sizeof(matrix_t*));
+	b->weight_grad = calloc(n->layer_count, sizeof(matrix_t*));
+	if (b->preact == NULL || b->output == NULL || b->error == NULL || b->weight_grad == NULL)
+		return E_ALLOC_FAILURE;
+
+	if ((err = init_matrix(&b->input, n->topology[0], size)) != E_SUCCESS) return err;
+	if ((err = init_matrix(&b->expected, n->topology[last], size)) != E_SUCCESS) return err;
+
+	for (int i = 1; i < n->layer_count; i++) {
+		if ((err = init_matrix(&b->preact[i], n->topology[i], size)) != E_SUCCESS) 
+			return err;
+		if ((err = init_matrix(&b->output[i], n->topology[i], size)) != E_SUCCESS) 
+			return err;
+		if ((err = init_matrix(&b->error[i], n->topology[i], size)) != E_SUCCESS) 
+			return err;
+
+		/* Same offset as the weights in the parameters */
+		matrix_t* w = n->layers[i]->weights;
+		err = init_matrix_view(&b->weight_grad[i], w->rows, w->columns, 
+				grads + (w->matrix - n->params));
+		if (err != E_SUCCESS) return err;
+	}
+	return E_SUCCESS;
+}
+
+
+/* free_batch_buffers */
+static void free_batch_buffers (net* n, batch_buffers* b) 
+{
+	for (int i = 1; i < n->layer_count; i++) {
+		if (b->preact) free_matrix(b->preact[i]);
+		if (b->output) free_matrix(b->output[i]);
+		if (b->error) free_matrix(b->error[i]);
+		if (b->weight_grad) free_matrix(b->weight_grad[i]);
+	}
+	free(b->preact);
+	free(b->output);
+	free(b->error);
+	free(b->weight_grad);
+	free_matrix(b->input);
+	free_matrix(b->expected);
+}
+
+
+/* load_batch
+ *
+ * 	Copies b->size data pairs into the batch buffers, one column each.
+ */
+static error_t load_batch (net* n, batch_buffers* b, data_pair** pairs) 
+{
+	int outputs = n->topology[n->layer_count - 1];
+
+	for (int c = 0; c < b->size; c++) {
+		cml_data* in = pairs[c]->input;
+		cml_data* expected = pairs[c]->expected_output;
+
+		if (in->count != n->topology[0])
+			return E_WRONG_INPUT_SIZE;
+
+		if (expected->count != outputs)
+			return E_WRONG_OUTPUT_SIZE;
+
+		for (int r = 0; r < in->count; r++) 
+			MATRIX_AT(b->input, r, c) = get_value_at(in, r);
+		for (int r = 0; r < outputs; r++) 
+			MATRIX_AT(b->expected, r, c) = get_value_at(expected, r);
+	}
+	return E_SUCCESS;
+}
+
+
+/* batch_feed_forward
+ *
+ * 	Same as feed_forward() for a whole batch, each layer is a single 
+ * 	matrix product of the weights with the previous layer's outputs.
+ */
+static error_t batch_feed_forward (net* n, batch_buffers* b) 
+{
+	matrix_t* prev = b->input;
+
+	for (int i = 1; i < n->layer_count; i++) {
+		layer* clayer = n->layers[i];
+
+		error_t err = matrix_matrix_mult_into(clayer->weights, MATRIX_NO_TRANS, 
+				prev, MATRIX_NO_TRANS, b->output[i]);
+		if (err != E_SUCCESS) return err;
+
+		err = activation_forward(&clayer->actf, b->output[i], 
+				clayer->using_bias ? *clayer->bias : 0, b->preact[i]);
+		if (err != E_SUCCESS) return err;
+		prev = b->output[i];
+	}
+	return E_SUCCESS;
+}
+
+
+/* batch_backprop
+ *
+ * 	Works out the error of every layer for a batch, then the gradients of
+ * 	each layer summed over the batch. The weight gradient is the product of
+ * 	its error with the transpose of its inputs, the bias gradient the sum 
+ * 	of its error.
+ */
+static error_t batch_backprop (net* n, batch_buffers* b) 
+{
+	error_t err;
+	int last = n->layer_count - 1;
+
+	for (int i = last; i > 0; i--) {
+		layer* clayer = n->layers[i];
+
+		if (i == last) {
+			err = calculate_output_delta(n, b->preact[i], b->output[i], b->expected, 
+					b->error[i]);
+			if (err != E_SUCCESS) return err;
+			continue;
+		}
+
+		err = matrix_matrix_mult_into(n->layers[i+1]->weights, MATRIX_TRANS, 
+				b->error[i+1], MATRIX_NO_TRANS, b->error[i]);
+		if (err != E_SUCCESS) return err;
+
+		err = activation_backward(&clayer->actf, b->preact[i], b->output[i], b->error[i]);
+		if (err != E_SUCCESS) return err;
+	}
+
+	for (int i = 1; i <= last; i++) {
+		matrix_t* in = (i == 1) ? b->input : b->output[i-1];
+		err = matrix_matrix_mult_into(b->error[i], MATRIX_NO_TRANS, in, MATRIX_TRANS, 
+				b->weight_grad[i]);
+		if (err != E_SUCCESS) return err;
+
+		double error_sum = 0;
+		for (int r = 0; r < b->error[i]->rows; r++) 
+			for (int c = 0; c < b->size; c++) 
+				error_sum += MATRIX_AT(b->error[i], r, c);
+		b->grads[n->layers[i]->bias - n->params] = error_sum;
+	}
+	return E_SUCCESS;
+}
+
+
+/* apply_gradients
+ *
+ * 	Takes a step with the gradients in n->grads, which are summed over
+ * 	size samples, so the step is scaled by the size to take the average.
+ */
+static error_t apply_gradients (net* n, int size) 
+{
+	for (int l = 1; l < n->layer_count; l++) {
+		layer* clayer = n->layers[l];
+		error_t err = matrix_gradient_update(clayer->weights, clayer->last_weight_delta,
+				clayer->weight_grad, n->learning_rate / size, n->momentum);
+		if (err != E_SUCCESS) return err;
+
+		if (clayer->using_bias) 
+			*clayer->bias -= *clayer->bias_grad / size;
+	}
+	return E_SUCCESS;
+}
+
+
+/* shard_size
+ *
+ * 	Samples of a batch of the given size that share id of shares works 
+ * 	on. The first size % shares shares take one extra.
+ */
+static int shard_size (int size, int shares, int id) 
+{
+	return size / shares + (id < size % shares);
+}
+
+
+/* share_gradients
+ *
+ * 	Works out the gradients of shares [begin, end) of the current batch of 
+ * 	train_parallel(), each into its own gradients.
+ */
+static error_t share_gradients (void* arg, size_t begin, size_t end) 
+{
+	parallel_trainer* t = arg;
+	net* n = t->n;
+	error_t err = E_SUCCESS;
+
+	for (size_t id = begin; id < end && err == E_SUCCESS; id++) {
+		parallel_share* share = &t->share[id];
+		batch_buffers* b = (t->size == t->batch_size) ? &share->full : &share->tail;
+
+		int offset = 0;
+		for (size_t i = 0; i < id; i++) 
+			offset += shard_size(t->size, t->shares, i);
+
+		if (shard_size(t->size, t->shares, id) == 0) {
+			memset(t->grads[id], 0, n->param_count * sizeof(cml_real));
+			continue;
+		}
+
+		scratch_mark_t mark = scratch_mark();
+		err = load_batch(n, b, t->data->data + t->start + offset);
+		if (err == E_SUCCESS) err = batch_feed_forward(n, b);
+		if (err == E_SUCCESS) err = batch_backprop(n, b);
+		scratch_reset(mark);
+	}
+	return err;
+}
+
+
+/* sum_gradients
+ *
+ * 	Adds the gradients of every share into those of the first, for the 
+ * 	parameters [begin, end). Each one is summed in share order, so the 
+ * 	result does not depend on how the parameters are split up.
+ */
+static error_t sum_gradients (void* arg, size_t begin, size_t end) 
+{
+	parallel_trainer* t = arg;
+	cml_real* sum = t->grads[0];
+
+	for (int s = 1; s < t->shares; s++) {
+		const cml_real* other = t->grads[s];
+		for (size_t i = begin; i < end; i++) 
+			sum[i] += other[i];
+	}
+	return E_SUCCESS;
+}
+
+
+/* init_hogwild_share
+ *
+ * 	Sets up w->copy as a net sharing the parameters of n, with buffers of
+ * 	its own, and points w->n at it. On failure whatever was allocated is 
+ * 	left for free_hogwild_share().
+ */
+static error_t init_hogwild_share (net* n, hogwild_share* w) 
+{
+	error_t err;
+	size_t count = n->param_count;
+
+	w->n = &w->copy;
+	w->copy = *n;
+	w->copy.ctx = NULL;
+	w->copy.input_buff = NULL;
+	w->copy.expected_buff = NULL;
+	w->copy.layers = calloc(n->layer_count, sizeof(layer*));
+	w->layers = calloc(n->layer_count, sizeof(layer));
+	if (w->copy.layers == NULL || w->layers == NULL)
+		return E_ALLOC_FAILURE;
+
+	if (posix_memalign((void**)&w->deltas, MATRIX_ALIGNMENT, count * sizeof(cml_real)) != 0) {
+		w->deltas = NULL;
+		return E_ALLOC_FAILURE;
+	}
+	memset(w->deltas, 0, count * sizeof(cml_real));
+
+	err = init_matrix(&w->copy.input_buff, n->topology[0], 1);
+	if (err != E_SUCCESS) return err;
+	err = init_matrix(&w->copy.expected_buff, n->topology[n->layer_count - 1], 1);
+	if (err != E_SUCCESS) return err;
+
+	w->layers[0] = *n->layers[0];
+	w->copy.layers[0] = &w->layers[0];
+	for (int i = 1; i < n->layer_count; i++) {
+		layer* l = &w->layers[i];
+		matrix_t* weights = n->layers[i]->weights;
+
+		/* The weights, biases and gradients stay shared */
+		*l = *n->layers[i];
+		l->preact = l->output = l->layer_error = l->last_weight_delta = NULL;
+		w->copy.layers[i] = l;
 
-	*avg_err = *total_err / (double)ds->test_count;
+		if ((err = init_matrix(&l->preact, l->output_nodes, 1)) != E_SUCCESS) return err;
+		if ((err = init_matrix(&l->output, l->output_nodes, 1)) != E_SUCCESS) return err;
+		if ((err = init_matrix(&l->layer_error, l->output_nodes, 1)) != E_SUCCESS) return err;
+
+		err = init_matrix_view(&l->last_weight_delta, weights->rows, weights->columns, 
+				w->deltas + (weights->matrix - n->params));
+		if (err != E_SUCCESS) return err;
+
+		if (i > 1) 
+			l->input = w->layers[i-1].output;
+	}
 	return E_SUCCESS;
 }
+
+
+/* free_hogwild_share
+ *
+ * 	Frees what init_hogwild_share() allocated, the net it was made from 
+ * 	is left alone.
+ */
+static void free_hogwild_share (hogwild_share* w) 
+{
+	if (w->layers) {
+		for (int i = 1; i < w->copy.layer_count; i++) {
+			layer* l = &w->layers[i];
+			if (l->preact) free_matrix(l->preact);
+			if (l->output) free_matrix(l->output);
+			if (l->layer_error) free_matrix(l->layer_error);
+			if (l->last_weight_delta) free_matrix(l->last_weight_delta);
+		}
+	}
+	if (w->copy.input_buff) free_matrix(w->copy.input_buff);
+	if (w->copy.expected_buff) free_matrix(w->copy.expected_buff);
+	free(w->copy.layers);
+	free(w->layers);
+	free(w->deltas);
+}
+
+
+/* hogwild_epoch
+ *
+ * 	Runs an epoch of the shares [begin, end) of train_hogwild().
+ */
+static error_t hogwild_epoch (void* arg, size_t begin, size_t end) 
+{
+	hogwild_share* shares = arg;
+	error_t err = E_SUCCESS;
+
+	for (size_t i = begin; i < end && err == E_SUCCESS; i++) 
+		err = hogwild_run_share(&shares[i]);
+	return err;
+}
+
+
+/* hogwild_run_share
+ *
+ * 	Runs an epoch of train() over the share's part of the data. The 
+ * 	updates are made without any locking, so they may overwrite some of 
+ * 	those made for other shares at the same time, which Hogwild! relies 
+ * 	on being rare.
+ */
+static error_t hogwild_run_share (hogwild_share* w) 
+{
+	scratch_mark_t mark = scratch_mark();
+	error_t err = E_SUCCESS;
+
+	for (int i = w->start; i < w->start + w->size && err == E_SUCCESS; i++) {
+		err = load_data_pair(w->n, w->data->data[i]);
+		if (err == E_SUCCESS) err = feed_forward(w->n, w->n->input_buff);
+		if (err == E_SUCCESS) err = backprop(w->n, w->n->expected_buff);
+		scratch_reset(mark);
+	}
+	return err;
+}
+
+
+/* test_error_ranges
+ *
+ * 	Sums the cost of each chunk in the ranges [begin, end) of 
+ * 	calc_test_error() into job->costs, running the samples of a range 
+ * 	through its context.
+ */
+static error_t test_error_ranges (void* arg, size_t begin, size_t end) 
+{
+	test_error_job* job = arg;
+	net* n = job->n;
+	data_set* ds = job->data;
+	int last = n->layer_count - 1;
+	error_t err = E_SUCCESS;
+
+	for (size_t r = begin; r < end && err == E_SUCCESS; r++) {
+		inference_ctx* ctx = job->ctx[r];
+		matrix_t* expected = job->expected[r];
+		int first = (int)r * job->chunks / job->ranges;
+		int stop_chunk = ((int)r + 1) * job->chunks / job->ranges;
+
+		for (int c = first; c < stop_chunk && err == E_SUCCESS; c++) {
+			int stop = (c + 1) * TEST_ERROR_CHUNK;
+			if (stop > ds->test_count) stop = ds->test_count;
+
+			double cost = 0;
+			for (int i = c * TEST_ERROR_CHUNK; i < stop && err == E_SUCCESS; i++) {
+				data_pair* pair = ds->data[i];
+
+				if (pair->input->count != n->topology[0])
+					err = E_WRONG_INPUT_SIZE;
+				else if (pair->expected_output->count != n->topology[last])
+					err = E_WRONG_OUTPUT_SIZE;
+
+				if (err == E_SUCCESS) err = cml_data_to_matrix_into(pair->input, ctx->input);
+				if (err == E_SUCCESS) err = cml_data_to_matrix_into(pair->expected_output, expected);
+				if (err == E_SUCCESS) err = ctx_feed_forward(ctx, n);
+				if (err == E_SUCCESS) cost += calculate_cost(n, ctx->output[last], expected);
+			}
+			job->costs[c] = cost;
+		}
+	}
+
+	return err;
+}
+
+
+/* predict_groups
+ *
+ * 	Runs the groups [begin, end) of samples of predict_batch() through the
+ * 	net. Each group works like train_batched(), a column per sample, in 
+ * 	buffers from the scratch arena.
+ */
+static error_t predict_groups (void* arg, size_t begin, size_t end) 
+{
+	predict_batch_job* job = arg;
+	net* n = job->n;
+	int last = n->layer_count - 1;
+	int in_count = n->topology[0];
+	int out_count = n->topology[last];
+	error_t err = E_SUCCESS;
+
+	scratch_mark_t mark = scratch_mark();
+
+	for (size_t g = begin; g < end && err == E_SUCCESS; g++) {
+		size_t start = g * PREDICT_BATCH_SIZE;
+		unsigned int size = (job->count - start < PREDICT_BATCH_SIZE) ? 
+			job->count - start : PREDICT_BATCH_SIZE;
+		const double* in = job->inputs + start * in_count;
+
+		matrix_t* prev = scratch_matrix(in_count, size);
+		if (prev == NULL) {
+			err = E_ALLOC_FAILURE;
+			break;
+		}
+		for (unsigned int c = 0; c < size; c++) 
+			for (int r = 0; r < in_count; r++) 
+				MATRIX_AT(prev, r, c) = in[c * in_count + r];
+
+		for (int i = 1; i <= last && err == E_SUCCESS; i++) {
+			layer* clayer = n->layers[i];
+			matrix_t* out = scratch_matrix(n->topology[i], size);
+			if (out == NULL) {
+				err = E_ALLOC_FAILURE;
+				break;
+			}
+
+			err = matrix_matrix_mult_into(clayer->weights, MATRIX_NO_TRANS, 
+					prev, MATRIX_NO_TRANS, out);
+			if (err == E_SUCCESS)
+				err = activation_forward(&clayer->actf, out, 
+						clayer->using_bias ? *clayer->bias : 0, NULL);
+			prev = out;
+		}
+
+		double* result = job->outputs + start * out_count;
+		for (unsigned int c = 0; c < size && err == E_SUCCESS; c++) 
+			for (int r = 0; r < out_count; r++) 
+				result[c * out_count + r] = MATRIX_AT(prev, r, c);
+
+		/* The next group reuses the same memory */
+		scratch_reset(mark);
+	}
+
+	scratch_reset(mark);
+	return err;
+}
@@ -0,0 +1,546 @@
+/* pthreads and sysconf() */
+#define _POSIX_C_SOURCE 200112L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cml.h"
+#include "thread-pool.h"
+
+/* Most threads a pool is started with */
+#define POOL_MAX_THREADS 256
+
+/* Most ranges pool_parallel_for() splits its indices into, and how many it
+ * aims for per thread so a thread that is held up can be made up for */
+#define POOL_MAX_RANGES 256
+#define POOL_RANGES_PER_THREAD 4
+
+/* Tasks a deque has room for when it is first used */
+#define POOL_DEQUE_SIZE 64
+
+
+/* pool_task */
+typedef struct pool_task {
+	pool_task_f fn;
+	void* arg;
+	pool_group* group;
+} pool_task;
+
+
+/* pool_deque
+ *
+ * 	Ring buffer of tasks, the owner adds and takes them at tail, thieves
+ * 	take them from head. The capacity is always a power of 2.
+ */
+typedef struct pool_deque {
+	pthread_mutex_t lock;
+	pool_task* tasks;
+	size_t capacity;
+	size_t head;
+	size_t tail;
+} pool_deque;
+
+
+/* thread_pool
+ *
+ * 	There are workers threads, and deques has one more entry after theirs
+ * 	that is shared by the threads outside the pool. lock guards queued,
+ * 	the count of tasks in all the deques, stop and the pending count of
+ * 	every group. wake is signalled whenever a task is queued or a group
+ * 	is done.
+ */
+typedef struct thread_pool {
+	int size;
+	int workers;
+	int started; // Threads that have taken an id, while starting up
+	pthread_t* threads;
+	pool_deque* deques;
+	int deque_count;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int queued;
+	int stop;
+} thread_pool;
+
+
+/* pool_range, one of the ranges of pool_parallel_for() */
+typedef struct pool_range {
+	pool_range_f fn;
+	void* arg;
+	size_t begin;
+	size_t end;
+	error_t err;
+} pool_range;
+
+
+/* The pool, started by get_pool() */
+static thread_pool* pool = NULL;
+static int pool_requested = 0; // From set_thread_count(), 0 for the default
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The pool and deque of this thread if it is a pool thread */
+static __thread thread_pool* worker_pool = NULL;
+static __thread int worker_id = -1;
+
+/* How many tasks and ranges of the pool this thread is in the middle of */
+static __thread int task_depth = 0;
+
+
+/* Local functions */
+static thread_pool* get_pool (void);
+static thread_pool* start_pool (int size);
+static void stop_pool (thread_pool* p);
+static int default_thread_count (void);
+static int deque_push (pool_deque* d, pool_task* t);
+static int deque_pop (pool_deque* d, pool_task* t);
+static int deque_steal (pool_deque* d, pool_task* t);
+static int find_task (thread_pool* p, pool_task* t);
+static void run_task (thread_pool* p, pool_task* t);
+static void* worker_main (void* arg);
+static void run_range (void* arg);
+
+
+/* PUBLIC FUNCTIONS */
+
+/* set_thread_count() */
+error_t set_thread_count (int threads)
+{
+	if (threads < 0)
+		return E_INVALID_THREAD_COUNT;
+
+	if (threads > POOL_MAX_THREADS)
+		threads = POOL_MAX_THREADS;
+
+	pthread_mutex_lock(&pool_lock);
+	pool_requested = threads;
+	int size = (threads > 0) ? threads : default_thread_count();
+	if (pool != NULL && pool->size != size) {
+		stop_pool(pool);
+		pool = NULL;
+	}
+	pthread_mutex_unlock(&pool_lock);
+	return E_SUCCESS;
+}
+
+
+/* get_thread_count() */
+int get_thread_count (void)
+{
+	pthread_mutex_lock(&pool_lock);
+	int size = pool ? pool->size :
+		(pool_requested > 0 ? pool_requested : default_thread_count());
+	pthread_mutex_unlock(&pool_lock);
+	return size;
+}
+
+
+/* pool_spawn() */
+void pool_spawn (pool_group* g, pool_task_f fn, void* arg)
+{
+	thread_pool* p = get_pool();
+	if (p == NULL || p->workers == 0) {
+		fn(arg);
+		return;
+	}
+
+	/* The group has to count the task before anyone can run it */
+	pthread_mutex_lock(&p->lock);
+	g->pending++;
+	pthread_mutex_unlock(&p->lock);
+
+	pool_task t = { fn, arg, g };
+	int id = (worker_pool == p) ? worker_id : p->workers;
+	if (!deque_push(&p->deques[id], &t)) {
+		run_task(p, &t);
+		return;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	p->queued++;
+	pthread_cond_broadcast(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+}
+
+
+/* pool_wait() */
+void pool_wait (pool_group* g)
+{
+	thread_pool* p = get_pool();
+	if (p == NULL || p->workers == 0)
+		return;
+
+	for (;;) {
+		pool_task t;
+
+		pthread_mutex_lock(&p->lock);
+		int done = (g->pending == 0);
+		pthread_mutex_unlock(&p->lock);
+		if (done)
+			return;
+
+		if (find_task(p, &t)) {
+			run_task(p, &t);
+			continue;
+		}
+
+		/* The rest of the group is running on other threads, sleep until
+		 * it is done or there is something else to help with */
+		pthread_mutex_lock(&p->lock);
+		while (g->pending > 0 && p->queued <= 0)
+			pthread_cond_wait(&p->wake, &p->lock);
+		pthread_mutex_unlock(&p->lock);
+	}
+}
+
+
+/* pool_parallel_for() */
+error_t pool_parallel_for (size_t begin, size_t end, size_t grain, pool_range_f fn,
+		void* arg)
+{
+	if (begin >= end)
+		return E_SUCCESS;
+
+	if (grain < 1)
+		grain = 1;
+
+	thread_pool* p = get_pool();
+	size_t count = end - begin;
+	size_t ranges = (count + grain - 1) / grain;
+	size_t most = (p == NULL) ? 1 : (size_t)p->size * POOL_RANGES_PER_THREAD;
+
+	if (most > POOL_MAX_RANGES) most = POOL_MAX_RANGES;
+	if (ranges > most) ranges = most;
+	if (ranges <= 1 || p->workers == 0) {
+		task_depth++;
+		error_t err = fn(arg, begin, end);
+		task_depth--;
+		return err;
+	}
+
+	pool_range r[POOL_MAX_RANGES];
+	pool_group g = POOL_GROUP_INIT;
+
+	for (size_t i = 0; i < ranges; i++) {
+		r[i].fn = fn;
+		r[i].arg = arg;
+		r[i].begin = begin + count * i / ranges;
+		r[i].end = begin + count * (i + 1) / ranges;
+		r[i].err = E_SUCCESS;
+	}
+
+	/* The caller works on the first range while the others are stolen */
+	for (size_t i = 1; i < ranges; i++)
+		pool_spawn(&g, run_range, &r[i]);
+	run_range(&r[0]);
+	pool_wait(&g);
+
+	for (size_t i = 0; i < ranges; i++)
+		if (r[i].err != E_SUCCESS)
+			return r[i].err;
+	return E_SUCCESS;
+}
+
+
+/* pool_size() */
+int pool_size (void)
+{
+	thread_pool* p = get_pool();
+	return p ? p->size : 1;
+}
+
+
+/* pool_worker_id() */
+int pool_worker_id (void)
+{
+	return worker_id;
+}
+
+
+/* pool_in_task() */
+int pool_in_task (void)
+{
+	return worker_id >= 0 || task_depth > 0;
+}
+
+
+/* LOCAL FUNCTIONS */
+
+/* get_pool
+ *
+ * 	Returns the pool, starting it if needed, or NULL if it could not be
+ * 	started, in which case the work is done on the caller.
+ */
+static thread_pool* get_pool (void)
+{
+	if (worker_pool != NULL)
+		return worker_pool;
+
+	pthread_mutex_lock(&pool_lock);
+	if (pool == NULL)
+		pool = start_pool(pool_requested > 0 ? pool_requested : default_thread_count());
+	thread_pool* p = pool;
+	pthread_mutex_unlock(&pool_lock);
+	return p;
+}
+
+
+/* start_pool
+ *
+ * 	Starts a pool of size threads, the caller being one of them. If some
+ * 	of the threads can't be started the pool is smaller.
+ */
+static thread_pool* start_pool (int size)
+{
+	thread_pool* p = calloc(1, sizeof(thread_pool));
+	if (p == NULL)
+		return NULL;
+
+	p->threads = calloc(size, sizeof(pthread_t));
+	p->deques = calloc(size, sizeof(pool_deque));
+	if (p->threads == NULL || p->deques == NULL) {
+		free(p->threads);
+		free(p->deques);
+		free(p);
+		return NULL;
+	}
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->wake, NULL);
+	p->deque_count = size;
+	for (int i = 0; i < size; i++)
+		pthread_mutex_init(&p->deques[i].lock, NULL);
+
+	int workers = 0;
+	while (workers < size - 1 && 
+			pthread_create(&p->threads[workers], NULL, worker_main, p) == 0)
+		workers++;
+
+	/* The threads wait for this before they look at the pool, the shared 
+	 * deque goes after the last one that did start */
+	pthread_mutex_lock(&p->lock);
+	p->workers = workers;
+	p->size = workers + 1;
+	pthread_cond_broadcast(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+	return p;
+}
+
+
+/* stop_pool
+ *
+ * 	Lets the threads of p finish what is queued, then stops them and
+ * 	frees the pool.
+ */
+static void stop_pool (thread_pool* p)
+{
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pthread_cond_broadcast(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+
+	for (int i = 0; i < p->workers; i++)
+		pthread_join(p->threads[i], NULL);
+
+	for (int i = 0; i < p->deque_count; i++) {
+		pthread_mutex_destroy(&p->deques[i].lock);
+		free(p->deques[i].tasks);
+	}
+
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->wake);
+	free(p->threads);
+	free(p->deques);
+	free(p);
+}
+
+
+/* Stop the pool when the library is unloaded */
+__attribute__((destructor))
+static void end_pool (void)
+{
+	pthread_mutex_lock(&pool_lock);
+	if (pool != NULL)
+		stop_pool(pool);
+	pool = NULL;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+
+/* default_thread_count
+ *
+ * 	CML_NUM_THREADS if it is set to a positive number, otherwise the
+ * 	number of CPUs online.
+ */
+static int default_thread_count (void)
+{
+	long count = 0;
+	const char* env = getenv("CML_NUM_THREADS");
+
+	if (env != NULL) {
+		char* end;
+		count = strtol(env, &end, 10);
+		if (end == env || *end != '\0')
+			count = 0;
+	}
+
+	if (count < 1)
+		count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (count < 1)
+		count = 1;
+	return count > POOL_MAX_THREADS ? POOL_MAX_THREADS : (int)count;
+}
+
+
+/* deque_push
+ *
+ * 	Adds t at the tail of d, growing it as needed. Returns 0 if there was
+ * 	no room and it could not grow.
+ */
+static int deque_push (pool_deque* d, pool_task* t)
+{
+	pthread_mutex_lock(&d->lock);
+
+	if (d->tail - d->head == d->capacity) {
+		size_t capacity = d->capacity ? 2 * d->capacity : POOL_DEQUE_SIZE;
+		pool_task* tasks = malloc(capacity * sizeof(pool_task));
+		if (tasks == NULL) {
+			pthread_mutex_unlock(&d->lock);
+			return 0;
+		}
+
+		/* Unwrap the tasks to the start of the new buffer */
+		size_t count = d->tail - d->head;
+		for (size_t i = 0; i < count; i++)
+			tasks[i] = d->tasks[(d->head + i) & (d->capacity - 1)];
+		free(d->tasks);
+		d->tasks = tasks;
+		d->capacity = capacity;
+		d->head = 0;
+		d->tail = count;
+	}
+
+	d->tasks[d->tail++ & (d->capacity - 1)] = *t;
+	pthread_mutex_unlock(&d->lock);
+	return 1;
+}
+
+
+/* deque_pop and deque_steal
+ *
+ * 	Take the newest and the oldest task of d into t. Both return 0 if d
+ * 	is empty.
+ */
+static int deque_pop (pool_deque* d, pool_task* t)
+{
+	int found = 0;
+	pthread_mutex_lock(&d->lock);
+	if (d->tail != d->head) {
+		*t = d->tasks[--d->tail & (d->capacity - 1)];
+		found = 1;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return found;
+}
+
+static int deque_steal (pool_deque* d, pool_task* t)
+{
+	int found = 0;
+	pthread_mutex_lock(&d->lock);
+	if (d->tail != d->head) {
+		*t = d->tasks[d->head++ & (d->capacity - 1)];
+		found = 1;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return found;
+}
+
+
+/* find_task
+ *
+ * 	Takes a task for the calling thread into t, from its own deque if it
+ * 	has any, otherwise stolen from the next one along that does. Returns 0
+ * 	if there were none.
+ */
+static int find_task (thread_pool* p, pool_task* t)
+{
+	int count = p->workers + 1;
+	int id = (worker_pool == p) ? worker_id : p->workers;
+	int found = deque_pop(&p->deques[id], t);
+
+	for (int i = 1; i < count && !found; i++)
+		found = deque_steal(&p->deques[(id + i) % count], t);
+
+	if (found) {
+		pthread_mutex_lock(&p->lock);
+		p->queued--;
+		pthread_mutex_unlock(&p->lock);
+	}
+	return found;
+}
+
+
+/* run_task
+ *
+ * 	Runs t, then counts it off its group.
+ */
+static void run_task (thread_pool* p, pool_task* t)
+{
+	task_depth++;
+	t->fn(t->arg);
+	task_depth--;
+
+	pthread_mutex_lock(&p->lock);
+	if (--t->group->pending == 0)
+		pthread_cond_broadcast(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+}
+
+
+/* worker_main
+ *
+ * 	Body of each pool thread, runs tasks until the pool is stopped and
+ * 	nothing is left queued.
+ */
+static void* worker_main (void* arg)
+{
+	thread_pool* p = arg;
+
+	/* Wait for the pool to finish starting, then take the next id */
+	pthread_mutex_lock(&p->lock);
+	while (p->size == 0)
+		pthread_cond_wait(&p->wake, &p->lock);
+	worker_pool = p;
+	worker_id = p->started++;
+	pthread_mutex_unlock(&p->lock);
+
+	for (;;) {
+		pool_task t;
+		if (find_task(p, &t)) {
+			run_task(p, &t);
+			continue;
+		}
+
+		pthread_mutex_lock(&p->lock);
+		while (p->queued <= 0 && !p->stop)
+			pthread_cond_wait(&p->wake, &p->lock);
+		int stop = p->stop && p->queued <= 0;
+		pthread_mutex_unlock(&p->lock);
+		if (stop)
+			break;
+	}
+
+	worker_id = -1;
+	worker_pool = NULL;
+	return NULL;
+}
+
+
+/* run_range, the task for each range of pool_parallel_for() */
+static void run_range (void* arg)
+{
+	pool_range* r = arg;
+	task_depth++;
+	r->err = r->fn(r->arg, r->begin, r->end);
+	task_depth--;
+}
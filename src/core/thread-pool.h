@@ -0,0 +1,101 @@
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+#include <stddef.h>
+#include "cml.h"
+
+/*	The thread pool every parallel part of the library runs on, so they
+ *	share one set of threads rather than each starting their own.
+ *
+ *	The pool is started on first use with the size given to
+ *	set_thread_count(), or the CML_NUM_THREADS environment variable, or
+ *	else the number of CPUs. The thread that hands out work counts as one
+ *	of them, it runs tasks as well while it waits, so a size of 1 runs
+ *	everything on the caller.
+ *
+ *	Each pool thread has a deque of tasks. It takes tasks from the end it
+ *	adds them to, newest first, and when it runs out it steals the oldest
+ *	task of another deque. Threads from outside the pool share one more
+ *	deque. Tasks may hand out more work and wait for it in turn.
+ */
+
+
+/* pool_task_f
+ *
+ * 	A task for pool_spawn(), called with the arg it was spawned with.
+ */
+typedef void (*pool_task_f) (void* arg);
+
+
+/* pool_range_f
+ *
+ * 	The body of pool_parallel_for(), called with the arg it was given and
+ * 	a range [begin, end) of the indices to work on.
+ */
+typedef error_t (*pool_range_f) (void* arg, size_t begin, size_t end);
+
+
+/* pool_group
+ *
+ * 	A set of tasks that can be waited for together, see pool_spawn().
+ * 	Initialize with POOL_GROUP_INIT.
+ */
+typedef struct pool_group {
+	int pending;
+} pool_group;
+
+#define POOL_GROUP_INIT { 0 }
+
+
+/* pool_spawn and pool_wait
+ *
+ * 	pool_spawn() queues fn(arg) to be run by any pool thread as part of
+ * 	group g, and pool_wait() returns once every task spawned in g has
+ * 	finished, running queued tasks itself in the meantime. If the pool has
+ * 	no threads besides the caller, or the task could not be queued, fn
+ * 	runs before pool_spawn() returns.
+ */
+void pool_spawn (pool_group* g, pool_task_f fn, void* arg);
+void pool_wait (pool_group* g);
+
+
+/* pool_parallel_for
+ *
+ * 	Calls fn over [begin, end) split into ranges of at least grain
+ * 	indices, which are run on the pool, and waits for all of them. How
+ * 	the indices are split depends on the size of the pool, so fn must
+ * 	give the same result however it is called.
+ *
+ * 	Returns the error of the first range, in index order, whose fn failed,
+ * 	or E_SUCCESS.
+ */
+error_t pool_parallel_for (size_t begin, size_t end, size_t grain, pool_range_f fn,
+		void* arg);
+
+
+/* pool_size
+ *
+ * 	Threads in the pool, including the caller, starting it if it is not
+ * 	running yet.
+ */
+int pool_size (void);
+
+
+/* pool_worker_id
+ *
+ * 	Index of the calling thread in the pool, or -1 if it is not a pool
+ * 	thread.
+ */
+int pool_worker_id (void);
+
+
+/* pool_in_task
+ *
+ * 	Nonzero if the caller is a pool thread, or is running a task or range
+ * 	for the pool. Work done there is already in parallel with the rest, 
+ * 	so splitting it up further only adds overhead.
+ */
+int pool_in_task (void);
+
+
+#endif
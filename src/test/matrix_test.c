@@ -1,8 +1,20 @@
+/* pthreads */
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <math.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "munit.h"
 #include "cml.h"
+#include "test-utils.h"
 #include "cml-internal.h"
+#include "matrix-kernels.h"
+
+/* Names of every kernel set, the ones the CPU can't run are skipped */
+static const char* kernel_names[] = { "scalar", "sse2", "avx2", "avx512", "cblas" };
+#define KERNEL_NAME_COUNT (sizeof(kernel_names) / sizeof(kernel_names[0]))
 
 
 /* test_vector_scalar_addition
@@ -31,27 +43,24 @@ test_vector_scalar_addition (const MunitParameter params[], void* data) {
 	munit_assert(err == E_NULL_ARG);
 	
 	/* Non-vector matrix */
-	vec = malloc(sizeof(matrix_t));
-	init_matrix(vec, 2, 2);
+	init_matrix(&vec, 2, 2);
 	err = vector_scalar_addition(vec, 0);
 	munit_assert(err == E_NOT_VECTOR);
 	free_matrix(vec);
 
 	/* Zero dimension vector */
-	vec = malloc(sizeof(matrix_t));
-	init_matrix(vec, 0, 0);
+	init_matrix(&vec, 0, 0);
 	err = vector_scalar_addition(vec, 0);
 	munit_assert(err == E_ZERO_DIM_MATRIX);
 	free_matrix(vec);
 
 	/* Make sure it properly adds values */
-	matrix_t* base = malloc(sizeof(matrix_t));
-	vec = malloc(sizeof(matrix_t));
-	init_matrix(vec, 3, 1);
+	matrix_t* base = NULL;
+	init_matrix(&vec, 3, 1);
 
 	for (int i = 0; i < 3; i++) 
-		vec->matrix[i][0] = vec_values[i];
-	copy_matrix(vec, base);
+		MATRIX_AT(vec, i, 0) = vec_values[i];
+	copy_matrix(vec, &base);
 
 	/* Try all values in addition_values */ 
 	for (int i = 0; i < 3; i++) {
@@ -60,22 +69,953 @@ test_vector_scalar_addition (const MunitParameter params[], void* data) {
 
 		/* Make sure the values added properly */
 		for (int j = 0; j < 3; j++) 
-			munit_assert(vec->matrix[j][0] == (base->matrix[j][0] + addition_values[i]));
+			munit_assert(MATRIX_AT(vec, j, 0) == (MATRIX_AT(base, j, 0) + addition_values[i]));
 		
 		free_matrix(vec);
-		vec = malloc(sizeof(matrix_t));
-		copy_matrix(base, vec);
+		copy_matrix(base, &vec);
+	}
+
+	free_matrix(vec);
+	free_matrix(base);
+	return MUNIT_OK;
+}
+
+
+
+/* test_init_matrix_layout
+ *
+ * 	Checks the storage layout that init_matrix() sets up:
+ * 		-> The buffer and every row start on an aligned boundary
+ * 		-> Vectors are stored densely
+ * 		-> All values and the row padding start out as 0
+ */
+static MunitResult
+test_init_matrix_layout (const MunitParameter params[], void* data) {
+
+	unsigned int dims[4][2] = { {1, 1}, {17, 1}, {1, 13}, {5, 11} };
+	
+	(void) params;
+	(void) data;
+
+	for (int d = 0; d < 4; d++) {
+		matrix_t* m = NULL;
+		error_t err = init_matrix(&m, dims[d][0], dims[d][1]);
+		munit_assert(err == E_SUCCESS);
+		munit_assert_size((size_t)m->matrix % MATRIX_ALIGNMENT, ==, 0);
+		munit_assert_uint(m->stride, >=, m->columns);
+
+		if (m->rows == 1 || m->columns == 1) {
+			munit_assert_uint(m->stride, ==, m->columns);
+		} else {
+			munit_assert_size((m->stride * sizeof(cml_real)) % MATRIX_ALIGNMENT, ==, 0);
+		}
+
+		for (unsigned int i = 0; i < m->rows * m->stride; i++) 
+			munit_assert(m->matrix[i] == 0);
+		free_matrix(m);
+	}
+	return MUNIT_OK;
+}
+
+
+/* test_matrix_vector_mult
+ *
+ * 	Compare matrix_vector_mult() against a hand worked product, using a 
+ * 	column count that leaves row padding behind each row.
+ */
+static MunitResult
+test_matrix_vector_mult (const MunitParameter params[], void* data) {
+
+	matrix_t *m = NULL, *vec = NULL, *res = NULL;
+	
+	(void) params;
+	(void) data;
+
+	init_matrix(&m, 3, 10);
+	init_matrix(&vec, 10, 1);
+
+	for (unsigned int i = 0; i < 3; i++) 
+		for (unsigned int j = 0; j < 10; j++) 
+			MATRIX_AT(m, i, j) = (double)(i + 1) * (j % 3 == 0 ? 1 : -1);
+	
+	for (unsigned int j = 0; j < 10; j++) 
+		MATRIX_AT(vec, j, 0) = j;
+
+	/* Row i is (i+1) * (sum of j%3==0) - (i+1) * (sum of rest) = (i+1) * (18 - 27) */
+	error_t err = matrix_vector_mult(m, vec, &res);
+	munit_assert(err == E_SUCCESS);
+	munit_assert_uint(res->rows, ==, 3);
+	for (unsigned int i = 0; i < 3; i++) 
+		assert_real_equal(MATRIX_AT(res, i, 0), (i + 1) * -9.0);
+
+	free_matrix(res);
+	res = NULL;
+
+	/* Vector of the wrong size */
+	free_matrix(vec);
+	init_matrix(&vec, 9, 1);
+	err = matrix_vector_mult(m, vec, &res);
+	munit_assert(err == E_MATRIX_WRONG_DIM);
+
+	free_matrix(m);
+	free_matrix(vec);
+	return MUNIT_OK;
+}
+
+
+/* test_matrix_vector_mult_kernels
+ *
+ * 	Run matrix_vector_mult() on every kernel set the CPU supports, over sizes 
+ * 	that hit each of the vector loop tails, and compare against a plain loop.
+ */
+static MunitResult
+test_matrix_vector_mult_kernels (const MunitParameter params[], void* data) {
+
+	unsigned int dims[5][2] = { {1, 1}, {3, 7}, {4, 8}, {13, 33}, {64, 129} };
+
+	(void) params;
+	(void) data;
+
+	for (size_t k = 0; k < KERNEL_NAME_COUNT; k++) {
+		const matrix_kernels* kern = find_matrix_kernels(kernel_names[k]);
+		if (kern == NULL) continue;
+		set_matrix_kernels(kern);
+
+		for (int d = 0; d < 5; d++) {
+			matrix_t* m = random_matrix(dims[d][0], dims[d][1], 1);
+			matrix_t* vec = random_matrix(dims[d][1], 1, 1);
+			matrix_t* res = NULL;
+
+			error_t err = matrix_vector_mult(m, vec, &res);
+			munit_assert(err == E_SUCCESS);
+
+			for (unsigned int i = 0; i < m->rows; i++) {
+				double expected = 0;
+				for (unsigned int j = 0; j < m->columns; j++) 
+					expected += MATRIX_AT(m, i, j) * MATRIX_AT(vec, j, 0);
+				assert_real_equal(MATRIX_AT(res, i, 0), expected);
+			}
+
+			free_matrix(m);
+			free_matrix(vec);
+			free_matrix(res);
+		}
 	}
 
+	set_matrix_kernels(NULL);
 	return MUNIT_OK;
 }
 
 
+/* Custom activation for test_matrix_vector_mult_act */
+static cml_real _double_f (cml_real x) { return 2 * x; }
+
+
+/* test_matrix_vector_mult_act
+ *
+ * 	matrix_vector_mult_act_into() must give the same values as the product,
+ * 	bias and activation done as separate steps, on every kernel set and for
+ * 	both the fused activations and a custom one. With preact given, it must
+ * 	also keep the product plus bias there.
+ */
+static MunitResult
+test_matrix_vector_mult_act (const MunitParameter params[], void* data) {
+
+	unsigned int dims[4][2] = { {1, 1}, {3, 7}, {13, 33}, {64, 129} };
+	act_func_t types[3] = { SIGMOID, TANH, CUSTOM };
+	const cml_real bias = 0.25;
+
+	for (size_t k = 0; k < KERNEL_NAME_COUNT; k++) {
+		const matrix_kernels* kern = find_matrix_kernels(kernel_names[k]);
+		if (kern == NULL) continue;
+		set_matrix_kernels(kern);
+
+		for (int d = 0; d < 4; d++) {
+			matrix_t* m = random_matrix(dims[d][0], dims[d][1], 1);
+			matrix_t* vec = random_matrix(dims[d][1], 1, 1);
+			matrix_t *res = NULL, *z = NULL, *expected = NULL;
+			init_matrix(&res, dims[d][0], 1);
+			init_matrix(&z, dims[d][0], 1);
+
+			for (int t = 0; t < 6; t++) {
+				activation_f actf;
+				get_activation_f(&actf, types[t % 3], _double_f, _double_f);
+				matrix_t* preact = (t < 3) ? NULL : z;
+
+				error_t err = matrix_vector_mult_act_into(m, vec, bias, &actf, preact, res);
+				munit_assert(err == E_SUCCESS);
+
+				matrix_vector_mult(m, vec, &expected);
+				vector_scalar_addition(expected, bias);
+				if (preact != NULL)
+					for (unsigned int i = 0; i < m->rows; i++)
+						assert_real_equal(MATRIX_AT(z, i, 0), MATRIX_AT(expected, i, 0));
+
+				map_vector(expected, actf.af);
+
+				for (unsigned int i = 0; i < m->rows; i++)
+					assert_real_equal(MATRIX_AT(res, i, 0), MATRIX_AT(expected, i, 0));
+				free_matrix(expected);
+				expected = NULL;
+			}
+
+			munit_assert(matrix_vector_mult_act_into(m, vec, bias, NULL, NULL, res) 
+					== E_NULL_ARG);
+
+			free_matrix(m);
+			free_matrix(vec);
+			free_matrix(res);
+			free_matrix(z);
+		}
+	}
+
+	set_matrix_kernels(NULL);
+	return MUNIT_OK;
+}
+
+
+/* test_matrix_vector_mult_threads
+ *
+ * 	Products large enough to be split between threads must give exactly
+ * 	the values of a single thread, on every kernel set, with and without
+ * 	a fused activation and with a row count that leaves a partial block.
+ */
+static MunitResult
+test_matrix_vector_mult_threads (const MunitParameter params[], void* data) {
+
+	const unsigned int rows = 1001, columns = 700;
+	activation_f actf;
+	get_activation_f(&actf, SIGMOID, NULL, NULL);
+
+	for (size_t k = 0; k < KERNEL_NAME_COUNT; k++) {
+		const matrix_kernels* kern = find_matrix_kernels(kernel_names[k]);
+		if (kern == NULL) continue;
+		set_matrix_kernels(kern);
+
+		matrix_t* m = random_matrix(rows, columns, 1);
+		matrix_t* vec = random_matrix(columns, 1, 1);
+		matrix_t *res[2][2] = { { NULL, NULL }, { NULL, NULL } };
+
+		for (int t = 0; t < 2; t++) {
+			munit_assert_int((int)set_thread_count(t ? 4 : 1), ==, (int)E_SUCCESS);
+			for (int f = 0; f < 2; f++) {
+				init_matrix(&res[t][f], rows, 1);
+				error_t err = f ? matrix_vector_mult_act_into(m, vec, 0.5, &actf, NULL, res[t][f])
+					: matrix_vector_mult_into(m, vec, res[t][f]);
+				munit_assert_int((int)err, ==, (int)E_SUCCESS);
+			}
+		}
+
+		for (int f = 0; f < 2; f++) {
+			munit_assert_memory_equal(rows * sizeof(cml_real), res[0][f]->matrix, 
+					res[1][f]->matrix);
+			free_matrix(res[0][f]);
+			free_matrix(res[1][f]);
+		}
+		free_matrix(m);
+		free_matrix(vec);
+	}
+
+	set_thread_count(0);
+	set_matrix_kernels(NULL);
+	return MUNIT_OK;
+}
+
+
+/* Largest error allowed between the activation kernels and libm, and the 
+ * documented error of the _FAST activations */
+#ifdef CML_SINGLE_PRECISION
+#define ACT_TOLERANCE 1e-6
+#else
+#define ACT_TOLERANCE 1e-14
+#endif
+#define FAST_ACT_TOLERANCE 1e-5
+
+/* test_activation_kernels
+ *
+ * 	activation_forward() and activation_backward() must match the exact per
+ * 	value functions on every kernel set, for inputs out in the tails of exp()
+ * 	and for lengths that leave a partial vector. The _FAST activations are
+ * 	checked against SIGMOID and TANH with their documented error. The 
+ * 	derivatives are taken at the kept input of the activation.
+ */
+static MunitResult
+test_activation_kernels (const MunitParameter params[], void* data) {
+
+	unsigned int dims[5][2] = { {1, 1}, {1, 7}, {37, 1}, {3, 33}, {2, 801} };
+	act_func_t types[7] = { SIGMOID, TANH, CUSTOM, SIGMOID_FAST, TANH_FAST, RELU, 
+		LEAKY_RELU };
+	act_func_t exact_types[7] = { SIGMOID, TANH, CUSTOM, SIGMOID, TANH, RELU, 
+		LEAKY_RELU };
+	const cml_real bias = 0.5;
+
+	for (size_t k = 0; k < KERNEL_NAME_COUNT; k++) {
+		const matrix_kernels* kern = find_matrix_kernels(kernel_names[k]);
+		if (kern == NULL) continue;
+		set_matrix_kernels(kern);
+
+		for (int d = 0; d < 5; d++) {
+			matrix_t *in = NULL, *z = NULL, *out = NULL, *err = NULL;
+			init_matrix(&in, dims[d][0], dims[d][1]);
+			init_matrix(&z, dims[d][0], dims[d][1]);
+			init_matrix(&out, dims[d][0], dims[d][1]);
+			init_matrix(&err, dims[d][0], dims[d][1]);
+
+			/* Spread over [-40, 40], past where sigmoid and tanh saturate */
+			unsigned int count = dims[d][0] * dims[d][1];
+			for (unsigned int i = 0; i < count; i++) {
+				cml_real x = (count == 1) ? 1.5 : -40 + 80 * (cml_real)i / (count - 1);
+				MATRIX_AT(in, i / dims[d][1], i % dims[d][1]) = x;
+			}
+
+			for (int t = 0; t < 7; t++) {
+				activation_f actf, exact;
+				get_activation_f(&actf, types[t], _double_f, _double_f);
+				get_activation_f(&exact, exact_types[t], _double_f, _double_f);
+				double tol = (types[t] == exact_types[t]) ? ACT_TOLERANCE : FAST_ACT_TOLERANCE;
+
+				copy_matrix_into(in, out);
+				munit_assert(activation_forward(&actf, out, bias, z) == E_SUCCESS);
+
+				for (unsigned int i = 0; i < dims[d][0]; i++)
+					for (unsigned int j = 0; j < dims[d][1]; j++) {
+						cml_real x = MATRIX_AT(in, i, j);
+						munit_assert_double(fabs(MATRIX_AT(out, i, j) - exact.af(x + bias)), 
+								<=, tol);
+						assert_real_equal(MATRIX_AT(z, i, j), x + bias);
+
+						MATRIX_AT(err, i, j) = x;
+					}
+
+				munit_assert(activation_backward(&actf, z, out, err) == E_SUCCESS);
+
+				for (unsigned int i = 0; i < dims[d][0]; i++)
+					for (unsigned int j = 0; j < dims[d][1]; j++) {
+						cml_real x = MATRIX_AT(in, i, j);
+						cml_real expected = x * exact.ap(MATRIX_AT(z, i, j));
+						munit_assert_double(fabs(MATRIX_AT(err, i, j) - expected), 
+								<=, 2 * tol * fmax(1, fabs(x)));
+					}
+			}
+
+			munit_assert(activation_forward(NULL, out, bias, NULL) == E_NULL_ARG);
+			munit_assert(activation_backward(NULL, z, out, err) == E_NULL_ARG);
+
+			activation_f custom;
+			get_activation_f(&custom, CUSTOM, _double_f, _double_f);
+			munit_assert(activation_backward(&custom, NULL, out, err) == E_NULL_ARG);
+
+			free_matrix(in);
+			free_matrix(z);
+			free_matrix(out);
+			free_matrix(err);
+		}
+	}
+
+	set_matrix_kernels(NULL);
+	return MUNIT_OK;
+}
+
+
+/* test_activation_softmax
+ *
+ * 	SOFTMAX must give the softmax of each column, for a single sample and a
+ * 	batch, without overflowing on large inputs. Its backward step must match
+ * 	multiplying by the full Jacobian.
+ */
+static MunitResult
+test_activation_softmax (const MunitParameter params[], void* data) {
+
+	unsigned int dims[4][2] = { {1, 1}, {10, 1}, {37, 1}, {10, 9} };
+	activation_f actf;
+	get_activation_f(&actf, SOFTMAX, NULL, NULL);
+	munit_assert_null(actf.af);
+
+	for (size_t k = 0; k < KERNEL_NAME_COUNT; k++) {
+		const matrix_kernels* kern = find_matrix_kernels(kernel_names[k]);
+		if (kern == NULL) continue;
+		set_matrix_kernels(kern);
+
+		for (int d = 0; d < 4; d++) {
+			unsigned int rows = dims[d][0], columns = dims[d][1];
+			matrix_t* in = random_matrix(rows, columns, 4);
+			matrix_t* err = random_matrix(rows, columns, 1);
+			matrix_t *out = NULL, *grad = NULL;
+			copy_matrix(in, &out);
+			copy_matrix(err, &grad);
+
+			/* Way past where exp() overflows, only the differences matter */
+			MATRIX_AT(in, 0, 0) += 1000;
+			MATRIX_AT(out, 0, 0) += 1000;
+
+			munit_assert(activation_forward(&actf, out, 3, NULL) == E_SUCCESS);
+			munit_assert(activation_backward(&actf, NULL, out, grad) == E_SUCCESS);
+
+			for (unsigned int j = 0; j < columns; j++) {
+				double max = MATRIX_AT(in, 0, j), sum = 0;
+				for (unsigned int i = 0; i < rows; i++)
+					max = fmax(max, MATRIX_AT(in, i, j));
+				for (unsigned int i = 0; i < rows; i++)
+					sum += exp(MATRIX_AT(in, i, j) - max);
+
+				for (unsigned int i = 0; i < rows; i++) {
+					double y = exp(MATRIX_AT(in, i, j) - max) / sum;
+					munit_assert_double(fabs(MATRIX_AT(out, i, j) - y), <=, ACT_TOLERANCE);
+
+					/* Row i of the Jacobian is y_i * (delta_il - y_l) */
+					double expected = 0;
+					for (unsigned int l = 0; l < rows; l++)
+						expected += MATRIX_AT(out, i, j) * ((i == l) - MATRIX_AT(out, l, j)) 
+							* MATRIX_AT(err, l, j);
+					assert_real_equal(MATRIX_AT(grad, i, j), expected);
+				}
+			}
+
+			free_matrix(in);
+			free_matrix(err);
+			free_matrix(out);
+			free_matrix(grad);
+		}
+	}
+
+	set_matrix_kernels(NULL);
+	return MUNIT_OK;
+}
+
+
+/* test_matrix_transpose_vector_mult
+ *
+ * 	matrix_transpose_vector_mult() must match building the transpose with 
+ * 	transpose_r() and multiplying, on every kernel set.
+ */
+static MunitResult
+test_matrix_transpose_vector_mult (const MunitParameter params[], void* data) {
+
+	unsigned int dims[5][2] = { {1, 1}, {7, 3}, {8, 4}, {33, 13}, {129, 64} };
+
+	(void) params;
+	(void) data;
+
+	for (size_t k = 0; k < KERNEL_NAME_COUNT; k++) {
+		const matrix_kernels* kern = find_matrix_kernels(kernel_names[k]);
+		if (kern == NULL) continue;
+		set_matrix_kernels(kern);
+
+		for (int d = 0; d < 5; d++) {
+			matrix_t* m = random_matrix(dims[d][0], dims[d][1], 1);
+			matrix_t* vec = random_matrix(dims[d][0], 1, 1);
+			matrix_t* t = transpose_r(m);
+			matrix_t *res = NULL, *expected = NULL;
+
+			error_t err = matrix_transpose_vector_mult(m, vec, &res);
+			munit_assert(err == E_SUCCESS);
+			err = matrix_vector_mult(t, vec, &expected);
+			munit_assert(err == E_SUCCESS);
+			munit_assert_uint(res->rows, ==, m->columns);
+
+			for (unsigned int i = 0; i < res->rows; i++) 
+				assert_real_equal(MATRIX_AT(res, i, 0), MATRIX_AT(expected, i, 0));
+
+			/* The vector has to match the rows of m */
+			free_matrix(res);
+			res = NULL;
+			if (m->rows != m->columns) {
+				err = matrix_transpose_vector_mult(t, vec, &res);
+				munit_assert(err == E_MATRIX_WRONG_DIM);
+			}
+
+			free_matrix(m);
+			free_matrix(t);
+			free_matrix(vec);
+			free_matrix(expected);
+		}
+	}
+
+	set_matrix_kernels(NULL);
+	return MUNIT_OK;
+}
+
+
+/* test_matrix_rank1_update
+ *
+ * 	matrix_rank1_update() against doing the same step with 
+ * 	kronecker_vectors(), on every kernel set. Two steps are taken so the 
+ * 	momentum term carried in delta is checked as well.
+ */
+static MunitResult
+test_matrix_rank1_update (const MunitParameter params[], void* data) {
+
+	const double rate = 0.1, momentum = 0.9;
+	unsigned int dims[4][2] = { {1, 1}, {5, 3}, {8, 16}, {21, 37} };
+
+	(void) params;
+	(void) data;
+
+	for (size_t k = 0; k < KERNEL_NAME_COUNT; k++) {
+		const matrix_kernels* kern = find_matrix_kernels(kernel_names[k]);
+		if (kern == NULL) continue;
+		set_matrix_kernels(kern);
+
+		for (int d = 0; d < 4; d++) {
+			matrix_t* m = random_matrix(dims[d][0], dims[d][1], 1);
+			matrix_t* x = random_matrix(dims[d][0], 1, 1);
+			matrix_t* y = random_matrix(1, dims[d][1], 1);
+			matrix_t *expected = NULL, *delta = NULL, *expected_delta = NULL;
+			
+			copy_matrix(m, &expected);
+			init_matrix(&delta, m->rows, m->columns);
+			init_matrix(&expected_delta, m->rows, m->columns);
+
+			for (int step = 0; step < 2; step++) {
+				matrix_t* outer = NULL;
+				error_t err = matrix_rank1_update(m, delta, x, y, rate, momentum);
+				munit_assert(err == E_SUCCESS);
+				
+				kronecker_vectors(x, y, &outer);
+				for (unsigned int i = 0; i < m->rows; i++) {
+					for (unsigned int j = 0; j < m->columns; j++) {
+						double step_delta = rate * MATRIX_AT(outer, i, j) + 
+							momentum * MATRIX_AT(expected_delta, i, j);
+						MATRIX_AT(expected_delta, i, j) = step_delta;
+						MATRIX_AT(expected, i, j) -= step_delta;
+						assert_real_equal(MATRIX_AT(delta, i, j), step_delta);
+						assert_real_equal(MATRIX_AT(m, i, j), 
+								MATRIX_AT(expected, i, j));
+					}
+				}
+				free_matrix(outer);
+			}
+
+			/* Vectors that don't line up with m */
+			munit_assert(matrix_rank1_update(m, delta, y, x, rate, momentum) == 
+					(m->rows == m->columns ? E_SUCCESS : E_MATRIX_WRONG_DIM));
+
+			free_matrix(m);
+			free_matrix(x);
+			free_matrix(y);
+			free_matrix(expected);
+			free_matrix(delta);
+			free_matrix(expected_delta);
+		}
+	}
+
+	set_matrix_kernels(NULL);
+	return MUNIT_OK;
+}
+
+
+/* test_matrix_matrix_mult
+ *
+ * 	Compare matrix_matrix_mult() with a plain triple loop on every kernel set,
+ * 	for each combination of transposes. The sizes cover partial register 
+ * 	tiles and products spanning more than one cache block.
+ */
+static MunitResult
+test_matrix_matrix_mult (const MunitParameter params[], void* data) {
+
+	/* m, k, n */
+	unsigned int dims[6][3] = { {1, 1, 1}, {3, 5, 7}, {13, 17, 33}, {5, 1, 70}, 
+		{8, 64, 16}, {100, 300, 21} };
+
+	for (size_t kn = 0; kn < KERNEL_NAME_COUNT; kn++) {
+		const matrix_kernels* kern = find_matrix_kernels(kernel_names[kn]);
+		if (kern == NULL) continue;
+		set_matrix_kernels(kern);
+
+		for (int d = 0; d < 6; d++) {
+			unsigned int m = dims[d][0], k = dims[d][1], n = dims[d][2];
+
+			for (int t = 0; t < 4; t++) {
+				int ta = t & 1, tb = t >> 1;
+				matrix_t* a = ta ? random_matrix(k, m, 1) : random_matrix(m, k, 1);
+				matrix_t* b = tb ? random_matrix(n, k, 1) : random_matrix(k, n, 1);
+				matrix_t* c = NULL;
+
+				error_t err = matrix_matrix_mult(a, ta, b, tb, &c);
+				munit_assert(err == E_SUCCESS);
+				munit_assert_int(c->rows, ==, m);
+				munit_assert_int(c->columns, ==, n);
+
+				for (unsigned int i = 0; i < m; i++) {
+					for (unsigned int j = 0; j < n; j++) {
+						double expected = 0;
+						for (unsigned int p = 0; p < k; p++) {
+							expected += (ta ? MATRIX_AT(a, p, i) : MATRIX_AT(a, i, p)) * 
+								(tb ? MATRIX_AT(b, j, p) : MATRIX_AT(b, p, j));
+						}
+						assert_real_equal(MATRIX_AT(c, i, j), expected);
+					}
+				}
+
+				/* The result is overwritten, not added to */
+				double first = MATRIX_AT(c, m - 1, n - 1);
+				err = matrix_matrix_mult_into(a, ta, b, tb, c);
+				munit_assert(err == E_SUCCESS);
+				assert_real_equal(MATRIX_AT(c, m - 1, n - 1), first);
+
+				free_matrix(a);
+				free_matrix(b);
+				free_matrix(c);
+			}
+		}
+	}
+
+	/* Inner dimensions don't line up */
+	matrix_t* a = random_matrix(3, 4, 1);
+	matrix_t* c = NULL;
+	munit_assert(matrix_matrix_mult(a, MATRIX_NO_TRANS, a, MATRIX_NO_TRANS, &c) == 
+			E_MATRIX_WRONG_DIM);
+	munit_assert(matrix_matrix_mult(a, MATRIX_TRANS, a, MATRIX_NO_TRANS, &c) == E_SUCCESS);
+	munit_assert(matrix_matrix_mult_into(a, MATRIX_NO_TRANS, a, MATRIX_TRANS, c) == 
+			E_MATRIX_WRONG_DIM);
+	free_matrix(a);
+	free_matrix(c);
+
+	set_matrix_kernels(NULL);
+	return MUNIT_OK;
+}
+
+
+/* test_into_variants
+ *
+ * 	The _into functions must give the same values as the allocating versions
+ * 	when given a destination of the right size, and refuse the wrong size.
+ */
+static MunitResult
+test_into_variants (const MunitParameter params[], void* data) {
+
+	(void) params;
+	(void) data;
+
+	matrix_t* m = random_matrix(6, 11, 1);
+	matrix_t* n = random_matrix(6, 11, 1);
+	matrix_t* x = random_matrix(11, 1, 1);
+	matrix_t* y = random_matrix(6, 1, 1);
+	matrix_t* yt = transpose_r(y);
+	matrix_t *expected = NULL, *dest = NULL, *wrong = NULL;
+	init_matrix(&wrong, 5, 1);
+
+	/* matrix_vector_mult */
+	matrix_vector_mult(m, x, &expected);
+	init_matrix(&dest, 6, 1);
+	munit_assert(matrix_vector_mult_into(m, x, dest) == E_SUCCESS);
+	munit_assert_memory_equal(sizeof(cml_real) * 6, dest->matrix, expected->matrix);
+	munit_assert(matrix_vector_mult_into(m, x, wrong) == E_MATRIX_WRONG_DIM);
+	free_matrix(expected);
+	free_matrix(dest);
+
+	/* matrix_transpose_vector_mult */
+	matrix_transpose_vector_mult(m, y, &expected);
+	init_matrix(&dest, 11, 1);
+	munit_assert(matrix_transpose_vector_mult_into(m, y, dest) == E_SUCCESS);
+	munit_assert_memory_equal(sizeof(cml_real) * 11, dest->matrix, expected->matrix);
+	munit_assert(matrix_transpose_vector_mult_into(m, y, wrong) == E_MATRIX_WRONG_DIM);
+	free_matrix(expected);
+	free_matrix(dest);
+
+	/* matrix_subtraction, in place into m */
+	matrix_subtraction(m, n, &expected);
+	munit_assert(matrix_subtraction_into(m, n, m) == E_SUCCESS);
+	for (unsigned int i = 0; i < m->rows; i++) 
+		munit_assert_memory_equal(sizeof(cml_real) * m->columns, &MATRIX_AT(m, i, 0), 
+				&MATRIX_AT(expected, i, 0));
+	munit_assert(matrix_subtraction_into(m, n, wrong) == E_MATRIX_WRONG_DIM);
+	free_matrix(expected);
+
+	/* multiply_vector */
+	matrix_t* y2 = random_matrix(6, 1, 1);
+	multiply_vector(y, y2, &expected);
+	init_matrix(&dest, 6, 1);
+	munit_assert(multiply_vector_into(y, y2, dest) == E_SUCCESS);
+	munit_assert_memory_equal(sizeof(cml_real) * 6, dest->matrix, expected->matrix);
+	munit_assert(multiply_vector_into(y, y2, wrong) == E_MATRIX_WRONG_DIM);
+	free_matrix(expected);
+	free_matrix(dest);
+	free_matrix(y2);
+
+	/* kronecker_vectors */
+	matrix_t* xt = transpose_r(x);
+	kronecker_vectors(y, xt, &expected);
+	init_matrix(&dest, 6, 11);
+	munit_assert(kronecker_vectors_into(y, xt, dest) == E_SUCCESS);
+	for (unsigned int i = 0; i < dest->rows; i++) 
+		munit_assert_memory_equal(sizeof(cml_real) * dest->columns, &MATRIX_AT(dest, i, 0), 
+				&MATRIX_AT(expected, i, 0));
+	munit_assert(kronecker_vectors_into(y, xt, wrong) == E_MATRIX_WRONG_DIM);
+	free_matrix(expected);
+	free_matrix(xt);
+
+	/* copy_matrix */
+	munit_assert(copy_matrix_into(n, dest) == E_SUCCESS);
+	for (unsigned int i = 0; i < dest->rows; i++) 
+		munit_assert_memory_equal(sizeof(cml_real) * dest->columns, &MATRIX_AT(dest, i, 0), 
+				&MATRIX_AT(n, i, 0));
+	munit_assert(copy_matrix_into(n, wrong) == E_MATRIX_WRONG_DIM);
+	munit_assert(copy_matrix_into(yt, dest) == E_MATRIX_WRONG_DIM);
+	free_matrix(dest);
+
+	free_matrix(m);
+	free_matrix(n);
+	free_matrix(x);
+	free_matrix(y);
+	free_matrix(yt);
+	free_matrix(wrong);
+	return MUNIT_OK;
+}
+
+
+/* test_transpose_r
+ *
+ * 	Make sure transpose_r() moves every element, including across the 
+ * 	blocks it works in.
+ */
+static MunitResult
+test_transpose_r (const MunitParameter params[], void* data) {
+
+	(void) params;
+	(void) data;
+
+	matrix_t* m = random_matrix(19, 13, 1);
+	matrix_t* t = transpose_r(m);
+
+	munit_assert_uint(t->rows, ==, 13);
+	munit_assert_uint(t->columns, ==, 19);
+
+	for (unsigned int i = 0; i < m->rows; i++) 
+		for (unsigned int j = 0; j < m->columns; j++) 
+			munit_assert(MATRIX_AT(t, j, i) == MATRIX_AT(m, i, j));
+
+	free_matrix(m);
+	free_matrix(t);
+	return MUNIT_OK;
+}
+
+
+/* test_kronecker_vectors
+ *
+ * 	The outer product of a column vector and a row vector.
+ */
+static MunitResult
+test_kronecker_vectors (const MunitParameter params[], void* data) {
+
+	matrix_t *x = NULL, *y = NULL, *res = NULL;
+	
+	(void) params;
+	(void) data;
+
+	init_matrix(&x, 3, 1);
+	init_matrix(&y, 1, 9);
+	for (unsigned int i = 0; i < 3; i++) 
+		MATRIX_AT(x, i, 0) = i + 1;
+	for (unsigned int j = 0; j < 9; j++) 
+		MATRIX_AT(y, 0, j) = j;
+
+	error_t err = kronecker_vectors(x, y, &res);
+	munit_assert(err == E_SUCCESS);
+	munit_assert_uint(res->rows, ==, 3);
+	munit_assert_uint(res->columns, ==, 9);
+
+	for (unsigned int i = 0; i < 3; i++) 
+		for (unsigned int j = 0; j < 9; j++) 
+			munit_assert(MATRIX_AT(res, i, j) == (i + 1) * j);
+
+	free_matrix(x);
+	free_matrix(y);
+	free_matrix(res);
+	return MUNIT_OK;
+}
+
+
+/* test_scratch_arena
+ *
+ * 	Allocations from the scratch arena are aligned, marks nest, and a 
+ * 	reset hands the same memory out again. A step bigger than the first 
+ * 	block still fits in a single block after going back to the bottom.
+ */
+static MunitResult
+test_scratch_arena (const MunitParameter params[], void* data) {
+
+	(void) params;
+	(void) data;
+
+	/* Start from an empty arena, other tests may have used it */
+	scratch_free();
+	scratch_mark_t bottom = scratch_mark();
+
+	cml_real* a = scratch_alloc(3);
+	munit_assert_not_null(a);
+	munit_assert_size((uintptr_t)a % MATRIX_ALIGNMENT, ==, 0);
+
+	scratch_mark_t mark = scratch_mark();
+	matrix_t* m = scratch_matrix(5, 7);
+	munit_assert_not_null(m);
+	munit_assert_int(m->owner, ==, MATRIX_SCRATCH);
+	munit_assert_size((uintptr_t)m->matrix % MATRIX_ALIGNMENT, ==, 0);
+	munit_assert_ptr(m->matrix, >=, a + 3);
+	for (unsigned int i = 0; i < m->rows; i++) 
+		for (unsigned int j = 0; j < m->stride; j++) 
+			munit_assert(MATRIX_AT(m, i, j) == 0);
+
+	/* Ignored rather than handed to the pool */
+	munit_assert(free_matrix(m) == E_SUCCESS);
+
+	scratch_reset(mark);
+	munit_assert_ptr_equal(scratch_matrix(5, 7), m);
+
+	/* Overflow the first block, then the bottom gets all of it */
+	cml_real* big = scratch_alloc(100000);
+	munit_assert_not_null(big);
+	big[99999] = 1;
+	scratch_reset(bottom);
+
+	cml_real* again = scratch_alloc(100000);
+	munit_assert_not_null(again);
+	munit_assert_ptr_equal(scratch_alloc(3), again + 100000);
+	scratch_reset(bottom);
+	munit_assert_ptr_equal(scratch_alloc(3), again);
+	scratch_reset(bottom);
+
+	/* A mark at the bottom of a first block that is already there stays
+	 * valid when the blocks are merged again */
+	bottom = scratch_mark();
+	for (int i = 0; i < 2; i++) {
+		munit_assert_not_null(scratch_alloc(150000 * (i + 1)));
+		scratch_reset(bottom);
+	}
+
+	/* So does a mark part way into the first block */
+	munit_assert_not_null(scratch_alloc(3));
+	mark = scratch_mark();
+	cml_real* next = scratch_alloc(3);
+	scratch_reset(mark);
+	for (int i = 0; i < 2; i++) {
+		munit_assert_not_null(scratch_alloc(150000 * (i + 1)));
+		scratch_reset(mark);
+		munit_assert_ptr_equal(scratch_alloc(3), next);
+		scratch_reset(mark);
+	}
+	scratch_reset(bottom);
+
+	return MUNIT_OK;
+}
+
+
+/* Matrices each thread of test_init_matrix_threads holds at once */
+#define POOL_THREAD_MATRICES 300
+
+/* Arguments of _pool_thread() */
+typedef struct pool_thread_args {
+	pthread_barrier_t* start; // Waited on before allocating, and before freeing
+	int tag;
+	int mismatches;
+} pool_thread_args;
+
+
+/* _pool_thread
+ *
+ * 	Allocates matrices until well past the size of the pool, tags each 
+ * 	with the thread, then once every thread has its matrices checks no 
+ * 	other thread was handed the same ones before freeing them.
+ */
+static void* _pool_thread (void* arg) 
+{
+	pool_thread_args* args = arg;
+	matrix_t* held[POOL_THREAD_MATRICES];
+
+	pthread_barrier_wait(args->start);
+
+	for (int i = 0; i < POOL_THREAD_MATRICES; i++) {
+		held[i] = NULL;
+		if (init_matrix(&held[i], 2, 3) != E_SUCCESS) {
+			args->mismatches++;
+			continue;
+		}
+		MATRIX_AT(held[i], 1, 2) = args->tag * POOL_THREAD_MATRICES + i;
+	}
+
+	/* Everyone holds all of theirs at once */
+	pthread_barrier_wait(args->start);
+
+	for (int i = 0; i < POOL_THREAD_MATRICES; i++) {
+		if (held[i] == NULL) continue;
+		if (held[i]->rows != 2 || held[i]->columns != 3 || 
+				MATRIX_AT(held[i], 1, 2) != args->tag * POOL_THREAD_MATRICES + i)
+			args->mismatches++;
+		free_matrix(held[i]);
+	}
+	return NULL;
+}
+
+
+/* test_init_matrix_threads
+ *
+ * 	Several threads run the matrix pool out at the same time, so it is 
+ * 	grown from more than one of them at once. Every thread must get 
+ * 	matrices of its own.
+ */
+static MunitResult
+test_init_matrix_threads (const MunitParameter params[], void* data) {
+
+	enum { THREADS = 16, ROUNDS = 8 };
+	pthread_t threads[THREADS];
+	pool_thread_args args[THREADS];
+	pthread_barrier_t start;
+
+	(void) params;
+	(void) data;
+
+	for (int r = 0; r < ROUNDS; r++) {
+		munit_assert_int(pthread_barrier_init(&start, NULL, THREADS), ==, 0);
+
+		for (int t = 0; t < THREADS; t++) {
+			args[t] = (pool_thread_args) { &start, t, 0 };
+			munit_assert_int(pthread_create(&threads[t], NULL, _pool_thread, 
+						&args[t]), ==, 0);
+		}
+		for (int t = 0; t < THREADS; t++) {
+			pthread_join(threads[t], NULL);
+			munit_assert_int(args[t].mismatches, ==, 0);
+		}
+
+		pthread_barrier_destroy(&start);
+	}
+
+	return MUNIT_OK;
+}
+
 
 /* Set up the test suite */
 static MunitTest test_suite_tests[] = {
 	{(char*) "vector_scalar_addition", test_vector_scalar_addition, NULL, NULL,
 		MUNIT_TEST_OPTION_NONE, NULL},
+	{(char*) "init_matrix/layout", test_init_matrix_layout, NULL, NULL,
+		MUNIT_TEST_OPTION_NONE, NULL},
+	{(char*) "matrix_vector_mult", test_matrix_vector_mult, NULL, NULL,
+		MUNIT_TEST_OPTION_NONE, NULL},
+	{(char*) "matrix_vector_mult/kernels", test_matrix_vector_mult_kernels, NULL, NULL,
+		MUNIT_TEST_OPTION_NONE, NULL},
+	{(char*) "matrix_vector_mult_act", test_matrix_vector_mult_act, NULL, NULL,
+		MUNIT_TEST_OPTION_NONE, NULL},
+	{(char*) "matrix_vector_mult_threads", test_matrix_vector_mult_threads, NULL, NULL,
+		MUNIT_TEST_OPTION_NONE, NULL},
+	{(char*) "activation_kernels", test_activation_kernels, NULL, NULL,
+		MUNIT_TEST_OPTION_NONE, NULL},
+	{(char*) "activation_softmax", test_activation_softmax, NULL, NULL,
+		MUNIT_TEST_OPTION_NONE, NULL},
+	{(char*) "matrix_transpose_vector_mult", test_matrix_transpose_vector_mult, NULL, NULL,
+		MUNIT_TEST_OPTION_NONE, NULL},
+	{(char*) "matrix_rank1_update", test_matrix_rank1_update, NULL, NULL,
+		MUNIT_TEST_OPTION_NONE, NULL},
+	{(char*) "matrix_matrix_mult", test_matrix_matrix_mult, NULL, NULL,
+		MUNIT_TEST_OPTION_NONE, NULL},
+	{(char*) "into", test_into_variants, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{(char*) "transpose_r", test_transpose_r, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+	{(char*) "kronecker_vectors", test_kronecker_vectors, NULL, NULL,
+		MUNIT_TEST_OPTION_NONE, NULL},
+	{(char*) "scratch_arena", test_scratch_arena, NULL, NULL, 
+		MUNIT_TEST_OPTION_NONE, NULL},
+	{(char*) "init_matrix/threads", test_init_matrix_threads, NULL, NULL, 
+		MUNIT_TEST_OPTION_NONE, NULL},
 	{NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL}
 };
 
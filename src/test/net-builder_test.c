@@ -1,3 +1,5 @@
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include "munit.h"
@@ -169,6 +171,19 @@ test_connect_net(const MunitParameter params[], void* data) {
 	for (int i = 1; i < n->layer_count - 1; i++) 
 		munit_assert_int((int)n->layers[i]->ltype, ==, (int)hidden);
 
+	/* Training buffers are allocated and chained together */
+	munit_assert_not_null(n->input_buff);
+	munit_assert_not_null(n->expected_buff);
+	for (int i = 1; i < n->layer_count; i++) {
+		layer* l = n->layers[i];
+		munit_assert_not_null(l->output);
+		munit_assert_not_null(l->layer_error);
+		munit_assert_not_null(l->last_weight_delta);
+		munit_assert_uint(l->output->rows, ==, l->output_nodes);
+		if (i > 1) 
+			munit_assert_ptr_equal(l->input, n->layers[i-1]->output);
+	}
+
 	munit_assert_int((int)n->layer_count, ==, (int)(hidden_layers + 2));
 	free_net(n);
 
@@ -176,6 +191,50 @@ test_connect_net(const MunitParameter params[], void* data) {
 }
 
 
+/* test_connect_net_arena()
+ *
+ * 	Tests that the weights and biases of every layer are laid out one
+ * 	after the other in the parameter arena, with their gradients and last
+ * 	steps at the same offsets in the gradient arena.
+ */
+static MunitResult
+test_connect_net_arena(const MunitParameter params[], void* data) {
+	net* n = _build_net(3, hidden);
+	munit_assert_int((int)connect_net(n), ==, (int)E_SUCCESS);
+
+	munit_assert_not_null(n->params);
+	munit_assert_not_null(n->grads);
+	munit_assert_null(n->layers[0]->weights);
+	munit_assert_null(n->layers[0]->bias);
+
+	cml_real* next = n->params;
+	for (int i = 1; i < n->layer_count; i++) {
+		layer* l = n->layers[i];
+		munit_assert_ptr_equal(l->weights->matrix, next);
+		munit_assert_size((uintptr_t)next % MATRIX_ALIGNMENT, ==, 0);
+		munit_assert_int(l->weights->owner, ==, MATRIX_VIEW);
+
+		ptrdiff_t offset = l->weights->matrix - n->params;
+		munit_assert_ptr_equal(l->weight_grad->matrix, n->grads + offset);
+		munit_assert_ptr_equal(l->last_weight_delta->matrix, 
+				n->grads + n->param_count + offset);
+		munit_assert_ptr_equal(l->bias_grad, n->grads + (l->bias - n->params));
+		munit_assert_uint(l->weights->rows, ==, l->output_nodes);
+		munit_assert_uint(l->weights->columns, ==, l->input_nodes);
+
+		/* Biases come after all the weights */
+		munit_assert_ptr_equal(l->bias, n->layers[1]->bias + (i - 1));
+		next += matrix_buffer_size(l->output_nodes, l->input_nodes);
+	}
+	munit_assert_ptr_equal(n->layers[1]->bias, next + 1);
+	munit_assert_size((size_t)(n->layers[n->layer_count-1]->bias - n->params), <, 
+			n->param_count);
+	free_net(n);
+
+	return MUNIT_OK;
+}
+
+
 /* test_connect_net_no_input_layer()
  *
  * 	Test that connect_net() handles when no input layer is given 
@@ -215,6 +274,8 @@ static MunitTest test_suite_tests[] = {
 		MUNIT_TEST_OPTION_NONE, NULL},
 	{(char*) "add_layer", test_add_layer, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
 	{(char*) "connect_net", test_connect_net, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+	{(char*) "connect_net/arena", test_connect_net_arena, NULL, NULL, 
+		MUNIT_TEST_OPTION_NONE, NULL },
 	{(char*) "connect_net/no_input_layer", test_connect_net_no_input_layer, NULL, NULL,
 		MUNIT_TEST_OPTION_NONE, NULL},
 	{(char*) "connect_net/no_output_layer", test_connect_net_no_output_layer, NULL, NULL,
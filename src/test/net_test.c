@@ -0,0 +1,702 @@
+/* pthreads */
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <pthread.h>
+#include "munit.h"
+#include "cml.h"
+#include "test-utils.h"
+#include "cml-internal.h"
+#include "matrix.h"
+#include "data-builder.h"
+
+/* Build a small connected 2-4-1 net, seeding the rng first so two nets built
+ * with the same seed start with the same weights */
+static net* _build_net(unsigned int seed);
+
+/* Build a data set holding the four xor samples */
+static data_set* _build_xor_data();
+
+/* Squared error of the net over the data set */
+static double _data_error(net* n, data_set* data);
+
+/* Build a 2-8-2 net with a LEAKY_RELU hidden layer and a SOFTMAX output */
+static net* _build_softmax_net(unsigned int seed);
+
+/* Build the xor samples with a one-hot output, (not xor, xor) */
+static data_set* _build_one_hot_xor_data();
+
+/* Thread running predict_ctx() over a data set, see test_predict_ctx() */
+static void* _predict_ctx_thread(void* arg);
+
+
+/* test_train_batched_single()
+ *
+ * 	This function tests that train_batched() with a batch size of 1 takes the
+ * 	same steps as train().
+ */
+static MunitResult
+test_train_batched_single (const MunitParameter params[], void* data) {
+
+	data_set* ds = _build_xor_data();
+	net* a = _build_net(7);
+	net* b = _build_net(7);
+
+	error_t err = train(a, ds, 50);
+	munit_assert_int((int)err, ==, (int)E_SUCCESS);
+
+	err = train_batched(b, ds, 50, 1);
+	munit_assert_int((int)err, ==, (int)E_SUCCESS);
+
+	for (int l = 1; l < a->layer_count; l++) {
+		matrix_t* wa = a->layers[l]->weights;
+		matrix_t* wb = b->layers[l]->weights;
+
+		for (unsigned int i = 0; i < wa->rows; i++)
+			for (unsigned int j = 0; j < wa->columns; j++)
+				assert_real_equal(MATRIX_AT(wa, i, j), MATRIX_AT(wb, i, j));
+		assert_real_equal(*a->layers[l]->bias, *b->layers[l]->bias);
+	}
+
+	free_net(a);
+	free_net(b);
+	free_data_set(ds);
+	return MUNIT_OK;
+}
+
+
+/* test_train_batched()
+ *
+ * 	This function tests train_batched() for:
+ * 	-> Handles NULL args and bad batch sizes
+ * 	-> Does nothing on an empty data set
+ * 	-> Lowers the error, with a batch size that leaves a smaller last batch
+ */
+static MunitResult
+test_train_batched (const MunitParameter params[], void* data) {
+
+	data_set* ds = _build_xor_data();
+	net* n = _build_net(11);
+
+	munit_assert_int((int)train_batched(NULL, ds, 1, 1), ==, (int)E_NULL_ARG);
+	munit_assert_int((int)train_batched(n, NULL, 1, 1), ==, (int)E_NULL_ARG);
+	munit_assert_int((int)train_batched(n, ds, 1, 0), ==, (int)E_INVALID_BATCH_SIZE);
+
+	/* An empty data set leaves the net as it is */
+	data_set* empty = init_data_set();
+	munit_assert_not_null(empty);
+	double start = _data_error(n, ds);
+	munit_assert_int((int)train_batched(n, empty, 5, 3), ==, (int)E_SUCCESS);
+	munit_assert_double(_data_error(n, ds), ==, start);
+	free_data_set(empty);
+
+	double before = _data_error(n, ds);
+	error_t err = train_batched(n, ds, 500, 3);
+	munit_assert_int((int)err, ==, (int)E_SUCCESS);
+	munit_assert_double(_data_error(n, ds), <, before);
+
+	free_net(n);
+	free_data_set(ds);
+	return MUNIT_OK;
+}
+
+
+/* test_train_softmax()
+ *
+ * 	This function tests a net with a LEAKY_RELU hidden layer and a SOFTMAX
+ * 	output layer:
+ * 	-> The outputs of predict() sum to 1
+ * 	-> train() and train_batched() both learn xor, apart from (0, 0)
+ */
+static MunitResult
+test_train_softmax (const MunitParameter params[], void* data) {
+
+	data_set* ds = _build_one_hot_xor_data();
+
+	for (int batched = 0; batched < 2; batched++) {
+		net* n = _build_softmax_net(5);
+
+		cml_data* out = predict(n, ds->data[0]->input);
+		munit_assert_not_null(out);
+		munit_assert_double_equal(get_value_at(out, 0) + get_value_at(out, 1), 1.0, 6);
+		free_cml_data(out);
+
+		double before = _data_error(n, ds);
+		error_t err = batched ? train_batched(n, ds, 1000, 2) : train(n, ds, 1000);
+		munit_assert_int((int)err, ==, (int)E_SUCCESS);
+
+		/* Without any bias (0, 0) always gives (0.5, 0.5), the rest is learnt */
+		munit_assert_double(before, >, 0.5);
+		munit_assert_double(_data_error(n, ds), <, 0.3);
+
+		free_net(n);
+	}
+
+	free_data_set(ds);
+	return MUNIT_OK;
+}
+
+
+/* test_preact_kept()
+ *
+ * 	After a training step every layer must still hold both z and its 
+ * 	output f(z), backprop may not overwrite either of them.
+ */
+static MunitResult
+test_preact_kept (const MunitParameter params[], void* data) {
+
+	data_set* ds = _build_xor_data();
+	net* n = _build_net(9);
+
+	/* Make the hidden layer tanh, which used to recompute tanh() on backprop */
+	get_activation_f(&n->layers[1]->actf, TANH, NULL, NULL);
+
+	munit_assert_int((int)train(n, ds, 3), ==, (int)E_SUCCESS);
+
+	for (int l = 1; l < n->layer_count; l++) {
+		layer* clayer = n->layers[l];
+		for (unsigned int i = 0; i < clayer->output->rows; i++)
+			assert_real_equal(MATRIX_AT(clayer->output, i, 0), 
+					clayer->actf.af(MATRIX_AT(clayer->preact, i, 0)));
+	}
+
+	free_net(n);
+	free_data_set(ds);
+	return MUNIT_OK;
+}
+
+
+/* test_output_delta()
+ *
+ * 	This function tests calculate_output_delta() for:
+ * 	-> Cross entropy with a sigmoid or softmax output gives output - expected,
+ * 	   and the cost stays finite, even when the output is saturated
+ * 	-> Other pairs match the cost gradient times the activation derivative
+ */
+static MunitResult
+test_output_delta (const MunitParameter params[], void* data) {
+
+	net* nets[2] = { _build_net(3), _build_softmax_net(3) };
+
+	for (int k = 0; k < 2; k++) {
+		net* n = nets[k];
+		matrix_t* z = n->layers[n->layer_count - 1]->preact;
+		matrix_t* out = n->layers[n->layer_count - 1]->output;
+		matrix_t *expected = NULL, *delta = NULL;
+		init_matrix(&expected, out->rows, 1);
+		init_matrix(&delta, out->rows, 1);
+
+		/* Saturated and as wrong as it gets */
+		for (unsigned int i = 0; i < out->rows; i++) {
+			MATRIX_AT(out, i, 0) = (i == 0) ? 1 : 0;
+			MATRIX_AT(expected, i, 0) = (i == 0) ? 0 : 1;
+		}
+
+		munit_assert_int((int)calculate_output_delta(n, z, out, expected, delta), ==, 
+				(int)E_SUCCESS);
+		for (unsigned int i = 0; i < out->rows; i++)
+			assert_real_equal(MATRIX_AT(delta, i, 0), 
+					MATRIX_AT(out, i, 0) - MATRIX_AT(expected, i, 0));
+
+		double cost = calculate_cost_func(n, expected);
+		munit_assert_true(isfinite(cost));
+		munit_assert_double(cost, >, 10);
+
+		/* The quadratic cost has no shortcut */
+		n->costf = QUADRATIC;
+		for (unsigned int i = 0; i < out->rows; i++)
+			MATRIX_AT(out, i, 0) = 0.25 + 0.5 * i;
+
+		munit_assert_int((int)calculate_output_delta(n, z, out, expected, delta), ==, 
+				(int)E_SUCCESS);
+		for (unsigned int i = 0; i < out->rows; i++) {
+			cml_real o = MATRIX_AT(out, i, 0);
+			cml_real e = MATRIX_AT(expected, i, 0);
+			cml_real grad = o - e;
+
+			/* Softmax mixes in the other outputs */
+			if (k == 1) {
+				cml_real dot = 0;
+				for (unsigned int l = 0; l < out->rows; l++)
+					dot += (MATRIX_AT(out, l, 0) - MATRIX_AT(expected, l, 0)) * MATRIX_AT(out, l, 0);
+				assert_real_equal(MATRIX_AT(delta, i, 0), o * (grad - dot));
+			} else {
+				assert_real_equal(MATRIX_AT(delta, i, 0), grad * o * (1 - o));
+			}
+		}
+
+		free_matrix(expected);
+		free_matrix(delta);
+		free_net(n);
+	}
+
+	return MUNIT_OK;
+}
+
+
+/* Build a small connected 2-4-1 net */
+static net* _build_net (unsigned int seed)
+{
+	activation_f actf;
+	get_activation_f(&actf, SIGMOID, NULL, NULL);
+
+	net* n = init_net(0.5, 0.5, CROSS_ENTROPY);
+	munit_assert_not_null(n);
+
+	munit_assert_int((int)add_layer(n, build_layer(input, 0, 2, actf)), ==, (int)E_SUCCESS);
+	munit_assert_int((int)add_layer(n, build_layer(hidden, 1, 4, actf)), ==, (int)E_SUCCESS);
+	munit_assert_int((int)add_layer(n, build_layer(output, 1, 1, actf)), ==, (int)E_SUCCESS);
+
+	srand(seed);
+	munit_assert_int((int)connect_net(n), ==, (int)E_SUCCESS);
+	return n;
+}
+
+
+/* Build a data set holding the four xor samples */
+static data_set* _build_xor_data ()
+{
+	data_set* ds = init_data_set();
+	munit_assert_not_null(ds);
+
+	for (int i = 0; i < 4; i++) {
+		cml_data* in = init_cml_data();
+		cml_data* out = init_cml_data();
+
+		for (int j = 0; j < 3; j++) {
+			double* v = malloc(sizeof(double));
+			*v = (j < 2) ? (double)((i >> j) & 1) : (double)((i & 1) ^ (i >> 1));
+			add_to_cml_data((j < 2) ? in : out, v);
+		}
+
+		/* The data set owns in and out from here on */
+		munit_assert_int((int)add_data_pair(ds, init_data_pair(in, out)), ==, (int)E_SUCCESS);
+	}
+	return ds;
+}
+
+
+/* Build a 2-8-2 net with a LEAKY_RELU hidden layer and a SOFTMAX output */
+static net* _build_softmax_net (unsigned int seed)
+{
+	activation_f hidden_actf, output_actf, input_actf;
+	get_activation_f(&input_actf, SIGMOID, NULL, NULL);
+	get_activation_f(&hidden_actf, LEAKY_RELU, NULL, NULL);
+	get_activation_f(&output_actf, SOFTMAX, NULL, NULL);
+
+	net* n = init_net(0.05, 0.5, CROSS_ENTROPY);
+	munit_assert_not_null(n);
+
+	/* No bias on the hidden layer, its update is not scaled by the learning 
+	 * rate and easily pushes every ReLU below zero */
+	munit_assert_int((int)add_layer(n, build_layer(input, 0, 2, input_actf)), ==, (int)E_SUCCESS);
+	munit_assert_int((int)add_layer(n, build_layer(hidden, 0, 8, hidden_actf)), ==, (int)E_SUCCESS);
+	munit_assert_int((int)add_layer(n, build_layer(output, 0, 2, output_actf)), ==, (int)E_SUCCESS);
+
+	srand(seed);
+	munit_assert_int((int)connect_net(n), ==, (int)E_SUCCESS);
+	return n;
+}
+
+
+/* Build the xor samples with a one-hot output, (not xor, xor) */
+static data_set* _build_one_hot_xor_data ()
+{
+	data_set* ds = init_data_set();
+	munit_assert_not_null(ds);
+
+	for (int i = 0; i < 4; i++) {
+		cml_data* in = init_cml_data();
+		cml_data* out = init_cml_data();
+		int x = (i & 1) ^ (i >> 1);
+
+		for (int j = 0; j < 4; j++) {
+			double* v = malloc(sizeof(double));
+			if (j < 2)
+				*v = (double)((i >> j) & 1);
+			else
+				*v = (double)((j == 3) == x);
+			add_to_cml_data((j < 2) ? in : out, v);
+		}
+
+		munit_assert_int((int)add_data_pair(ds, init_data_pair(in, out)), ==, (int)E_SUCCESS);
+	}
+	return ds;
+}
+
+
+/* Squared error of the net over the data set */
+static double _data_error (net* n, data_set* ds)
+{
+	double err = 0;
+
+	for (int i = 0; i < ds->count; i++) {
+		cml_data* out = predict(n, ds->data[i]->input);
+		munit_assert_not_null(out);
+
+		double diff = get_value_at(out, 0) - get_value_at(ds->data[i]->expected_output, 0);
+		err += diff * diff;
+		free_cml_data(out);
+	}
+	return err;
+}
+
+
+/* test_train_parallel()
+ *
+ * 	This function tests train_parallel() for:
+ * 	-> One share takes the same steps as train_batched()
+ * 	-> A given share count always gives the same net, close to that of 
+ * 	   train_batched(), also when a batch has fewer samples than shares
+ * 	-> Handles an invalid share count
+ * 	-> Does nothing on an empty data set
+ */
+static MunitResult
+test_train_parallel (const MunitParameter params[], void* data) {
+
+	data_set* ds = _build_xor_data();
+	net* serial = _build_net(19);
+	munit_assert_int((int)train_batched(serial, ds, 50, 3), ==, (int)E_SUCCESS);
+
+	net* single = _build_net(19);
+	munit_assert_int((int)train_parallel(single, ds, 50, 3, 1), ==, (int)E_SUCCESS);
+	munit_assert_memory_equal(sizeof(cml_real) * serial->param_count, 
+			single->params, serial->params);
+
+	/* Batches of 3 in 3 shares end each epoch with a batch of 1 */
+	net* runs[2] = { _build_net(19), _build_net(19) };
+	for (int r = 0; r < 2; r++) 
+		munit_assert_int((int)train_parallel(runs[r], ds, 50, 3, 3), ==, (int)E_SUCCESS);
+	munit_assert_memory_equal(sizeof(cml_real) * serial->param_count, 
+			runs[0]->params, runs[1]->params);
+
+	for (size_t i = 0; i < serial->param_count; i++) 
+		munit_assert_double_equal(runs[0]->params[i], serial->params[i], 5);
+
+	munit_assert_int((int)train_parallel(single, ds, 1, 3, 0), ==, 
+			(int)E_INVALID_THREAD_COUNT);
+
+	/* An empty data set leaves the net as it is, still that of serial */
+	data_set* empty = init_data_set();
+	munit_assert_not_null(empty);
+	munit_assert_int((int)train_parallel(single, empty, 5, 3, 2), ==, (int)E_SUCCESS);
+	munit_assert_memory_equal(sizeof(cml_real) * serial->param_count, 
+			single->params, serial->params);
+	free_data_set(empty);
+
+	free_net(serial);
+	free_net(single);
+	free_net(runs[0]);
+	free_net(runs[1]);
+	free_data_set(ds);
+	return MUNIT_OK;
+}
+
+
+/* test_train_parallel_threads()
+ *
+ * 	This function tests that for a given share count, train_parallel() 
+ * 	gives the same net on one thread as on four.
+ */
+static MunitResult
+test_train_parallel_threads (const MunitParameter params[], void* data) {
+
+	data_set* ds = _build_xor_data();
+	net* runs[2] = { _build_net(29), _build_net(29) };
+
+	for (int r = 0; r < 2; r++) {
+		munit_assert_int((int)set_thread_count(r ? 4 : 1), ==, (int)E_SUCCESS);
+		munit_assert_int((int)train_parallel(runs[r], ds, 50, 3, 3), ==, (int)E_SUCCESS);
+	}
+	set_thread_count(0);
+
+	munit_assert_memory_equal(sizeof(cml_real) * runs[0]->param_count, 
+			runs[0]->params, runs[1]->params);
+
+	free_net(runs[0]);
+	free_net(runs[1]);
+	free_data_set(ds);
+	return MUNIT_OK;
+}
+
+
+/* test_train_hogwild()
+ *
+ * 	This function tests train_hogwild() for:
+ * 	-> One share takes the same steps as train()
+ * 	-> Lowers the error with a share per sample
+ * 	-> Handles NULL args and an invalid share count
+ */
+static MunitResult
+test_train_hogwild (const MunitParameter params[], void* data) {
+
+	data_set* ds = _build_xor_data();
+	net* serial = _build_net(23);
+	munit_assert_int((int)train(serial, ds, 50), ==, (int)E_SUCCESS);
+
+	net* single = _build_net(23);
+	munit_assert_int((int)train_hogwild(single, ds, 50, 1), ==, (int)E_SUCCESS);
+	munit_assert_memory_equal(sizeof(cml_real) * serial->param_count,
+			single->params, serial->params);
+
+	net* n = _build_net(23);
+	double before = _data_error(n, ds);
+	munit_assert_int((int)train_hogwild(n, ds, 500, 4), ==, (int)E_SUCCESS);
+	munit_assert_double(_data_error(n, ds), <, before);
+
+	munit_assert_int((int)train_hogwild(NULL, ds, 1, 1), ==, (int)E_NULL_ARG);
+	munit_assert_int((int)train_hogwild(n, NULL, 1, 1), ==, (int)E_NULL_ARG);
+	munit_assert_int((int)train_hogwild(n, ds, 1, 0), ==, (int)E_INVALID_THREAD_COUNT);
+
+	free_net(serial);
+	free_net(single);
+	free_net(n);
+	free_data_set(ds);
+	return MUNIT_OK;
+}
+
+
+/* test_predict_into()
+ *
+ * 	This function tests predict_into() for:
+ * 	-> The output matches predict() on a sigmoid and a softmax net
+ * 	-> Handles NULL args and unconnected nets
+ */
+static MunitResult
+test_predict_into (const MunitParameter params[], void* data) {
+
+	net* nets[2] = { _build_net(17), _build_softmax_net(17) };
+	double in[2], out[2];
+
+	for (int k = 0; k < 2; k++) {
+		net* n = nets[k];
+		for (int r = 0; r < 10; r++) {
+			cml_data* input = init_cml_data();
+			for (int j = 0; j < 2; j++) {
+				double* v = malloc(sizeof(double));
+				*v = in[j] = munit_rand_double() * 4 - 2;
+				add_to_cml_data(input, v);
+			}
+
+			munit_assert_int((int)predict_into(n, in, out), ==, (int)E_SUCCESS);
+
+			cml_data* expected = predict(n, input);
+			for (int j = 0; j < n->topology[n->layer_count - 1]; j++) 
+				munit_assert_double_equal(out[j], get_value_at(expected, j), 6);
+			free_cml_data(expected);
+			free_cml_data(input);
+		}
+	}
+
+	munit_assert_int((int)predict_into(nets[0], NULL, out), ==, (int)E_NULL_ARG);
+	munit_assert_int((int)predict_into(nets[0], in, NULL), ==, (int)E_NULL_ARG);
+
+	net* unconnected = init_net(0.1, 0, QUADRATIC);
+	munit_assert_int((int)predict_into(unconnected, in, out), ==, 
+			(int)E_NET_NOT_CONNECTED);
+	free_net(unconnected);
+
+	free_net(nets[0]);
+	free_net(nets[1]);
+	return MUNIT_OK;
+}
+
+
+/* test_predict_batch()
+ *
+ * 	This function tests predict_batch() for:
+ * 	-> The outputs match predict() for each sample, on a sigmoid and a 
+ * 	   softmax net, including a count that isn't a multiple of the groups
+ * 	   the samples are run in
+ * 	-> Handles NULL args and unconnected nets
+ */
+static MunitResult
+test_predict_batch (const MunitParameter params[], void* data) {
+
+	net* nets[2] = { _build_net(13), _build_softmax_net(13) };
+	const size_t count = 600;
+	double* inputs = malloc(sizeof(double) * count * 2);
+	double* outputs = malloc(sizeof(double) * count * 2);
+
+	for (size_t i = 0; i < count * 2; i++) 
+		inputs[i] = munit_rand_double() * 4 - 2;
+
+	for (int k = 0; k < 2; k++) {
+		net* n = nets[k];
+		int out_count = n->topology[n->layer_count - 1];
+
+		munit_assert_int((int)predict_batch(n, inputs, count, outputs), ==, 
+				(int)E_SUCCESS);
+
+		for (size_t i = 0; i < count; i++) {
+			cml_data* in = init_cml_data();
+			for (int j = 0; j < 2; j++) {
+				double* v = malloc(sizeof(double));
+				*v = inputs[i * 2 + j];
+				add_to_cml_data(in, v);
+			}
+
+			cml_data* out = predict(n, in);
+			for (int j = 0; j < out_count; j++) 
+				munit_assert_double_equal(outputs[i * out_count + j], 
+						get_value_at(out, j), 6);
+			free_cml_data(out);
+			free_cml_data(in);
+		}
+	}
+
+	munit_assert_int((int)predict_batch(nets[0], inputs, 0, NULL), ==, (int)E_SUCCESS);
+	munit_assert_int((int)predict_batch(nets[0], NULL, 1, outputs), ==, (int)E_NULL_ARG);
+	munit_assert_int((int)predict_batch(NULL, inputs, 1, outputs), ==, (int)E_NULL_ARG);
+
+	net* unconnected = init_net(0.1, 0, QUADRATIC);
+	munit_assert_int((int)predict_batch(unconnected, inputs, 1, outputs), ==, 
+			(int)E_NET_NOT_CONNECTED);
+	free_net(unconnected);
+
+	free(inputs);
+	free(outputs);
+	free_net(nets[0]);
+	free_net(nets[1]);
+	return MUNIT_OK;
+}
+
+
+/* Arguments of _predict_ctx_thread() */
+typedef struct predict_ctx_args {
+	net* n;
+	data_set* ds;
+	double* expected; // Output of predict() for each sample, in order
+	int mismatches;
+} predict_ctx_args;
+
+
+/* test_predict_ctx()
+ *
+ * 	This function tests predict_ctx() for:
+ * 	-> Several threads sharing one net each get the same outputs as predict()
+ * 	-> A context doesn't run on a net of another topology, or a wrong input
+ */
+static MunitResult
+test_predict_ctx (const MunitParameter params[], void* data) {
+
+	enum { THREADS = 4 };
+	net* nets[2] = { _build_net(11), _build_softmax_net(11) };
+	data_set* sets[2] = { _build_xor_data(), _build_one_hot_xor_data() };
+
+	for (int k = 0; k < 2; k++) {
+		munit_assert_int((int)train(nets[k], sets[k], 20), ==, (int)E_SUCCESS);
+
+		int outputs = nets[k]->topology[nets[k]->layer_count - 1];
+		double* expected = malloc(sizeof(double) * sets[k]->count * outputs);
+		for (int i = 0; i < sets[k]->count; i++) {
+			cml_data* out = predict(nets[k], sets[k]->data[i]->input);
+			for (int j = 0; j < outputs; j++) 
+				expected[i * outputs + j] = get_value_at(out, j);
+			free_cml_data(out);
+		}
+
+		pthread_t threads[THREADS];
+		predict_ctx_args args[THREADS];
+		for (int t = 0; t < THREADS; t++) {
+			args[t] = (predict_ctx_args){ nets[k], sets[k], expected, 0 };
+			munit_assert_int(pthread_create(&threads[t], NULL, _predict_ctx_thread, 
+						&args[t]), ==, 0);
+		}
+		for (int t = 0; t < THREADS; t++) {
+			pthread_join(threads[t], NULL);
+			munit_assert_int(args[t].mismatches, ==, 0);
+		}
+		free(expected);
+	}
+
+	/* 2-4-1 and 2-8-2 don't match */
+	inference_ctx* ctx = init_inference_ctx(nets[0]);
+	munit_assert_not_null(ctx);
+	munit_assert_null(predict_ctx(ctx, nets[1], sets[1]->data[0]->input));
+	munit_assert_null(predict_ctx(ctx, nets[0], sets[0]->data[0]->expected_output));
+	munit_assert_null(predict_ctx(NULL, nets[0], sets[0]->data[0]->input));
+	munit_assert_int((int)free_inference_ctx(ctx), ==, (int)E_SUCCESS);
+
+	for (int k = 0; k < 2; k++) {
+		free_net(nets[k]);
+		free_data_set(sets[k]);
+	}
+	return MUNIT_OK;
+}
+
+
+/* Run predict_ctx() over the data set a few times with a context of its 
+ * own, counting outputs that differ from predict() */
+static void* _predict_ctx_thread (void* arg)
+{
+	predict_ctx_args* a = arg;
+	inference_ctx* ctx = init_inference_ctx(a->n);
+	int outputs = a->n->topology[a->n->layer_count - 1];
+
+	if (ctx == NULL) {
+		a->mismatches = -1;
+		return NULL;
+	}
+
+	for (int r = 0; r < 200; r++) {
+		for (int i = 0; i < a->ds->count; i++) {
+			cml_data* out = predict_ctx(ctx, a->n, a->ds->data[i]->input);
+			if (out == NULL) {
+				a->mismatches++;
+				continue;
+			}
+			for (int j = 0; j < outputs; j++) 
+				if (fabs(get_value_at(out, j) - a->expected[i * outputs + j]) > 1e-6)
+					a->mismatches++;
+			free_cml_data(out);
+		}
+	}
+
+	free_inference_ctx(ctx);
+	return NULL;
+}
+
+
+/* Set up the test suite */
+static MunitTest test_suite_tests[] = {
+	{(char*) "train_batched/single", test_train_batched_single, NULL, NULL,
+		MUNIT_TEST_OPTION_NONE, NULL},
+	{(char*) "train_batched", test_train_batched, NULL, NULL,
+		MUNIT_TEST_OPTION_NONE, NULL},
+	{(char*) "train/softmax", test_train_softmax, NULL, NULL,
+		MUNIT_TEST_OPTION_NONE, NULL},
+	{(char*) "output_delta", test_output_delta, NULL, NULL,
+		MUNIT_TEST_OPTION_NONE, NULL},
+	{(char*) "preact", test_preact_kept, NULL, NULL,
+		MUNIT_TEST_OPTION_NONE, NULL},
+	{(char*) "train_parallel", test_train_parallel, NULL, NULL,
+		MUNIT_TEST_OPTION_NONE, NULL},
+	{(char*) "train_parallel/threads", test_train_parallel_threads, NULL, NULL,
+		MUNIT_TEST_OPTION_NONE, NULL},
+	{(char*) "train_hogwild", test_train_hogwild, NULL, NULL,
+		MUNIT_TEST_OPTION_NONE, NULL},
+	{(char*) "predict_into", test_predict_into, NULL, NULL,
+		MUNIT_TEST_OPTION_NONE, NULL},
+	{(char*) "predict_batch", test_predict_batch, NULL, NULL,
+		MUNIT_TEST_OPTION_NONE, NULL},
+	{(char*) "predict_ctx", test_predict_ctx, NULL, NULL,
+		MUNIT_TEST_OPTION_NONE, NULL},
+	{NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL}
+};
+
+/* Declare test suite */
+static const MunitSuite test_suite = {
+	(char*) "net/",
+	test_suite_tests,
+	NULL,
+	1,
+	MUNIT_SUITE_OPTION_NONE
+};
+
+
+int main (int argc, char* argv[MUNIT_ARRAY_PARAM(argc + 1)]) {
+	return munit_suite_main(&test_suite, (void*) "munit", argc, argv);
+}
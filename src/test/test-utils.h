@@ -0,0 +1,20 @@
+#ifndef _TEST_UTILS_H_
+#define _TEST_UTILS_H_
+
+#include "munit.h"
+#include "cml.h"
+
+/* Number of digits computed values are compared to, float only holds about 
+ * 7 and loses some of those over long sums */
+#ifdef CML_SINGLE_PRECISION
+#	define REAL_DIGITS 3
+#else
+#	define REAL_DIGITS 9
+#endif
+
+/* munit_assert_double_equal() to REAL_DIGITS digits. munit pastes the digit
+ * count into a literal, so it has to be expanded a level before that */
+#define assert_real_equal(a, b) assert_real_equal_(a, b, REAL_DIGITS)
+#define assert_real_equal_(a, b, digits) munit_assert_double_equal(a, b, digits)
+
+#endif
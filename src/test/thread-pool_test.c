@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "munit.h"
+#include "cml.h"
+#include "thread-pool.h"
+
+/* Counts how many times each index is visited, see _count_range() */
+typedef struct visit_counts {
+	size_t begin;
+	int* counts;
+	size_t fail_at; // Ranges holding this index fail
+} visit_counts;
+
+/* Range of pool_parallel_for() that adds one to each of its indices */
+static error_t _count_range(void* arg, size_t begin, size_t end);
+
+/* Fork-join task working out a fibonacci number, see _fib() */
+typedef struct fib_task {
+	int n;
+	long result;
+} fib_task;
+
+/* Task for pool_spawn() working out the fibonacci number of a fib_task */
+static void _fib(void* arg);
+
+
+/* test_thread_count()
+ *
+ * 	This function tests set_thread_count() and get_thread_count() for:
+ * 	-> The count set is the size of the pool
+ * 	-> 0 goes back to the default, which is at least 1
+ * 	-> Handles a negative count
+ */
+static MunitResult
+test_thread_count (const MunitParameter params[], void* data) {
+
+	munit_assert_int((int)set_thread_count(3), ==, (int)E_SUCCESS);
+	munit_assert_int(get_thread_count(), ==, 3);
+	munit_assert_int(pool_size(), ==, 3);
+
+	munit_assert_int((int)set_thread_count(0), ==, (int)E_SUCCESS);
+	munit_assert_int(get_thread_count(), >=, 1);
+	munit_assert_int(pool_size(), ==, get_thread_count());
+
+	munit_assert_int((int)set_thread_count(-1), ==, (int)E_INVALID_THREAD_COUNT);
+	munit_assert_int(pool_worker_id(), ==, -1);
+	return MUNIT_OK;
+}
+
+
+/* test_parallel_for()
+ *
+ * 	This function tests pool_parallel_for() for:
+ * 	-> Every index is visited exactly once, for any pool size and grain
+ * 	-> Empty ranges do nothing
+ * 	-> The error of the first failing range is returned
+ */
+static MunitResult
+test_parallel_for (const MunitParameter params[], void* data) {
+
+	size_t sizes[] = { 1, 7, 1000, 100003 };
+	size_t grains[] = { 1, 64, 5000 };
+	int threads[] = { 1, 2, 5 };
+
+	for (int t = 0; t < 3; t++) {
+		munit_assert_int((int)set_thread_count(threads[t]), ==, (int)E_SUCCESS);
+
+		for (int s = 0; s < 4; s++) {
+			for (int g = 0; g < 3; g++) {
+				visit_counts v = { 10, calloc(sizes[s], sizeof(int)), (size_t)-1 };
+				error_t err = pool_parallel_for(10, 10 + sizes[s], grains[g],
+						_count_range, &v);
+				munit_assert_int((int)err, ==, (int)E_SUCCESS);
+
+				for (size_t i = 0; i < sizes[s]; i++)
+					munit_assert_int(v.counts[i], ==, 1);
+				free(v.counts);
+			}
+		}
+
+		visit_counts v = { 0, NULL, (size_t)-1 };
+		munit_assert_int((int)pool_parallel_for(5, 5, 1, _count_range, &v), ==,
+				(int)E_SUCCESS);
+
+		v.counts = calloc(1000, sizeof(int));
+		v.fail_at = 500;
+		munit_assert_int((int)pool_parallel_for(0, 1000, 1, _count_range, &v), ==,
+				(int)E_FAILURE);
+		free(v.counts);
+	}
+
+	set_thread_count(0);
+	return MUNIT_OK;
+}
+
+
+/* test_fork_join()
+ *
+ * 	This function tests pool_spawn() and pool_wait() with tasks that spawn
+ * 	and wait for tasks of their own, on pools of a few sizes.
+ */
+static MunitResult
+test_fork_join (const MunitParameter params[], void* data) {
+
+	int threads[] = { 1, 2, 4 };
+
+	for (int t = 0; t < 3; t++) {
+		munit_assert_int((int)set_thread_count(threads[t]), ==, (int)E_SUCCESS);
+
+		fib_task task = { 20, 0 };
+		_fib(&task);
+		munit_assert_long(task.result, ==, 6765);
+	}
+
+	set_thread_count(0);
+	return MUNIT_OK;
+}
+
+
+/* _count_range() */
+static error_t _count_range (void* arg, size_t begin, size_t end)
+{
+	visit_counts* v = arg;
+
+	for (size_t i = begin; i < end; i++)
+		v->counts[i - v->begin]++;
+	return (v->fail_at >= begin && v->fail_at < end) ? E_FAILURE : E_SUCCESS;
+}
+
+
+/* _fib() */
+static void _fib (void* arg)
+{
+	fib_task* task = arg;
+
+	if (task->n < 2) {
+		task->result = task->n;
+		return;
+	}
+
+	pool_group g = POOL_GROUP_INIT;
+	fib_task a = { task->n - 1, 0 };
+	fib_task b = { task->n - 2, 0 };
+	pool_spawn(&g, _fib, &a);
+	_fib(&b);
+	pool_wait(&g);
+	task->result = a.result + b.result;
+}
+
+
+/* Setup the test suite */
+static MunitTest test_suite_tests[] = {
+	{(char*) "thread_count", test_thread_count, NULL, NULL,
+		MUNIT_TEST_OPTION_NONE, NULL},
+	{(char*) "parallel_for", test_parallel_for, NULL, NULL,
+		MUNIT_TEST_OPTION_NONE, NULL},
+	{(char*) "fork_join", test_fork_join, NULL, NULL,
+		MUNIT_TEST_OPTION_NONE, NULL},
+	{NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL}
+};
+
+/* Declare test suite */
+static const MunitSuite test_suite = {
+	(char*) "thread-pool/",
+	test_suite_tests,
+	NULL,
+	1,
+	MUNIT_SUITE_OPTION_NONE
+};
+
+
+int main (int argc, char* argv[MUNIT_ARRAY_PARAM(argc + 1)]) {
+	return munit_suite_main(&test_suite, (void*) "munit", argc, argv);
+}